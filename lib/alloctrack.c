@@ -0,0 +1,260 @@
+#ifdef ALLOC_TRACK
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloctrack.h"
+
+// The allocator underneath, glibc exports it under these names
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+struct phase_stats
+{
+	const char *name; // NULL for a free entry
+	long ops, allocs, frees, bytes;
+};
+
+struct site_stats
+{
+	void *site; // NULL for a free entry
+	const char *phase;
+	long allocs, bytes;
+};
+
+// Entry 0 is the phase of code that is in none, everything is updated with
+// atomics and nothing here allocates
+static struct phase_stats phases[ALLOC_TRACK_PHASES] = {{"(none)"}};
+static struct site_stats sites[ALLOC_TRACK_SITES];
+static long lost_sites; // Allocations from sites that found the table full
+
+// Phases the thread is in, innermost last
+static __thread const char *phase_stack[ALLOC_TRACK_DEPTH];
+static __thread int phase_depth;
+static __thread const char *current_phase;
+
+static struct phase_stats *phase_of(const char *name)
+{
+	if (name == NULL)
+		return &phases[0];
+
+	for (int i = 1; i < ALLOC_TRACK_PHASES; i++)
+	{
+		const char *entry = __atomic_load_n(&phases[i].name, __ATOMIC_ACQUIRE);
+		if (entry == NULL)
+		{
+			const char *expected = NULL;
+			if (__atomic_compare_exchange_n(&phases[i].name, &expected, name, false,
+											__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+				expected == name)
+				return &phases[i];
+			continue;
+		}
+		if (entry == name)
+			return &phases[i];
+	}
+	return &phases[0];
+}
+
+// Open addressing on the return address
+static struct site_stats *site_of(void *site)
+{
+	unsigned int slot = ((uintptr_t)site >> 4) * 2654435761u % ALLOC_TRACK_SITES;
+
+	for (int i = 0; i < ALLOC_TRACK_SITES; i++, slot = (slot + 1) % ALLOC_TRACK_SITES)
+	{
+		void *entry = __atomic_load_n(&sites[slot].site, __ATOMIC_ACQUIRE);
+		if (entry == NULL)
+		{
+			void *expected = NULL;
+			if (__atomic_compare_exchange_n(&sites[slot].site, &expected, site, false,
+											__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+				expected == site)
+			{
+				sites[slot].phase = current_phase;
+				return &sites[slot];
+			}
+			continue;
+		}
+		if (entry == site)
+			return &sites[slot];
+	}
+	return NULL;
+}
+
+// Stats of every phase around the calling thread, a phase entered again
+// inside itself only once
+static int current_phases(struct phase_stats **out)
+{
+	int depth = phase_depth < ALLOC_TRACK_DEPTH ? phase_depth : ALLOC_TRACK_DEPTH;
+	int n = 0;
+
+	if (depth == 0)
+		out[n++] = &phases[0];
+	for (int i = 0; i < depth; i++)
+	{
+		bool seen = false;
+		for (int j = 0; j < i && !seen; j++)
+			seen = phase_stack[j] == phase_stack[i];
+		if (!seen)
+			out[n++] = phase_of(phase_stack[i]);
+	}
+	return n;
+}
+
+static void count_alloc(void *site, size_t size)
+{
+	struct phase_stats *in[ALLOC_TRACK_DEPTH];
+	int n_in = current_phases(in);
+	for (int i = 0; i < n_in; i++)
+	{
+		__atomic_add_fetch(&in[i]->allocs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&in[i]->bytes, size, __ATOMIC_RELAXED);
+	}
+
+	struct site_stats *stats = site_of(site);
+	if (stats == NULL)
+	{
+		__atomic_add_fetch(&lost_sites, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_add_fetch(&stats->allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->bytes, size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	count_alloc(__builtin_return_address(0), size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	count_alloc(__builtin_return_address(0), n * size);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	count_alloc(__builtin_return_address(0), size);
+	return __libc_realloc(ptr, size);
+}
+
+// Errors go in the return value, *ptr is left alone on failure
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	if (alignment == 0 || alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+
+	count_alloc(__builtin_return_address(0), size);
+	void *mem = __libc_memalign(alignment, size);
+	if (mem == NULL)
+		return ENOMEM;
+	*ptr = mem;
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	count_alloc(__builtin_return_address(0), size);
+	return __libc_memalign(alignment, size);
+}
+
+void free(void *ptr)
+{
+	if (ptr != NULL)
+	{
+		struct phase_stats *in[ALLOC_TRACK_DEPTH];
+		int n_in = current_phases(in);
+		for (int i = 0; i < n_in; i++)
+			__atomic_add_fetch(&in[i]->frees, 1, __ATOMIC_RELAXED);
+	}
+	__libc_free(ptr);
+}
+
+const char *alloc_phase_begin(const char *name)
+{
+	const char *prev = current_phase;
+	current_phase = name;
+	if (phase_depth < ALLOC_TRACK_DEPTH)
+		phase_stack[phase_depth] = name;
+	phase_depth++;
+	__atomic_add_fetch(&phase_of(name)->ops, 1, __ATOMIC_RELAXED);
+	return prev;
+}
+
+void alloc_phase_end(const char *prev)
+{
+	current_phase = prev;
+	phase_depth--;
+}
+
+long alloc_count(const char *name)
+{
+	for (int i = 1; i < ALLOC_TRACK_PHASES; i++)
+	{
+		const char *entry = __atomic_load_n(&phases[i].name, __ATOMIC_ACQUIRE);
+		if (entry != NULL && strcmp(entry, name) == 0)
+			return __atomic_load_n(&phases[i].allocs, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+static int by_allocs(const void *a, const void *b)
+{
+	long x = ((const struct site_stats *)a)->allocs, y = ((const struct site_stats *)b)->allocs;
+	return (x < y) - (x > y);
+}
+
+void alloc_report(FILE *out)
+{
+	// Copied first, the report itself must not count
+	static struct site_stats top[ALLOC_TRACK_SITES];
+	int n_top = 0;
+
+	// A phase includes the phases nested in it
+	fprintf(out, "%-16s %10s %10s %10s %12s %10s\n", "phase", "ops", "allocs", "frees", "bytes", "allocs/op");
+	for (int i = 0; i < ALLOC_TRACK_PHASES; i++)
+	{
+		struct phase_stats p = phases[i];
+		if (p.name == NULL || (p.ops == 0 && p.allocs == 0))
+			continue;
+		fprintf(out, "%-16s %10ld %10ld %10ld %12ld %10.2f\n", p.name, p.ops, p.allocs, p.frees, p.bytes,
+				p.ops > 0 ? (double)p.allocs / p.ops : 0.0);
+	}
+
+	for (int i = 0; i < ALLOC_TRACK_SITES; i++)
+	{
+		if (sites[i].site != NULL)
+			top[n_top++] = sites[i];
+	}
+	qsort(top, n_top, sizeof(top[0]), by_allocs);
+
+	// Offsets into the object are what addr2line -e takes
+	fprintf(out, "\n%10s %12s  %-16s %s\n", "allocs", "bytes", "first phase", "call site");
+	for (int i = 0; i < n_top && i < 20; i++)
+	{
+		Dl_info info;
+		if (dladdr(top[i].site, &info) != 0 && info.dli_fname != NULL)
+			fprintf(out, "%10ld %12ld  %-16s %s+%#lx %s\n", top[i].allocs, top[i].bytes,
+					top[i].phase != NULL ? top[i].phase : "(none)", info.dli_fname,
+					(unsigned long)((char *)top[i].site - (char *)info.dli_fbase),
+					info.dli_sname != NULL ? info.dli_sname : "");
+		else
+			fprintf(out, "%10ld %12ld  %-16s %p\n", top[i].allocs, top[i].bytes,
+					top[i].phase != NULL ? top[i].phase : "(none)", top[i].site);
+	}
+	if (lost_sites > 0)
+		fprintf(out, "%10ld allocations from sites past the first %d\n", lost_sites, ALLOC_TRACK_SITES);
+	fflush(out);
+}
+
+#endif
@@ -0,0 +1,38 @@
+#include <stdio.h>
+
+// Allocation tracking build mode (make ALLOC_TRACK=1): malloc and friends are
+// interposed and every allocation is counted against the call site that made
+// it and the phase its thread is in. Phases are named by the code paths that
+// want to know what they allocate, each time one is entered counts as one
+// operation, so the report gives allocations per move, per broadcast and so
+// on. Phases nest: an allocation counts for the phase the thread is in and
+// for every phase around it, so a phase covers everything done inside it.
+// Without the build mode the phase markers compile to nothing
+#define ALLOC_TRACK_PHASES 32
+#define ALLOC_TRACK_SITES 4096
+// Deepest nesting of phases, the ones past it count for their parents
+#define ALLOC_TRACK_DEPTH 8
+
+#ifdef ALLOC_TRACK
+#define ALLOC_PHASE_BEGIN(name) const char *alloc_prev_phase = alloc_phase_begin(name)
+#define ALLOC_PHASE_END() alloc_phase_end(alloc_prev_phase)
+#define ALLOC_REPORT(out) alloc_report(out)
+#define ALLOC_COUNT(name) alloc_count(name)
+#else
+#define ALLOC_PHASE_BEGIN(name)
+#define ALLOC_PHASE_END()
+#define ALLOC_REPORT(out)
+#define ALLOC_COUNT(name) (-1L)
+#endif
+
+// Enters a phase of the calling thread (name must be a string literal or live
+// as long), returns the phase it was in
+const char *alloc_phase_begin(const char *name);
+// Goes back to the phase the thread was in
+void alloc_phase_end(const char *prev);
+
+// Writes the allocations of every phase and the busiest call sites
+void alloc_report(FILE *out);
+
+// Allocations made so far in a phase, -1 without the build mode
+long alloc_count(const char *name);
@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitboard.h"
+
+static inline bool test_bit(const struct bitboard *bb, int cell)
+{
+	return (__atomic_load_n(&bb->words[cell / 64], __ATOMIC_RELAXED) >> (cell % 64)) & 1;
+}
+
+// Mask of the bits [from, to] of a word
+static inline uint64_t bit_range(int from, int to)
+{
+	uint64_t high = to == 63 ? ~0ULL : (1ULL << (to + 1)) - 1;
+	return high & ~((1ULL << from) - 1);
+}
+
+// Position of the k-th zero bit of a word, which has more than k of them
+static int select_zero(uint64_t word, int k)
+{
+	uint64_t zeros = ~word;
+	while (k-- > 0)
+		zeros &= zeros - 1;
+	return __builtin_ctzll(zeros);
+}
+
+void bitboard_init(struct bitboard *bb, int width, int height)
+{
+	int n_cells = width * height;
+
+	bb->width = width;
+	bb->height = height;
+	bb->n_words = (n_cells + 63) / 64;
+	bb->n_blocks = (bb->n_words + BITBOARD_BLOCK_WORDS - 1) / BITBOARD_BLOCK_WORDS;
+	bb->words = calloc(bb->n_words, sizeof(uint64_t));
+	bb->block_count = calloc(bb->n_blocks, sizeof(int));
+	bb->count = 0;
+
+	// The bits past the last cell are set, they are never free
+	if (n_cells % 64 != 0)
+		bb->words[bb->n_words - 1] = ~bit_range(0, n_cells % 64 - 1);
+}
+
+void bitboard_destroy(struct bitboard *bb)
+{
+	free(bb->words);
+	free(bb->block_count);
+}
+
+void bitboard_set(struct bitboard *bb, int x, int y)
+{
+	int cell = y * bb->width + x;
+	uint64_t bit = 1ULL << (cell % 64);
+
+	if (__atomic_fetch_or(&bb->words[cell / 64], bit, __ATOMIC_RELAXED) & bit)
+		return;
+
+	__atomic_add_fetch(&bb->block_count[cell / 64 / BITBOARD_BLOCK_WORDS], 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&bb->count, 1, __ATOMIC_RELAXED);
+}
+
+void bitboard_clear(struct bitboard *bb, int x, int y)
+{
+	int cell = y * bb->width + x;
+	uint64_t bit = 1ULL << (cell % 64);
+
+	if (!(__atomic_fetch_and(&bb->words[cell / 64], ~bit, __ATOMIC_RELAXED) & bit))
+		return;
+
+	__atomic_sub_fetch(&bb->block_count[cell / 64 / BITBOARD_BLOCK_WORDS], 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&bb->count, 1, __ATOMIC_RELAXED);
+}
+
+bool bitboard_test(const struct bitboard *bb, int x, int y)
+{
+	if (x < 0 || x >= bb->width || y < 0 || y >= bb->height)
+		return true;
+
+	return test_bit(bb, y * bb->width + x);
+}
+
+int bitboard_count_free(const struct bitboard *bb)
+{
+	return bb->width * bb->height - __atomic_load_n(&bb->count, __ATOMIC_RELAXED);
+}
+
+int bitboard_nth_free(const struct bitboard *bb, int k)
+{
+	if (k < 0)
+		return -1;
+
+	// Whole blocks first, then whole words
+	int block = 0;
+	for (; block < bb->n_blocks; block++)
+	{
+		int first = block * BITBOARD_BLOCK_WORDS;
+		int n_words = bb->n_words - first < BITBOARD_BLOCK_WORDS ? bb->n_words - first : BITBOARD_BLOCK_WORDS;
+		int n_free = n_words * 64 - bb->block_count[block];
+
+		// The padding of the last word counts as set but is not in the count
+		if (block == bb->n_blocks - 1)
+			n_free -= bb->n_words * 64 - bb->width * bb->height;
+
+		if (k < n_free)
+			break;
+		k -= n_free;
+	}
+	if (block == bb->n_blocks)
+		return -1;
+
+	for (int word = block * BITBOARD_BLOCK_WORDS; word < bb->n_words; word++)
+	{
+		uint64_t bits = __atomic_load_n(&bb->words[word], __ATOMIC_RELAXED);
+		int n_free = 64 - __builtin_popcountll(bits);
+
+		if (k < n_free)
+			return word * 64 + select_zero(bits, k);
+		k -= n_free;
+	}
+	return -1;
+}
+
+int bitboard_free_in_rect(const struct bitboard *bb, int x0, int y0, int x1, int y1, int *cells, int max)
+{
+	int n_free = 0;
+
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 >= bb->width ? bb->width - 1 : x1;
+	y1 = y1 >= bb->height ? bb->height - 1 : y1;
+
+	for (int y = y0; y <= y1; y++)
+	{
+		// A row of the rectangle is a run of bits, taken a word at a time
+		int from = y * bb->width + x0;
+		int to = y * bb->width + x1;
+
+		while (from <= to)
+		{
+			int word = from / 64;
+			int last = to / 64 == word ? to % 64 : 63;
+			uint64_t zeros = ~__atomic_load_n(&bb->words[word], __ATOMIC_RELAXED) & bit_range(from % 64, last);
+
+			if (cells == NULL || n_free >= max)
+			{
+				n_free += __builtin_popcountll(zeros);
+			}
+			else
+			{
+				for (; zeros != 0; zeros &= zeros - 1)
+				{
+					if (n_free < max)
+						cells[n_free] = word * 64 + __builtin_ctzll(zeros);
+					n_free++;
+				}
+			}
+
+			from = (word + 1) * 64;
+		}
+	}
+	return n_free;
+}
+
+unsigned int bitboard_neighbors(const struct bitboard *bb, int x, int y)
+{
+	return (bitboard_test(bb, x, y - 1) ? BB_UP : 0) |
+		   (bitboard_test(bb, x, y + 1) ? BB_DOWN : 0) |
+		   (bitboard_test(bb, x - 1, y) ? BB_LEFT : 0) |
+		   (bitboard_test(bb, x + 1, y) ? BB_RIGHT : 0);
+}
@@ -0,0 +1,47 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+// Occupancy of a board, one bit per cell (cell = y * width + x), for the
+// queries that only need to know whether cells are empty. Words are grouped
+// in blocks that keep how many of their bits are set, so picking the k-th free
+// cell skips whole blocks at once and stays cheap on boards with millions of
+// cells. Setting and clearing are atomic, threads writing different cells may
+// share words
+#define BITBOARD_BLOCK_WORDS 64
+
+// Bits of bitboard_neighbors()
+#define BB_UP 0x1
+#define BB_DOWN 0x2
+#define BB_LEFT 0x4
+#define BB_RIGHT 0x8
+
+struct bitboard
+{
+	int width, height;
+	int n_words, n_blocks;
+	uint64_t *words;
+	int *block_count; // Set bits in each block
+	int count;		  // Set bits in the whole board
+};
+
+void bitboard_init(struct bitboard *bb, int width, int height);
+void bitboard_destroy(struct bitboard *bb);
+
+void bitboard_set(struct bitboard *bb, int x, int y);
+void bitboard_clear(struct bitboard *bb, int x, int y);
+bool bitboard_test(const struct bitboard *bb, int x, int y);
+
+// Free cells in the whole board
+int bitboard_count_free(const struct bitboard *bb);
+
+// Cell of the k-th free cell (from 0, in cell order), -1 if there are not
+// that many
+int bitboard_nth_free(const struct bitboard *bb, int k);
+
+// Free cells in the rectangle [x0, x1] x [y0, y1] (inclusive), the first max
+// of them are written to cells (may be NULL) in cell order
+int bitboard_free_in_rect(const struct bitboard *bb, int x0, int y0, int x1, int y1, int *cells, int max);
+
+// BB_* bits of the neighbors of a cell that are set, cells off the board
+// count as set
+unsigned int bitboard_neighbors(const struct bitboard *bb, int x, int y);
@@ -1,17 +1,114 @@
 #include "board.h"
 #include <curses.h>
+#include <pthread.h>
 
-void draw(WINDOW *win, ball_info_t ball, bool delete)
+// Windows the batched draws can touch between two flushes
+#define MAX_DIRTY_WINS 4
+
+// Cells drawn since the last board_flush(), only the last draw of each cell
+// is kept
+static bool batching;
+static pthread_mutex_t board_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct
+{
+	WINDOW *win;
+	char ch;
+	bool dirty;
+} cells[WINDOW_SIZE][WINDOW_SIZE];
+static int dirty_cells[WINDOW_SIZE * WINDOW_SIZE];
+static int n_dirty_cells;
+static WINDOW *dirty_wins[MAX_DIRTY_WINS];
+static int n_dirty_wins;
+
+// Lines of the stats window as last drawn by update_top_stats()
+static WINDOW *stats_win;
+static ball_info_t stats_lines[MAX_STATS_LINES];
+static int n_stats_lines;
+
+// Caller holds board_mtx
+static void mark_window(WINDOW *win)
 {
-	if (delete)
+	for (int i = 0; i < n_dirty_wins; i++)
+	{
+		if (dirty_wins[i] == win)
+			return;
+	}
+
+	if (n_dirty_wins == MAX_DIRTY_WINS)
 	{
-		mvwaddch(win, ball.pos_y, ball.pos_x, ' ');
+		wnoutrefresh(win);
+		return;
 	}
-	else
+	dirty_wins[n_dirty_wins++] = win;
+}
+
+void board_batch(bool batch)
+{
+	pthread_mutex_lock(&board_mtx);
+	batching = batch;
+	pthread_mutex_unlock(&board_mtx);
+
+	if (!batch)
+		board_flush();
+}
+
+// Caller holds board_mtx
+static void flush()
+{
+	if (n_dirty_cells == 0 && n_dirty_wins == 0)
+		return;
+
+	for (int i = 0; i < n_dirty_cells; i++)
 	{
-		mvwaddch(win, ball.pos_y, ball.pos_x, ball.ch);
+		int x = dirty_cells[i] / WINDOW_SIZE;
+		int y = dirty_cells[i] % WINDOW_SIZE;
+
+		mvwaddch(cells[x][y].win, y, x, cells[x][y].ch);
+		mark_window(cells[x][y].win);
+		cells[x][y].dirty = false;
 	}
-	wrefresh(win);
+	n_dirty_cells = 0;
+
+	// One update of the physical screen for everything drawn in the frame
+	for (int i = 0; i < n_dirty_wins; i++)
+		wnoutrefresh(dirty_wins[i]);
+	n_dirty_wins = 0;
+	doupdate();
+}
+
+void board_flush()
+{
+	pthread_mutex_lock(&board_mtx);
+	flush();
+	pthread_mutex_unlock(&board_mtx);
+}
+
+void draw(WINDOW *win, ball_info_t ball, bool delete)
+{
+	char ch = delete ? ' ' : ball.ch;
+
+	if (!batching || ball.pos_x < 0 || ball.pos_x >= WINDOW_SIZE ||
+		ball.pos_y < 0 || ball.pos_y >= WINDOW_SIZE)
+	{
+		mvwaddch(win, ball.pos_y, ball.pos_x, ch);
+		wrefresh(win);
+		return;
+	}
+
+	pthread_mutex_lock(&board_mtx);
+
+	// A cell drawn twice in the same frame (a move away and back, a delete
+	// and an add) is only drawn once, with its final contents
+	if (cells[ball.pos_x][ball.pos_y].dirty && cells[ball.pos_x][ball.pos_y].win != win)
+		flush();
+	if (!cells[ball.pos_x][ball.pos_y].dirty)
+		dirty_cells[n_dirty_cells++] = ball.pos_x * WINDOW_SIZE + ball.pos_y;
+
+	cells[ball.pos_x][ball.pos_y].win = win;
+	cells[ball.pos_x][ball.pos_y].ch = ch;
+	cells[ball.pos_x][ball.pos_y].dirty = true;
+
+	pthread_mutex_unlock(&board_mtx);
 }
 
 void move_ball(WINDOW *win, ball_info_t *ball, direction_t dir)
@@ -60,8 +157,36 @@ void add_ball(WINDOW *win, ball_info_t *ball) { draw(win, *ball, false); }
 
 void delete_ball(WINDOW *win, ball_info_t *ball) { draw(win, *ball, true); }
 
+// Shared by both stats functions, refreshes the window unless batching
+static void refresh_stats(WINDOW *win)
+{
+	if (!batching)
+	{
+		wrefresh(win);
+		return;
+	}
+
+	pthread_mutex_lock(&board_mtx);
+	mark_window(win);
+	pthread_mutex_unlock(&board_mtx);
+}
+
+void clear_stats(WINDOW *win)
+{
+	// The next update_top_stats() draws every line again
+	if (win == stats_win)
+		stats_win = NULL;
+
+	werase(win);
+	box(win, 0, 0);
+}
+
 void update_stats(WINDOW *win, ball_info_t players[])
 {
+	// The whole window is drawn again
+	if (win == stats_win)
+		stats_win = NULL;
+
 	werase(win);
 	box(win, 0, 0);
 	int line = 0;
@@ -73,5 +198,46 @@ void update_stats(WINDOW *win, ball_info_t players[])
 			line++;
 		}
 	}
-	wrefresh(win);
+
+	refresh_stats(win);
+}
+
+void update_top_stats(WINDOW *win, ball_info_t top[], int n_top)
+{
+	int max_lines = getmaxy(win) - 2;
+	if (max_lines > MAX_STATS_LINES)
+		max_lines = MAX_STATS_LINES;
+	if (n_top > max_lines)
+		n_top = max_lines;
+
+	// Start from a clean window the first time
+	if (win != stats_win)
+	{
+		werase(win);
+		box(win, 0, 0);
+		stats_win = win;
+		n_stats_lines = 0;
+	}
+
+	// Only the lines that changed are drawn
+	bool changed = false;
+	for (int i = 0; i < n_top || i < n_stats_lines; i++)
+	{
+		if (i >= n_top)
+		{
+			mvwprintw(win, i + 1, 1, "%-6s", "");
+			changed = true;
+			continue;
+		}
+		if (i < n_stats_lines && stats_lines[i].ch == top[i].ch && stats_lines[i].hp == top[i].hp)
+			continue;
+
+		mvwprintw(win, i + 1, 1, "%c %-4d", top[i].ch, top[i].hp);
+		stats_lines[i] = top[i];
+		changed = true;
+	}
+	n_stats_lines = n_top;
+
+	if (changed)
+		refresh_stats(win);
 }
@@ -1,28 +1,23 @@
 #include <ncurses.h>
 
-#define WINDOW_SIZE 20 // Window size
+#include "world.h"
 
-// Direction
-typedef enum direction
-{
-	NONE,
-	UP,
-	DOWN,
-	LEFT,
-	RIGHT
-} direction_t;
+#define MAX_STATS_LINES (2 * WINDOW_SIZE) // Lines of the stats window
 
-// Player information
-typedef struct ball_info
-{
-	int pos_x;
-	int pos_y;
-	int hp;
-	char ch;
-} ball_info_t;
+// Draw functions refresh the window right away unless batching is on, then
+// they only mark the cells dirty and board_flush() draws them all with a
+// single update of the screen
+void board_batch(bool batch);
+void board_flush();
 
 void move_ball(WINDOW *win, ball_info_t *player, direction_t dir);
 void add_ball(WINDOW *win, ball_info_t *player);
 void delete_ball(WINDOW *win, ball_info_t *player);
 
 void update_stats(WINDOW *win, ball_info_t players[]);
+// Blanks a stats window written to by hand, so update_top_stats() does not
+// rely on what it drew there before
+void clear_stats(WINDOW *win);
+// Draws the players (already ranked) of a scoreboard, only repainting the
+// lines that changed since the last call
+void update_top_stats(WINDOW *win, ball_info_t top[], int n_top);
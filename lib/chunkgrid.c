@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunkgrid.h"
+
+void chunk_grid_init(struct chunk_grid *grid, int width, int height)
+{
+	memset(grid, 0, sizeof(*grid));
+	grid->width = width;
+	grid->height = height;
+
+	if (width * height <= CHUNK_GRID_DENSE_CELLS)
+	{
+		grid->dense = malloc(width * height * sizeof(int));
+		memset(grid->dense, -1, width * height * sizeof(int));
+		return;
+	}
+
+	grid->chunks_x = (width + CHUNK_GRID_SIZE - 1) / CHUNK_GRID_SIZE;
+	grid->chunks_y = (height + CHUNK_GRID_SIZE - 1) / CHUNK_GRID_SIZE;
+	grid->chunks = calloc(grid->chunks_x * grid->chunks_y, sizeof(struct grid_chunk *));
+	grid->emptied = malloc(grid->chunks_x * grid->chunks_y * sizeof(int));
+}
+
+void chunk_grid_destroy(struct chunk_grid *grid)
+{
+	chunk_grid_clear(grid);
+	free(grid->dense);
+	free(grid->chunks);
+	free(grid->emptied);
+}
+
+void chunk_grid_clear(struct chunk_grid *grid)
+{
+	if (grid->dense != NULL)
+	{
+		memset(grid->dense, -1, grid->width * grid->height * sizeof(int));
+		return;
+	}
+
+	for (int i = 0; i < grid->chunks_x * grid->chunks_y; i++)
+	{
+		free(grid->chunks[i]);
+		grid->chunks[i] = NULL;
+	}
+	grid->n_emptied = 0;
+	grid->n_allocated = 0;
+}
+
+// Chunk of a cell, allocated if it is not there yet (NULL without memory).
+// Threads racing for the same chunk keep whichever got in the directory first
+static struct grid_chunk *chunk_for(struct chunk_grid *grid, int chunk_id)
+{
+	struct grid_chunk *chunk = __atomic_load_n(&grid->chunks[chunk_id], __ATOMIC_ACQUIRE);
+	if (chunk != NULL)
+		return chunk;
+
+	struct grid_chunk *fresh = malloc(sizeof(struct grid_chunk));
+	if (fresh == NULL)
+		return NULL;
+
+	fresh->used = 0;
+	fresh->queued = false;
+	memset(fresh->cells, -1, sizeof(fresh->cells));
+
+	if (__atomic_compare_exchange_n(&grid->chunks[chunk_id], &chunk, fresh, false,
+									__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+		__atomic_add_fetch(&grid->n_allocated, 1, __ATOMIC_RELAXED);
+		return fresh;
+	}
+
+	free(fresh);
+	return chunk;
+}
+
+bool chunk_grid_set(struct chunk_grid *grid, int x, int y, int value)
+{
+	if (grid->dense != NULL)
+	{
+		grid->dense[y * grid->width + x] = value;
+		return true;
+	}
+
+	int chunk_id = (y >> CHUNK_GRID_SHIFT) * grid->chunks_x + (x >> CHUNK_GRID_SHIFT);
+	struct grid_chunk *chunk = value == -1 ? grid->chunks[chunk_id] : chunk_for(grid, chunk_id);
+
+	// Emptying a cell of a chunk that is not there changes nothing, filling
+	// one whose chunk could not be allocated cannot
+	if (chunk == NULL)
+		return value == -1;
+
+	int *cell = &chunk->cells[(y & (CHUNK_GRID_SIZE - 1)) * CHUNK_GRID_SIZE + (x & (CHUNK_GRID_SIZE - 1))];
+	int old = *cell;
+	*cell = value;
+
+	if (old == -1 && value != -1)
+	{
+		__atomic_add_fetch(&chunk->used, 1, __ATOMIC_RELAXED);
+	}
+	else if (old != -1 && value == -1 && __atomic_sub_fetch(&chunk->used, 1, __ATOMIC_RELAXED) == 0)
+	{
+		// Left for chunk_grid_release(), it may be filled again before
+		if (!__atomic_exchange_n(&chunk->queued, true, __ATOMIC_RELAXED))
+			grid->emptied[__atomic_fetch_add(&grid->n_emptied, 1, __ATOMIC_RELAXED)] = chunk_id;
+	}
+	return true;
+}
+
+void chunk_grid_release(struct chunk_grid *grid)
+{
+	for (int i = 0; i < grid->n_emptied; i++)
+	{
+		int chunk_id = grid->emptied[i];
+		struct grid_chunk *chunk = grid->chunks[chunk_id];
+
+		chunk->queued = false;
+		if (chunk->used == 0)
+		{
+			free(chunk);
+			grid->chunks[chunk_id] = NULL;
+			grid->n_allocated--;
+		}
+	}
+	grid->n_emptied = 0;
+}
+
+long chunk_grid_bytes(const struct chunk_grid *grid)
+{
+	if (grid->dense != NULL)
+		return (long)grid->width * grid->height * sizeof(int);
+
+	return (long)grid->chunks_x * grid->chunks_y * sizeof(struct grid_chunk *) +
+		   (long)grid->n_allocated * sizeof(struct grid_chunk);
+}
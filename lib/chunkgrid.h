@@ -0,0 +1,62 @@
+#include <stdbool.h>
+#include <stddef.h>
+
+// Grid of ints, -1 for an empty cell. Boards of up to CHUNK_GRID_DENSE_CELLS
+// cells are one dense array. Bigger ones are split in CHUNK_GRID_SIZE x
+// CHUNK_GRID_SIZE chunks that are only allocated while some cell of theirs is
+// not empty, found through a directory, so memory follows what is on the
+// board and not its area.
+//
+// Cells can be set from several threads at once as long as they are
+// different ones. Chunks that got empty are only freed by
+// chunk_grid_release(), which must not run at the same time as anything else
+#define CHUNK_GRID_SHIFT 4
+#define CHUNK_GRID_SIZE (1 << CHUNK_GRID_SHIFT)
+#define CHUNK_GRID_DENSE_CELLS (128 * 128)
+
+struct grid_chunk
+{
+	int used;	 // Cells that are not empty
+	bool queued; // In the list of chunks to check for release
+	int cells[CHUNK_GRID_SIZE * CHUNK_GRID_SIZE];
+};
+
+struct chunk_grid
+{
+	int width, height;
+	int *dense; // NULL if chunked
+
+	int chunks_x, chunks_y;
+	struct grid_chunk **chunks;
+	int *emptied; // Chunks that got empty since the last release
+	int n_emptied;
+	int n_allocated;
+};
+
+void chunk_grid_init(struct chunk_grid *grid, int width, int height);
+void chunk_grid_destroy(struct chunk_grid *grid);
+
+// Empties every cell
+void chunk_grid_clear(struct chunk_grid *grid);
+
+static inline int chunk_grid_get(const struct chunk_grid *grid, int x, int y)
+{
+	if (grid->dense != NULL)
+		return grid->dense[y * grid->width + x];
+
+	struct grid_chunk *chunk = __atomic_load_n(
+		&grid->chunks[(y >> CHUNK_GRID_SHIFT) * grid->chunks_x + (x >> CHUNK_GRID_SHIFT)], __ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+		return -1;
+	return chunk->cells[(y & (CHUNK_GRID_SIZE - 1)) * CHUNK_GRID_SIZE + (x & (CHUNK_GRID_SIZE - 1))];
+}
+
+// Returns false, leaving the cell empty, if it needed a chunk and there was
+// no memory for one
+bool chunk_grid_set(struct chunk_grid *grid, int x, int y, int value);
+
+// Frees the chunks that got empty
+void chunk_grid_release(struct chunk_grid *grid);
+
+// Bytes the cells take at the moment
+long chunk_grid_bytes(const struct chunk_grid *grid);
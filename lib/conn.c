@@ -0,0 +1,155 @@
+#include "conn.h"
+#include "shm_ring.h"
+#include "uring.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+ssize_t conn_send(conn_t *conn, const void *buf, size_t len)
+{
+	if (conn->shm != NULL)
+		return shm_send(conn->shm, buf, len);
+
+	if (conn->uring != NULL)
+	{
+		ssize_t nbytes = uring_io_send(conn->uring, buf, len);
+		uring_io_flush();
+		return nbytes;
+	}
+
+	const char *ptr = buf;
+	size_t nbytes = 0;
+
+	// This guarantees that all the data is sent
+	while (nbytes < len)
+	{
+		ssize_t n = send(conn->fd, ptr + nbytes, len - nbytes, MSG_NOSIGNAL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		nbytes += n;
+	}
+	return nbytes;
+}
+
+ssize_t conn_try_send(conn_t *conn, const void *buf, size_t len)
+{
+	if (conn->shm != NULL)
+		return shm_try_send(conn->shm, buf, len);
+
+	// io_uring takes everything, so only hand it more once it sent what it had
+	if (conn->uring != NULL)
+	{
+		ssize_t pending = uring_io_pending(conn->uring);
+		if (pending != 0)
+			return pending == -1 ? -1 : 0;
+		return uring_io_send(conn->uring, buf, len);
+	}
+
+	ssize_t n;
+	do
+	{
+		n = send(conn->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	return n;
+}
+
+ssize_t conn_try_sendv(conn_t *conn, const struct iovec *iov, int iovcnt)
+{
+	// The other backends copy into their own buffers anyway
+	if (conn->shm != NULL || conn->uring != NULL)
+	{
+		ssize_t nbytes = 0;
+		for (int i = 0; i < iovcnt; i++)
+		{
+			ssize_t n = conn_try_send(conn, iov[i].iov_base, iov[i].iov_len);
+			if (n == -1)
+				return nbytes > 0 ? nbytes : -1;
+			nbytes += n;
+			if (n < (ssize_t)iov[i].iov_len)
+				break;
+		}
+		return nbytes;
+	}
+
+	struct msghdr msg = {0};
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+
+	ssize_t n;
+	do
+	{
+		n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (n == -1 && errno == EINTR);
+
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	return n;
+}
+
+ssize_t conn_send_batched(conn_t *conn, const void *buf, size_t len)
+{
+	if (conn->uring != NULL)
+		return uring_io_send(conn->uring, buf, len);
+
+	return conn_send(conn, buf, len);
+}
+
+void conn_flush()
+{
+	if (uring_io_enabled())
+		uring_io_flush();
+}
+
+ssize_t conn_recv(conn_t *conn, void *buf, size_t len)
+{
+	if (conn->shm != NULL)
+		return shm_recv(conn->shm, buf, len);
+
+	if (conn->uring != NULL)
+		return uring_io_recv(conn->uring, buf, len);
+
+	char *ptr = buf;
+	size_t nbytes = 0;
+
+	// This guarantees all the data is received using socket streams
+	while (nbytes < len)
+	{
+		ssize_t n = recv(conn->fd, ptr + nbytes, len - nbytes, 0);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == 0)
+			return nbytes > 0 ? -1 : 0;
+		if (n == -1)
+			return -1;
+		nbytes += n;
+	}
+	return nbytes;
+}
+
+void conn_close(conn_t *conn)
+{
+	if (conn->shm != NULL)
+		shm_channel_shutdown(conn->shm);
+	else if (conn->uring != NULL)
+		uring_io_close(conn->uring);
+	else
+		shutdown(conn->fd, SHUT_RDWR);
+}
+
+void conn_free(conn_t *conn)
+{
+	if (conn->shm != NULL)
+		shm_channel_destroy(conn->shm);
+	else if (conn->uring != NULL)
+		uring_io_free(conn->uring); // Closes the socket once the ring is done with it
+	else
+		close(conn->fd);
+	conn->shm = NULL;
+	conn->uring = NULL;
+	conn->fd = -1;
+}
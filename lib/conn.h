@@ -0,0 +1,32 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// A connection to a peer, either a stream socket or a shared memory channel
+// Both carry exactly the same byte stream
+typedef struct conn
+{
+	int fd;					 // Stream socket (control socket for shared memory)
+	struct shm_channel *shm; // NULL for stream sockets
+	struct uring_conn *uring; // Set when the socket is driven through io_uring
+} conn_t;
+
+// Sends/receives all the len bytes, returning len, 0 if the peer closed the
+// connection (receive only) or -1 on error
+ssize_t conn_send(conn_t *conn, const void *buf, size_t len);
+ssize_t conn_recv(conn_t *conn, void *buf, size_t len);
+
+// Sends what can be sent without blocking, returning the bytes sent (0 if
+// the connection cannot take anything right now) or -1 on error
+ssize_t conn_try_send(conn_t *conn, const void *buf, size_t len);
+// Same for a gather list, stream sockets send it with a single sendmsg()
+ssize_t conn_try_sendv(conn_t *conn, const struct iovec *iov, int iovcnt);
+
+// Like conn_send(), but backends that can batch (io_uring) only queue the
+// data until the next conn_flush(), which submits everything queued at once
+ssize_t conn_send_batched(conn_t *conn, const void *buf, size_t len);
+void conn_flush();
+
+// Closing wakes up whoever is blocked on the connection, the resources only
+// go away with conn_free(), once nobody is using the connection any more
+void conn_close(conn_t *conn);
+void conn_free(conn_t *conn);
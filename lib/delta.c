@@ -0,0 +1,69 @@
+#include "world.h"
+#include "delta.h"
+#include <string.h>
+
+#define N_CELLS (WINDOW_SIZE * WINDOW_SIZE)
+
+void board_state_set(struct board_state *state, const ball_info_t *ball)
+{
+	if (ball->pos_x < 0 || ball->pos_x >= WINDOW_SIZE ||
+		ball->pos_y < 0 || ball->pos_y >= WINDOW_SIZE)
+		return;
+
+	int cell = ball->pos_y * WINDOW_SIZE + ball->pos_x;
+	state->ch[cell] = ball->ch;
+	state->hp[cell] = ball->hp;
+}
+
+int delta_encode(const struct board_state *base, const struct board_state *cur, unsigned char *out)
+{
+	int len = 0;
+
+	for (int cell = 0; cell < N_CELLS; cell++)
+	{
+		if (cur->ch[cell] == base->ch[cell] && cur->hp[cell] == base->hp[cell])
+			continue;
+
+		out[len++] = cell & 0xFF;
+		out[len++] = cell >> 8;
+		out[len++] = cur->ch[cell];
+		out[len++] = cur->hp[cell];
+	}
+
+	return len;
+}
+
+int delta_apply(struct board_state *state, const unsigned char *in, int len)
+{
+	if (len % 4 != 0)
+		return -1;
+
+	for (int offset = 0; offset < len; offset += 4)
+	{
+		int cell = in[offset] | (in[offset + 1] << 8);
+		if (cell >= N_CELLS)
+			return -1;
+
+		state->ch[cell] = in[offset + 2];
+		state->hp[cell] = in[offset + 3];
+	}
+
+	return 0;
+}
+
+struct board_state *delta_find(struct delta_history *history, unsigned int seq)
+{
+	int slot = seq % DELTA_HISTORY;
+
+	if (seq == 0 || history->seq[slot] != seq)
+		return NULL;
+	return &history->state[slot];
+}
+
+void delta_store(struct delta_history *history, unsigned int seq, const struct board_state *state)
+{
+	int slot = seq % DELTA_HISTORY;
+
+	history->seq[slot] = seq;
+	history->state[slot] = *state;
+}
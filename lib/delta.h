@@ -0,0 +1,34 @@
+// State of every cell of the board, ch 0 is an empty cell
+struct board_state
+{
+	unsigned char ch[WINDOW_SIZE * WINDOW_SIZE];
+	unsigned char hp[WINDOW_SIZE * WINDOW_SIZE];
+};
+
+// A delta is a list of the cells that changed, each one as 4 bytes: the cell
+// index (y * WINDOW_SIZE + x, 2 bytes little endian), ch and hp
+#define DELTA_MAX_BYTES (4 * WINDOW_SIZE * WINDOW_SIZE)
+
+// Number of past states kept on each end, deltas are only ever encoded
+// against one of them
+#define DELTA_HISTORY 16
+
+struct delta_history
+{
+	unsigned int seq[DELTA_HISTORY]; // 0 for an unused slot
+	struct board_state state[DELTA_HISTORY];
+};
+
+void board_state_set(struct board_state *state, const ball_info_t *ball);
+
+// Encodes the cells of cur that differ from base into out, which must hold
+// DELTA_MAX_BYTES, returns the bytes used
+int delta_encode(const struct board_state *base, const struct board_state *cur, unsigned char *out);
+
+// Applies len bytes of delta to state, returns -1 if the data is malformed
+int delta_apply(struct board_state *state, const unsigned char *in, int len);
+
+// State stored for seq, NULL if it is not (or no longer) in the history
+struct board_state *delta_find(struct delta_history *history, unsigned int seq);
+// Stores state as the one for seq, replacing the oldest one
+void delta_store(struct delta_history *history, unsigned int seq, const struct board_state *state);
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitboard.h"
+#include "flowfield.h"
+
+void flow_init(struct flow_field *ff, int width, int height)
+{
+	ff->width = width;
+	ff->height = height;
+	ff->dist = malloc(width * height * sizeof(int));
+	ff->step = malloc(width * height);
+	ff->mark = calloc(width * height, sizeof(unsigned int));
+	ff->search = 0;
+	ff->queue = malloc(width * height * sizeof(int));
+}
+
+void flow_destroy(struct flow_field *ff)
+{
+	free(ff->dist);
+	free(ff->step);
+	free(ff->mark);
+	free(ff->queue);
+}
+
+// Labels a cell reached from a neighbor, step is the way back to it. Returns
+// true if the search goes on from the cell
+static inline bool reach(struct flow_field *ff, const struct bitboard *blocked, int cell, int dist, unsigned int step)
+{
+	if (ff->mark[cell] == ff->search)
+		return false;
+
+	ff->mark[cell] = ff->search;
+	ff->dist[cell] = dist;
+	ff->step[cell] = step;
+
+	return !bitboard_test(blocked, cell % ff->width, cell / ff->width);
+}
+
+void flow_build(struct flow_field *ff, const struct bitboard *blocked, const int *targets, int n_targets)
+{
+	// Marks from before a wrap around could look current
+	if (++ff->search == 0)
+	{
+		memset(ff->mark, 0, ff->width * ff->height * sizeof(unsigned int));
+		ff->search = 1;
+	}
+
+	int head = 0, tail = 0;
+
+	for (int i = 0; i < n_targets; i++)
+	{
+		int cell = targets[i];
+		if (ff->mark[cell] == ff->search)
+			continue;
+
+		ff->mark[cell] = ff->search;
+		ff->dist[cell] = 0;
+		ff->step[cell] = 0;
+		ff->queue[tail++] = cell;
+	}
+
+	while (head < tail)
+	{
+		int cell = ff->queue[head++];
+		int x = cell % ff->width, y = cell / ff->width;
+		int dist = ff->dist[cell] + 1;
+
+		// The step of a neighbor points back to this cell
+		if (y > 0 && reach(ff, blocked, cell - ff->width, dist, BB_DOWN))
+			ff->queue[tail++] = cell - ff->width;
+		if (y < ff->height - 1 && reach(ff, blocked, cell + ff->width, dist, BB_UP))
+			ff->queue[tail++] = cell + ff->width;
+		if (x > 0 && reach(ff, blocked, cell - 1, dist, BB_RIGHT))
+			ff->queue[tail++] = cell - 1;
+		if (x < ff->width - 1 && reach(ff, blocked, cell + 1, dist, BB_LEFT))
+			ff->queue[tail++] = cell + 1;
+	}
+}
+
+unsigned int flow_step(const struct flow_field *ff, int x, int y)
+{
+	int cell = y * ff->width + x;
+	return ff->mark[cell] == ff->search ? ff->step[cell] : 0;
+}
+
+int flow_distance(const struct flow_field *ff, int x, int y)
+{
+	int cell = y * ff->width + x;
+	return ff->mark[cell] == ff->search ? ff->dist[cell] : -1;
+}
@@ -0,0 +1,30 @@
+// Distances to the nearest of a set of target cells, from a single
+// breadth-first search started at all of them at once, and the first step of
+// the way for every cell. One search serves any number of chasers, each of
+// them only reads its own cell. Uses the BB_* bits and the cell numbering of
+// bitboard.h
+
+struct flow_field
+{
+	int width, height;
+	int *dist;			 // Steps to the nearest target, valid if marked
+	unsigned char *step; // BB_* bit of the neighbor one step closer
+	unsigned int *mark;	 // Search that reached each cell
+	unsigned int search; // Current search, so cells need no clearing
+	int *queue;
+};
+
+void flow_init(struct flow_field *ff, int width, int height);
+void flow_destroy(struct flow_field *ff);
+
+// Searches from the target cells. Cells set in blocked (other than the
+// targets) are reached, so chasers standing on them get a step, but the
+// search does not go through them
+void flow_build(struct flow_field *ff, const struct bitboard *blocked, const int *targets, int n_targets);
+
+// BB_* bit of the way to the nearest target from a cell, 0 if no target can
+// be reached or the cell is one
+unsigned int flow_step(const struct flow_field *ff, int x, int y);
+
+// Steps from a cell to the nearest target, -1 if none can be reached
+int flow_distance(const struct flow_field *ff, int x, int y);
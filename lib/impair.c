@@ -0,0 +1,107 @@
+#include "impair.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define IMPAIR_MAX_DGRAM 65536
+
+static pthread_mutex_t mux_impair = PTHREAD_MUTEX_INITIALIZER;
+static int initialized;
+static int loss, dup, reorder;
+static unsigned int seed;
+
+// Datagram held back to be delivered out of order
+static struct held_dgram
+{
+	int valid;
+	int fd;
+	int flags;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	size_t len;
+	char data[IMPAIR_MAX_DGRAM];
+} held;
+
+static int env_percent(const char *name)
+{
+	char *value = getenv(name);
+	if (value == NULL)
+		return 0;
+
+	int percent = atoi(value);
+	return percent < 0 ? 0 : percent > 100 ? 100 : percent;
+}
+
+static void impair_init()
+{
+	loss = env_percent("CHASE_UDP_LOSS");
+	dup = env_percent("CHASE_UDP_DUP");
+	reorder = env_percent("CHASE_UDP_REORDER");
+
+	char *value = getenv("CHASE_UDP_SEED");
+	seed = value != NULL ? atoi(value) : time(NULL);
+
+	initialized = 1;
+}
+
+static int roll(int percent) { return percent > 0 && rand_r(&seed) % 100 < percent; }
+
+static void release_held()
+{
+	if (!held.valid)
+		return;
+
+	sendto(held.fd, held.data, held.len, held.flags,
+		   held.addr_len ? (struct sockaddr *)&held.addr : NULL, held.addr_len);
+	held.valid = 0;
+}
+
+ssize_t impair_sendto(int fd, const void *buf, size_t len, int flags,
+					  const struct sockaddr *addr, socklen_t addr_len)
+{
+	pthread_mutex_lock(&mux_impair);
+
+	if (!initialized)
+		impair_init();
+
+	// Fast path when no impairment is configured
+	if (loss == 0 && dup == 0 && reorder == 0)
+	{
+		pthread_mutex_unlock(&mux_impair);
+		return sendto(fd, buf, len, flags, addr, addr_len);
+	}
+
+	// A lost datagram still looks sent to the caller
+	if (roll(loss))
+	{
+		pthread_mutex_unlock(&mux_impair);
+		return len;
+	}
+
+	// Hold this datagram back so it is delivered after the next one
+	if (!held.valid && len <= IMPAIR_MAX_DGRAM && roll(reorder))
+	{
+		held.fd = fd;
+		held.flags = flags;
+		held.addr_len = addr != NULL ? addr_len : 0;
+		if (addr != NULL)
+			memcpy(&held.addr, addr, addr_len);
+		held.len = len;
+		memcpy(held.data, buf, len);
+		held.valid = 1;
+
+		pthread_mutex_unlock(&mux_impair);
+		return len;
+	}
+
+	ssize_t nbytes = sendto(fd, buf, len, flags, addr, addr_len);
+	if (roll(dup))
+		sendto(fd, buf, len, flags, addr, addr_len);
+
+	release_held();
+
+	pthread_mutex_unlock(&mux_impair);
+	return nbytes;
+}
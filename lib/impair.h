@@ -0,0 +1,12 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+
+// Datagram send that goes through a local network impairment shim.
+// The impairment is configured with environment variables (all in percent):
+//   CHASE_UDP_LOSS    - datagrams silently dropped
+//   CHASE_UDP_DUP     - datagrams sent twice
+//   CHASE_UDP_REORDER - datagrams held back and sent after the next one
+// and CHASE_UDP_SEED to make the loss pattern reproducible.
+// Without any of them set it behaves exactly like sendto().
+ssize_t impair_sendto(int fd, const void *buf, size_t len, int flags,
+					  const struct sockaddr *addr, socklen_t addr_len);
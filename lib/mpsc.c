@@ -0,0 +1,82 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mpsc.h"
+
+// Slots are kept a cache line apart, producers writing neighbouring slots do
+// not share lines
+#define MPSC_LINE 64
+
+static atomic_ulong *slot_seq(struct mpsc *q, unsigned long pos)
+{
+	return (atomic_ulong *) &q->slots[(pos & q->mask) * q->slot_size];
+}
+
+static void *slot_data(struct mpsc *q, unsigned long pos)
+{
+	return &q->slots[(pos & q->mask) * q->slot_size + sizeof(atomic_ulong)];
+}
+
+void mpsc_init(struct mpsc *q, unsigned long n_slots, size_t item_size)
+{
+	q->mask = n_slots - 1;
+	q->item_size = item_size;
+	q->slot_size = (sizeof(atomic_ulong) + item_size + MPSC_LINE - 1) / MPSC_LINE * MPSC_LINE;
+	q->slots = aligned_alloc(MPSC_LINE, n_slots * q->slot_size);
+	q->head = 0;
+	atomic_init(&q->tail, 0);
+
+	// Slot i is free for the producer that claims position i
+	for (unsigned long i = 0; i < n_slots; i++)
+		atomic_init(slot_seq(q, i), i);
+}
+
+bool mpsc_push(struct mpsc *q, const void *item)
+{
+	unsigned long pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+	while (1)
+	{
+		unsigned long seq = atomic_load_explicit(slot_seq(q, pos), memory_order_acquire);
+		long diff = (long)(seq - pos);
+
+		// Free, try to claim it (pos is reloaded if another producer did)
+		if (diff == 0)
+		{
+			if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+													  memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		// Still holds the item of the previous lap
+		else if (diff < 0)
+		{
+			return false;
+		}
+		// Claimed by someone else already
+		else
+		{
+			pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+		}
+	}
+
+	memcpy(slot_data(q, pos), item, q->item_size);
+	atomic_store_explicit(slot_seq(q, pos), pos + 1, memory_order_release);
+	return true;
+}
+
+bool mpsc_pop(struct mpsc *q, void *item)
+{
+	unsigned long pos = q->head;
+	unsigned long seq = atomic_load_explicit(slot_seq(q, pos), memory_order_acquire);
+
+	// Not published yet, a claimed slot holds up the ones after it
+	if (seq != pos + 1)
+		return false;
+
+	memcpy(item, slot_data(q, pos), q->item_size);
+
+	// Free for the producer of the next lap
+	atomic_store_explicit(slot_seq(q, pos), pos + q->mask + 1, memory_order_release);
+	q->head = pos + 1;
+	return true;
+}
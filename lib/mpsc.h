@@ -0,0 +1,26 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Bounded multi-producer single-consumer queue of fixed size items, without
+// locks. Every slot carries a sequence number saying whose turn it is:
+// producers claim a slot by moving the tail with a compare and swap and then
+// publish it by bumping its sequence, the consumer takes the slots in the
+// order they were claimed. Indexes run freely and are masked on access
+struct mpsc
+{
+	_Alignas(64) atomic_ulong tail; // Next slot to claim, shared by the producers
+	_Alignas(64) unsigned long head; // Next slot to take, consumer only
+	unsigned long mask;
+	size_t item_size, slot_size;
+	char *slots;
+};
+
+// n_slots must be a power of 2
+void mpsc_init(struct mpsc *q, unsigned long n_slots, size_t item_size);
+
+// Returns false if the queue is full
+bool mpsc_push(struct mpsc *q, const void *item);
+
+// Returns false if no published item is waiting (consumer only)
+bool mpsc_pop(struct mpsc *q, void *item);
@@ -0,0 +1,90 @@
+#include <limits.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+static void *pool_worker(void *arg)
+{
+	struct pool *p = arg;
+
+	while (1)
+	{
+		/* Critical region pool start */
+		pthread_mutex_lock(&p->lock);
+		while (p->n_jobs == 0)
+			pthread_cond_wait(&p->wake, &p->lock);
+
+		struct pool_job job = p->jobs[p->head];
+		p->head = (p->head + 1) % p->n_workers;
+		p->n_jobs--;
+		pthread_mutex_unlock(&p->lock);
+		/* Critical region pool end */
+
+		job.run(job.arg);
+
+		pthread_mutex_lock(&p->lock);
+		p->n_idle++;
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	return NULL;
+}
+
+bool pool_init(struct pool *p, int n_workers, size_t stack_bytes)
+{
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	p->n_workers = n_workers;
+	p->n_idle = 0;
+	p->jobs = calloc(n_workers, sizeof(struct pool_job));
+	p->head = 0;
+	p->n_jobs = 0;
+
+	if (stack_bytes < POOL_MIN_STACK_BYTES)
+		stack_bytes = POOL_MIN_STACK_BYTES;
+	if (stack_bytes < PTHREAD_STACK_MIN)
+		stack_bytes = PTHREAD_STACK_MIN;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, stack_bytes);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	// Workers only count as idle once they exist
+	for (int i = 0; i < n_workers; i++)
+	{
+		pthread_t thread;
+		if (pthread_create(&thread, &attr, pool_worker, p) != 0)
+		{
+			pthread_attr_destroy(&attr);
+			return false;
+		}
+
+		pthread_mutex_lock(&p->lock);
+		p->n_idle++;
+		pthread_mutex_unlock(&p->lock);
+	}
+
+	pthread_attr_destroy(&attr);
+	return true;
+}
+
+bool pool_submit(struct pool *p, void *(*run)(void *arg), void *arg)
+{
+	/* Critical region pool start */
+	pthread_mutex_lock(&p->lock);
+	if (p->n_idle == 0)
+	{
+		pthread_mutex_unlock(&p->lock);
+		return false;
+	}
+
+	p->jobs[(p->head + p->n_jobs) % p->n_workers] = (struct pool_job){run, arg};
+	p->n_jobs++;
+	p->n_idle--;
+	pthread_cond_signal(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+	/* Critical region pool end */
+
+	return true;
+}
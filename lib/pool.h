@@ -0,0 +1,35 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Fixed set of worker threads, all started up front with small stacks, that
+// take long running jobs (a connection each) and go back to waiting when a
+// job returns. A job is only taken if a worker is free to run it right away,
+// so the number of workers is a hard limit on the jobs running at once and
+// threads, stacks included, are reused instead of made per job
+struct pool_job
+{
+	void *(*run)(void *arg);
+	void *arg;
+};
+
+struct pool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	int n_workers;
+	int n_idle; // Workers waiting, minus the jobs handed to them
+
+	// Jobs handed over and not picked up yet, at most n_workers of them
+	struct pool_job *jobs;
+	int head, n_jobs;
+};
+
+// Smallest stack a worker gets, whatever is asked for
+#define POOL_MIN_STACK_BYTES (64 * 1024)
+
+// Returns false if the workers could not be started
+bool pool_init(struct pool *p, int n_workers, size_t stack_bytes);
+
+// Hands a job to a free worker, returns false if every worker is busy
+bool pool_submit(struct pool *p, void *(*run)(void *arg), void *arg);
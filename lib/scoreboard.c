@@ -0,0 +1,89 @@
+#include "world.h"
+#include "scoreboard.h"
+#include <stdlib.h>
+
+void scoreboard_init(struct scoreboard *sb, int n_ids, int max_hp)
+{
+	sb->n_ids = n_ids;
+	sb->max_hp = max_hp;
+	sb->head = malloc((max_hp + 1) * sizeof(int));
+	sb->next = malloc(n_ids * sizeof(int));
+	sb->prev = malloc(n_ids * sizeof(int));
+	sb->entry = calloc(n_ids, sizeof(ball_info_t));
+	sb->present = calloc(n_ids, sizeof(bool));
+
+	for (int hp = 0; hp <= max_hp; hp++)
+		sb->head[hp] = -1;
+}
+
+void scoreboard_clear(struct scoreboard *sb)
+{
+	for (int hp = 0; hp <= sb->max_hp; hp++)
+		sb->head[hp] = -1;
+	for (int id = 0; id < sb->n_ids; id++)
+		sb->present[id] = false;
+}
+
+static int clamp_hp(struct scoreboard *sb, int hp)
+{
+	return hp < 0 ? 0 : hp > sb->max_hp ? sb->max_hp : hp;
+}
+
+static void unlink_id(struct scoreboard *sb, int id)
+{
+	int hp = clamp_hp(sb, sb->entry[id].hp);
+
+	if (sb->prev[id] != -1)
+		sb->next[sb->prev[id]] = sb->next[id];
+	else
+		sb->head[hp] = sb->next[id];
+	if (sb->next[id] != -1)
+		sb->prev[sb->next[id]] = sb->prev[id];
+
+	sb->present[id] = false;
+}
+
+void scoreboard_set(struct scoreboard *sb, int id, const ball_info_t *ball)
+{
+	if (id < 0 || id >= sb->n_ids)
+		return;
+
+	// Same list, nothing to move
+	if (sb->present[id] && clamp_hp(sb, sb->entry[id].hp) == clamp_hp(sb, ball->hp))
+	{
+		sb->entry[id] = *ball;
+		return;
+	}
+
+	if (sb->present[id])
+		unlink_id(sb, id);
+
+	int hp = clamp_hp(sb, ball->hp);
+
+	sb->entry[id] = *ball;
+	sb->prev[id] = -1;
+	sb->next[id] = sb->head[hp];
+	if (sb->head[hp] != -1)
+		sb->prev[sb->head[hp]] = id;
+	sb->head[hp] = id;
+	sb->present[id] = true;
+}
+
+void scoreboard_remove(struct scoreboard *sb, int id)
+{
+	if (id >= 0 && id < sb->n_ids && sb->present[id])
+		unlink_id(sb, id);
+}
+
+int scoreboard_top(struct scoreboard *sb, int k, ball_info_t *top)
+{
+	int n = 0;
+
+	for (int hp = sb->max_hp; hp >= 0 && n < k; hp--)
+	{
+		for (int id = sb->head[hp]; id != -1 && n < k; id = sb->next[id])
+			top[n++] = sb->entry[id];
+	}
+
+	return n;
+}
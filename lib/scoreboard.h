@@ -0,0 +1,24 @@
+#include <stdbool.h>
+
+// Players ranked by hp, kept up to date one change at a time: one list per
+// hp value, so moving a player to another list and reading the top K are
+// both independent of how many players there are
+struct scoreboard
+{
+	int n_ids, max_hp;
+	int *head;		  // First id of each hp list, -1 if empty
+	int *next, *prev; // Links of each id in its list
+	ball_info_t *entry;
+	bool *present;
+};
+
+void scoreboard_init(struct scoreboard *sb, int n_ids, int max_hp);
+void scoreboard_clear(struct scoreboard *sb);
+
+// Adds or updates the entry of id (any int below n_ids)
+void scoreboard_set(struct scoreboard *sb, int id, const ball_info_t *ball);
+void scoreboard_remove(struct scoreboard *sb, int id);
+
+// Copies the (at most k) entries with the highest hp to top, returns how
+// many there were
+int scoreboard_top(struct scoreboard *sb, int k, ball_info_t *top);
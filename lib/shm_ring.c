@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include "shm_ring.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+// Number of times a side polls the ring before going to sleep on the eventfd
+#define SHM_SPIN 2000
+
+#define SHM_N_FDS 5 // memfd + 2 eventfds per ring
+
+// Ring 0 goes from the client to the server and ring 1 the other way around
+struct shm_region
+{
+	struct shm_ring ring[2];
+};
+
+static struct shm_channel *channel_map(int ctl_fd, int fds[SHM_N_FDS], int side)
+{
+	// The memfd is only needed for the mapping, it is closed either way
+	struct shm_channel *ch = calloc(1, sizeof(struct shm_channel));
+	if (ch == NULL)
+	{
+		close(fds[0]);
+		return NULL;
+	}
+
+	ch->mem = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	close(fds[0]);
+	if (ch->mem == MAP_FAILED)
+	{
+		free(ch);
+		return NULL;
+	}
+
+	struct shm_region *region = ch->mem;
+
+	// side 0 is the client, side 1 is the server
+	ch->ctl_fd = ctl_fd;
+	ch->tx = &region->ring[side];
+	ch->rx = &region->ring[1 - side];
+	ch->tx_data_efd = fds[1 + 2 * side];
+	ch->tx_space_efd = fds[2 + 2 * side];
+	ch->rx_data_efd = fds[1 + 2 * (1 - side)];
+	ch->rx_space_efd = fds[2 + 2 * (1 - side)];
+	pthread_mutex_init(&ch->tx_lock, NULL);
+
+	return ch;
+}
+
+struct shm_channel *shm_channel_create(int ctl_fd)
+{
+	int fds[SHM_N_FDS];
+
+	fds[0] = memfd_create("chase-shm", MFD_CLOEXEC);
+	if (fds[0] == -1)
+		return NULL;
+	if (ftruncate(fds[0], sizeof(struct shm_region)) == -1)
+	{
+		close(fds[0]);
+		return NULL;
+	}
+	for (int i = 1; i < SHM_N_FDS; i++)
+	{
+		fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fds[i] == -1)
+		{
+			while (i-- > 0)
+				close(fds[i]);
+			return NULL;
+		}
+	}
+
+	// Hand all the file descriptors to the peer in a single message
+	char tag = 'S';
+	struct iovec iov = {&tag, 1};
+	char control[CMSG_SPACE(sizeof(fds))] = {0};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(ctl_fd, &msg, MSG_NOSIGNAL) != 1)
+	{
+		for (int i = 0; i < SHM_N_FDS; i++)
+			close(fds[i]);
+		return NULL;
+	}
+
+	struct shm_channel *ch = channel_map(ctl_fd, fds, 1);
+	if (ch == NULL)
+	{
+		for (int i = 1; i < SHM_N_FDS; i++)
+			close(fds[i]);
+	}
+	return ch;
+}
+
+struct shm_channel *shm_channel_attach(int ctl_fd)
+{
+	int fds[SHM_N_FDS];
+
+	char tag;
+	struct iovec iov = {&tag, 1};
+	char control[CMSG_SPACE(sizeof(fds))] = {0};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if (recvmsg(ctl_fd, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return NULL;
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds)))
+		return NULL;
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+	return channel_map(ctl_fd, fds, 0);
+}
+
+// Sleeps until the eventfd is signaled, returns -1 if the peer went away
+static int channel_wait(struct shm_channel *ch, int efd)
+{
+	struct pollfd fds[2] = {{efd, POLLIN, 0}, {ch->ctl_fd, POLLIN, 0}};
+
+	while (poll(fds, 2, -1) == -1)
+	{
+		if (errno != EINTR)
+			return -1;
+	}
+
+	// Nothing is ever sent on the control socket after the setup, so it
+	// only becomes readable when the peer closes it
+	if (fds[1].revents)
+		return -1;
+
+	uint64_t value;
+	if (read(efd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+		return -1;
+	return 0;
+}
+
+static void channel_signal(int efd)
+{
+	uint64_t value = 1;
+	write(efd, &value, sizeof(value));
+}
+
+ssize_t shm_send(struct shm_channel *ch, const void *buf, size_t len)
+{
+	struct shm_ring *ring = ch->tx;
+	const char *src = buf;
+	size_t sent = 0;
+	int spin = 0;
+
+	pthread_mutex_lock(&ch->tx_lock);
+
+	while (sent < len)
+	{
+		unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+		unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+		unsigned int space = SHM_RING_SIZE - (head - tail);
+
+		if (space == 0)
+		{
+			if (spin++ < SHM_SPIN)
+				continue;
+
+			// Ring is full, sleep until the consumer frees some space
+			atomic_store(&ring->writer_waiting, 1);
+			if (atomic_load(&ring->tail) == tail && channel_wait(ch, ch->tx_space_efd) == -1)
+			{
+				atomic_store(&ring->writer_waiting, 0);
+				pthread_mutex_unlock(&ch->tx_lock);
+				return -1;
+			}
+			atomic_store(&ring->writer_waiting, 0);
+			spin = 0;
+			continue;
+		}
+
+		// Copy as much as fits, in (at most) two pieces because of the wrap around
+		size_t n = len - sent < space ? len - sent : space;
+		size_t offset = head & (SHM_RING_SIZE - 1);
+		size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+
+		memcpy(&ring->data[offset], src + sent, first);
+		memcpy(&ring->data[0], src + sent + first, n - first);
+
+		atomic_store(&ring->head, head + n);
+		sent += n;
+
+		if (atomic_load(&ring->reader_waiting))
+			channel_signal(ch->tx_data_efd);
+	}
+
+	pthread_mutex_unlock(&ch->tx_lock);
+	return sent;
+}
+
+ssize_t shm_try_send(struct shm_channel *ch, const void *buf, size_t len)
+{
+	struct shm_ring *ring = ch->tx;
+
+	pthread_mutex_lock(&ch->tx_lock);
+
+	unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	unsigned int space = SHM_RING_SIZE - (head - tail);
+
+	size_t n = len < space ? len : space;
+	size_t offset = head & (SHM_RING_SIZE - 1);
+	size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+
+	memcpy(&ring->data[offset], buf, first);
+	memcpy(&ring->data[0], (const char *)buf + first, n - first);
+
+	if (n > 0)
+	{
+		atomic_store(&ring->head, head + n);
+		if (atomic_load(&ring->reader_waiting))
+			channel_signal(ch->tx_data_efd);
+	}
+
+	pthread_mutex_unlock(&ch->tx_lock);
+	return n;
+}
+
+ssize_t shm_recv(struct shm_channel *ch, void *buf, size_t len)
+{
+	struct shm_ring *ring = ch->rx;
+	char *dst = buf;
+	size_t received = 0;
+	int spin = 0;
+
+	while (received < len)
+	{
+		unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		unsigned int avail = head - tail;
+
+		if (avail == 0)
+		{
+			if (spin++ < SHM_SPIN)
+				continue;
+
+			// Ring is empty, sleep until the producer writes something
+			atomic_store(&ring->reader_waiting, 1);
+			if (atomic_load(&ring->head) == head && channel_wait(ch, ch->rx_data_efd) == -1)
+			{
+				atomic_store(&ring->reader_waiting, 0);
+				return received > 0 ? -1 : 0;
+			}
+			atomic_store(&ring->reader_waiting, 0);
+			spin = 0;
+			continue;
+		}
+
+		size_t n = len - received < avail ? len - received : avail;
+		size_t offset = tail & (SHM_RING_SIZE - 1);
+		size_t first = n < SHM_RING_SIZE - offset ? n : SHM_RING_SIZE - offset;
+
+		memcpy(dst + received, &ring->data[offset], first);
+		memcpy(dst + received + first, &ring->data[0], n - first);
+
+		atomic_store(&ring->tail, tail + n);
+		received += n;
+
+		if (atomic_load(&ring->writer_waiting))
+			channel_signal(ch->rx_space_efd);
+	}
+
+	return received;
+}
+
+void shm_channel_shutdown(struct shm_channel *ch) { shutdown(ch->ctl_fd, SHUT_RDWR); }
+
+void shm_channel_destroy(struct shm_channel *ch)
+{
+	munmap(ch->mem, sizeof(struct shm_region));
+	close(ch->tx_data_efd);
+	close(ch->tx_space_efd);
+	close(ch->rx_data_efd);
+	close(ch->rx_space_efd);
+	close(ch->ctl_fd);
+	pthread_mutex_destroy(&ch->tx_lock);
+	free(ch);
+}
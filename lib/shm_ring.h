@@ -0,0 +1,47 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define SHM_RING_SIZE (1 << 16) // Bytes in each direction, must be a power of 2
+
+// Single producer single consumer byte ring living in shared memory
+// Indexes run freely and are masked on access
+struct shm_ring
+{
+	_Alignas(64) atomic_uint head; // Written by the producer only
+	_Alignas(64) atomic_uint tail; // Written by the consumer only
+	_Alignas(64) atomic_int reader_waiting;
+	atomic_int writer_waiting;
+	_Alignas(64) char data[SHM_RING_SIZE];
+};
+
+// Process local view of a pair of rings shared with a peer process
+// Every ring has an eventfd to wake its consumer (data) and one to wake its
+// producer (space), the control socket is only used to pass the file
+// descriptors and to detect the peer going away
+struct shm_channel
+{
+	int ctl_fd;
+	void *mem;
+	struct shm_ring *tx;
+	struct shm_ring *rx;
+	int tx_data_efd, tx_space_efd;
+	int rx_data_efd, rx_space_efd;
+	// Several threads may send, but the ring only allows one producer
+	pthread_mutex_t tx_lock;
+};
+
+// Creates the rings and eventfds and hands them to the peer (server side)
+struct shm_channel *shm_channel_create(int ctl_fd);
+// Maps the rings and eventfds received from the peer (client side)
+struct shm_channel *shm_channel_attach(int ctl_fd);
+
+// Same semantics as sending/receiving everything on a stream socket
+ssize_t shm_send(struct shm_channel *ch, const void *buf, size_t len);
+ssize_t shm_recv(struct shm_channel *ch, void *buf, size_t len);
+// Copies as much as fits in the ring without waiting, returns the bytes copied
+ssize_t shm_try_send(struct shm_channel *ch, const void *buf, size_t len);
+
+// Wakes anyone blocked on the channel, on both sides
+void shm_channel_shutdown(struct shm_channel *ch);
+void shm_channel_destroy(struct shm_channel *ch);
@@ -0,0 +1,83 @@
+#include "world.h"
+#include "snapshot.h"
+#include <string.h>
+
+#define N_CELLS (WINDOW_SIZE * WINDOW_SIZE)
+
+int snapshot_encode(const ball_info_t *balls, int n, unsigned char *out)
+{
+	const ball_info_t *cells[N_CELLS] = {0};
+
+	for (int i = 0; i < n; i++)
+	{
+		if (balls[i].pos_x < 0 || balls[i].pos_x >= WINDOW_SIZE ||
+			balls[i].pos_y < 0 || balls[i].pos_y >= WINDOW_SIZE)
+			continue;
+		cells[balls[i].pos_y * WINDOW_SIZE + balls[i].pos_x] = &balls[i];
+	}
+
+	memset(out, 0, SNAP_BITMAP_BYTES);
+	int len = SNAP_BITMAP_BYTES;
+	int run = -1; // Offset of the current run
+
+	for (int cell = 0; cell < N_CELLS; cell++)
+	{
+		const ball_info_t *ball = cells[cell];
+		if (ball == NULL)
+			continue;
+
+		out[cell / 8] |= 1 << (cell % 8);
+
+		// Same ball as the previous one, just make the run longer
+		if (run != -1 && out[run] < 255 && out[run + 1] == (unsigned char)ball->ch &&
+			out[run + 2] == (unsigned char)ball->hp)
+		{
+			out[run]++;
+			continue;
+		}
+
+		run = len;
+		out[len++] = 1;
+		out[len++] = ball->ch;
+		out[len++] = ball->hp;
+	}
+
+	return len;
+}
+
+int snapshot_decode(const unsigned char *in, int len, ball_info_t *balls)
+{
+	if (len < SNAP_BITMAP_BYTES)
+		return -1;
+
+	int n = 0;
+	int offset = SNAP_BITMAP_BYTES;
+	int left = 0; // Balls left in the current run
+
+	for (int cell = 0; cell < N_CELLS; cell++)
+	{
+		if (!(in[cell / 8] & (1 << (cell % 8))))
+			continue;
+
+		if (left == 0)
+		{
+			if (offset + 3 > len || in[offset] == 0)
+				return -1;
+			left = in[offset];
+			offset += 3;
+		}
+
+		balls[n].pos_x = cell % WINDOW_SIZE;
+		balls[n].pos_y = cell / WINDOW_SIZE;
+		balls[n].ch = in[offset - 2];
+		balls[n].hp = in[offset - 1];
+		n++;
+		left--;
+	}
+
+	// Every run must have been used up exactly
+	if (left != 0 || offset != len)
+		return -1;
+
+	return n;
+}
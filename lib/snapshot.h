@@ -0,0 +1,15 @@
+// Compressed full board snapshot:
+// - an occupancy bitmap with one bit per cell, row by row (bit y *
+//   WINDOW_SIZE + x, least significant bit first)
+// - the balls of the set bits, in the same order, run length encoded as
+//   (count, ch, hp) byte triples over runs of identical ch and hp
+#define SNAP_BITMAP_BYTES ((WINDOW_SIZE * WINDOW_SIZE + 7) / 8)
+#define SNAP_MAX_BYTES (SNAP_BITMAP_BYTES + 3 * WINDOW_SIZE * WINDOW_SIZE)
+
+// Encodes the n balls (at most one per cell) into out, which must hold
+// SNAP_MAX_BYTES, returns the bytes used
+int snapshot_encode(const ball_info_t *balls, int n, unsigned char *out);
+
+// Decodes len bytes into balls, which must hold WINDOW_SIZE * WINDOW_SIZE
+// entries, returns how many there were or -1 if the data is malformed
+int snapshot_decode(const unsigned char *in, int len, ball_info_t *balls);
@@ -0,0 +1,211 @@
+#include <stdlib.h>
+
+#include "spatial.h"
+
+static inline int bucket_of(const struct spatial_index *si, int x, int y)
+{
+	return (y / si->bucket_size) * si->buckets_x + x / si->bucket_size;
+}
+
+static inline int *head_of(const struct spatial_index *si, int bucket, int type)
+{
+	return &si->head[bucket * si->n_types + type];
+}
+
+static void unlink_id(struct spatial_index *si, int id)
+{
+	if (si->prev[id] != -1)
+		si->next[si->prev[id]] = si->next[id];
+	else
+		*head_of(si, si->bucket[id], si->type[id]) = si->next[id];
+
+	if (si->next[id] != -1)
+		si->prev[si->next[id]] = si->prev[id];
+}
+
+static void link_id(struct spatial_index *si, int id, int bucket)
+{
+	int *head = head_of(si, bucket, si->type[id]);
+
+	si->bucket[id] = bucket;
+	si->prev[id] = -1;
+	si->next[id] = *head;
+	if (*head != -1)
+		si->prev[*head] = id;
+	*head = id;
+}
+
+void spatial_init(struct spatial_index *si, int width, int height, int bucket_size, int n_ids, int n_types)
+{
+	si->width = width;
+	si->height = height;
+	si->bucket_size = bucket_size;
+	si->buckets_x = (width + bucket_size - 1) / bucket_size;
+	si->buckets_y = (height + bucket_size - 1) / bucket_size;
+	si->n_ids = n_ids;
+	si->n_types = n_types;
+
+	int n_heads = si->buckets_x * si->buckets_y * n_types;
+	si->head = malloc(n_heads * sizeof(int));
+	for (int i = 0; i < n_heads; i++)
+		si->head[i] = -1;
+
+	si->next = malloc(n_ids * sizeof(int));
+	si->prev = malloc(n_ids * sizeof(int));
+	si->bucket = malloc(n_ids * sizeof(int));
+	si->type = calloc(n_ids, 1);
+	si->x = calloc(n_ids, sizeof(int));
+	si->y = calloc(n_ids, sizeof(int));
+	for (int i = 0; i < n_ids; i++)
+		si->bucket[i] = -1;
+}
+
+void spatial_destroy(struct spatial_index *si)
+{
+	free(si->head);
+	free(si->next);
+	free(si->prev);
+	free(si->bucket);
+	free(si->type);
+	free(si->x);
+	free(si->y);
+}
+
+void spatial_place(struct spatial_index *si, int id, int type, int x, int y)
+{
+	int bucket = bucket_of(si, x, y);
+
+	si->x[id] = x;
+	si->y[id] = y;
+
+	// Moves within a bucket are the common case and cost nothing more
+	if (si->bucket[id] == bucket && si->type[id] == type)
+		return;
+
+	if (si->bucket[id] != -1)
+		unlink_id(si, id);
+	si->type[id] = type;
+	link_id(si, id, bucket);
+}
+
+void spatial_remove(struct spatial_index *si, int id)
+{
+	if (si->bucket[id] == -1)
+		return;
+
+	unlink_id(si, id);
+	si->bucket[id] = -1;
+}
+
+bool spatial_contains(const struct spatial_index *si, int id)
+{
+	return si->bucket[id] != -1;
+}
+
+int spatial_distance(const struct spatial_index *si, int id, int x, int y)
+{
+	return abs(si->x[id] - x) + abs(si->y[id] - y);
+}
+
+int spatial_in_rect(const struct spatial_index *si, unsigned int types, int x0, int y0, int x1, int y1, int *ids, int max)
+{
+	int n = 0;
+
+	x0 = x0 < 0 ? 0 : x0;
+	y0 = y0 < 0 ? 0 : y0;
+	x1 = x1 >= si->width ? si->width - 1 : x1;
+	y1 = y1 >= si->height ? si->height - 1 : y1;
+	if (x0 > x1 || y0 > y1)
+		return 0;
+
+	for (int by = y0 / si->bucket_size; by <= y1 / si->bucket_size; by++)
+	{
+		for (int bx = x0 / si->bucket_size; bx <= x1 / si->bucket_size; bx++)
+		{
+			for (int type = 0; type < si->n_types; type++)
+			{
+				if (!(types & (1u << type)))
+					continue;
+
+				for (int id = *head_of(si, by * si->buckets_x + bx, type); id != -1; id = si->next[id])
+				{
+					if (si->x[id] < x0 || si->x[id] > x1 || si->y[id] < y0 || si->y[id] > y1)
+						continue;
+					if (ids != NULL && n < max)
+						ids[n] = id;
+					n++;
+				}
+			}
+		}
+	}
+	return n;
+}
+
+// Adds an entity to the k nearest found so far, kept sorted by distance
+static int keep_nearest(int *ids, int *dists, int n, int k, int id, int dist)
+{
+	if (n == k && dist >= dists[n - 1])
+		return n;
+
+	int i = n < k ? n++ : n - 1;
+	for (; i > 0 && dists[i - 1] > dist; i--)
+	{
+		ids[i] = ids[i - 1];
+		dists[i] = dists[i - 1];
+	}
+	ids[i] = id;
+	dists[i] = dist;
+	return n;
+}
+
+int spatial_nearest(const struct spatial_index *si, unsigned int types, int x, int y, int max_dist, int k, int *ids)
+{
+	if (k <= 0)
+		return 0;
+
+	int dists[k];
+	int n = 0;
+	int bx = x / si->bucket_size, by = y / si->bucket_size;
+	int max_ring = si->buckets_x > si->buckets_y ? si->buckets_x : si->buckets_y;
+
+	// Rings of buckets around the one of the cell, everything in ring r is
+	// more than (r - 1) * bucket_size steps away, so the search stops once
+	// the k found are all closer than the next ring
+	for (int ring = 0; ring < max_ring; ring++)
+	{
+		int nearest_next = ring * si->bucket_size + 1;
+		if (max_dist != -1 && nearest_next - si->bucket_size > max_dist)
+			break;
+
+		for (int ry = by - ring; ry <= by + ring; ry++)
+		{
+			if (ry < 0 || ry >= si->buckets_y)
+				continue;
+
+			// Only the edge of the ring, the inside was searched already
+			int step = ry == by - ring || ry == by + ring ? 1 : 2 * ring;
+			for (int rx = bx - ring; rx <= bx + ring; rx += step > 0 ? step : 1)
+			{
+				if (rx < 0 || rx >= si->buckets_x)
+					continue;
+
+				for (int type = 0; type < si->n_types; type++)
+				{
+					if (!(types & (1u << type)))
+						continue;
+
+					for (int id = *head_of(si, ry * si->buckets_x + rx, type); id != -1; id = si->next[id])
+					{
+						int dist = spatial_distance(si, id, x, y);
+						if (max_dist == -1 || dist <= max_dist)
+							n = keep_nearest(ids, dists, n, k, id, dist);
+					}
+				}
+			}
+		}
+
+		if (n == k && dists[n - 1] < nearest_next)
+			break;
+	}
+	return n;
+}
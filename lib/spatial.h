@@ -0,0 +1,43 @@
+#include <stdbool.h>
+
+// Where entities are, by buckets of bucket_size x bucket_size cells with a
+// list per type in each, so finding what is near a cell only looks at the
+// buckets around it and not at every entity. Entities are ids below n_ids
+// with a type below n_types, queries take a mask of types (1 << type).
+// Distances are in steps (Manhattan), the way balls move
+
+struct spatial_index
+{
+	int width, height;
+	int bucket_size, buckets_x, buckets_y;
+	int n_ids, n_types;
+	int *head;			 // First id of each bucket and type, -1 if none
+	int *next, *prev;	 // Lists of ids
+	int *bucket;		 // Bucket of each id, -1 if not in the index
+	unsigned char *type; // Of each id
+	int *x, *y;			 // Of each id
+};
+
+void spatial_init(struct spatial_index *si, int width, int height, int bucket_size, int n_ids, int n_types);
+void spatial_destroy(struct spatial_index *si);
+
+// Puts an entity in a cell, adding it if it was not in the index
+void spatial_place(struct spatial_index *si, int id, int type, int x, int y);
+
+// Takes an entity out of the index, if it was there
+void spatial_remove(struct spatial_index *si, int id);
+
+bool spatial_contains(const struct spatial_index *si, int id);
+
+// Entities of the types in the mask in the rectangle [x0, x1] x [y0, y1]
+// (inclusive), the first max of them are written to ids (may be NULL).
+// Returns how many there are
+int spatial_in_rect(const struct spatial_index *si, unsigned int types, int x0, int y0, int x1, int y1, int *ids, int max);
+
+// The up to k entities of the types in the mask nearest to a cell and no
+// further than max_dist steps (-1 for any distance), nearest first. Returns
+// how many were written to ids
+int spatial_nearest(const struct spatial_index *si, unsigned int types, int x, int y, int max_dist, int k, int *ids);
+
+// Steps between an entity in the index and a cell
+int spatial_distance(const struct spatial_index *si, int id, int x, int y);
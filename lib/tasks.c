@@ -0,0 +1,398 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tasks.h"
+
+// Most workers, whatever the number of cores
+#define TASKS_MAX_WORKERS 64
+// Tasks a deque has room for before it grows
+#define TASKS_DEQUE_SIZE 64
+
+struct task
+{
+	task_fn fn;
+	void *arg;
+	struct task_group *group; // NULL if nobody waits for it
+};
+
+// Tasks of a worker in a ring, the worker pushes and pops at the bottom and
+// thieves take from the top
+struct deque
+{
+	pthread_mutex_t lock;
+	struct task *tasks;
+	int top, n, cap;
+};
+
+struct timer
+{
+	long deadline;
+	struct task task;
+};
+
+static struct deque deques[TASKS_MAX_WORKERS];
+static int n_workers;
+
+// Worker the calling thread is, -1 for any other thread
+static __thread int self = -1;
+
+// Tasks in the deques, workers only sleep when there are none. Submitters
+// bump queued before looking at n_sleeping and sleepers the other way
+// around, so either one sees the other
+static atomic_int queued;
+static atomic_int n_sleeping;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond;
+
+// Timers in a binary heap by deadline, under idle_lock
+static struct timer *timers;
+static int n_timers, timers_cap;
+static atomic_long next_deadline; // LONG_MAX without timers
+
+// Worker that gets the next task submitted from outside the workers
+static atomic_uint next_worker;
+
+static long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void deque_push(struct deque *d, struct task task)
+{
+	/* Critical region deque start */
+	pthread_mutex_lock(&d->lock);
+
+	if (d->n == d->cap)
+	{
+		int new_cap = d->cap ? 2 * d->cap : TASKS_DEQUE_SIZE;
+		struct task *tasks = malloc(new_cap * sizeof(struct task));
+		for (int i = 0; i < d->n; i++)
+			tasks[i] = d->tasks[(d->top + i) % d->cap];
+		free(d->tasks);
+		d->tasks = tasks;
+		d->top = 0;
+		d->cap = new_cap;
+	}
+
+	d->tasks[(d->top + d->n) % d->cap] = task;
+	d->n++;
+
+	pthread_mutex_unlock(&d->lock);
+	/* Critical region deque end */
+}
+
+// Newest task, for the owner
+static bool deque_pop(struct deque *d, struct task *task)
+{
+	pthread_mutex_lock(&d->lock);
+	bool found = d->n > 0;
+	if (found)
+	{
+		d->n--;
+		*task = d->tasks[(d->top + d->n) % d->cap];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+// Oldest task, for thieves
+static bool deque_steal(struct deque *d, struct task *task)
+{
+	pthread_mutex_lock(&d->lock);
+	bool found = d->n > 0;
+	if (found)
+	{
+		*task = d->tasks[d->top];
+		d->top = (d->top + 1) % d->cap;
+		d->n--;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+// Oldest task of a group, for whoever waits for it
+static bool deque_take_group(struct deque *d, struct task_group *g, struct task *task)
+{
+	pthread_mutex_lock(&d->lock);
+	bool found = false;
+	for (int i = 0; i < d->n && !found; i++)
+	{
+		if (d->tasks[(d->top + i) % d->cap].group != g)
+			continue;
+
+		*task = d->tasks[(d->top + i) % d->cap];
+		for (int j = i; j < d->n - 1; j++)
+			d->tasks[(d->top + j) % d->cap] = d->tasks[(d->top + j + 1) % d->cap];
+		d->n--;
+		found = true;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+static void wake_worker()
+{
+	if (atomic_load(&n_sleeping) > 0)
+	{
+		pthread_mutex_lock(&idle_lock);
+		pthread_cond_signal(&idle_cond);
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
+
+static void push_task(struct task task)
+{
+	int worker = self != -1 ? self : (int)(atomic_fetch_add(&next_worker, 1) % n_workers);
+	deque_push(&deques[worker], task);
+	atomic_fetch_add(&queued, 1);
+	wake_worker();
+}
+
+// Own tasks first, then the other workers' starting with the next one
+static bool find_task(struct task *task)
+{
+	bool found = self != -1 && deque_pop(&deques[self], task);
+
+	int start = self != -1 ? self + 1 : (int)(atomic_load(&next_worker) % n_workers);
+	for (int i = 0; i < n_workers && !found; i++)
+	{
+		int victim = (start + i) % n_workers;
+		if (victim != self)
+			found = deque_steal(&deques[victim], task);
+	}
+
+	if (found)
+		atomic_fetch_sub(&queued, 1);
+	return found;
+}
+
+static void run_task(struct task task)
+{
+	task.fn(task.arg);
+
+	struct task_group *g = task.group;
+	if (g != NULL && atomic_fetch_sub(&g->pending, 1) == 1)
+	{
+		pthread_mutex_lock(&g->lock);
+		pthread_cond_broadcast(&g->done);
+		pthread_mutex_unlock(&g->lock);
+	}
+}
+
+static void timer_swap(int a, int b)
+{
+	struct timer t = timers[a];
+	timers[a] = timers[b];
+	timers[b] = t;
+}
+
+// Moves the timers that are due to the deque of the calling worker
+static void fire_timers()
+{
+	long now = now_ms();
+	if (now < atomic_load(&next_deadline))
+		return;
+
+	int fired = 0;
+
+	/* Critical region idle start */
+	pthread_mutex_lock(&idle_lock);
+
+	while (n_timers > 0 && timers[0].deadline <= now)
+	{
+		deque_push(&deques[self], timers[0].task);
+		atomic_fetch_add(&queued, 1);
+		fired++;
+
+		// Last timer to the root and down the heap
+		timers[0] = timers[--n_timers];
+		for (int i = 0; ; )
+		{
+			int next = i, l = 2 * i + 1, r = 2 * i + 2;
+			if (l < n_timers && timers[l].deadline < timers[next].deadline)
+				next = l;
+			if (r < n_timers && timers[r].deadline < timers[next].deadline)
+				next = r;
+			if (next == i)
+				break;
+			timer_swap(i, next);
+			i = next;
+		}
+	}
+	atomic_store(&next_deadline, n_timers > 0 ? timers[0].deadline : LONG_MAX);
+
+	// The caller runs one, the others are for whoever is idle
+	if (fired > 1)
+		pthread_cond_broadcast(&idle_cond);
+
+	pthread_mutex_unlock(&idle_lock);
+	/* Critical region idle end */
+}
+
+// Sleeps until there is a task or a timer is due
+static void idle()
+{
+	/* Critical region idle start */
+	pthread_mutex_lock(&idle_lock);
+	atomic_fetch_add(&n_sleeping, 1);
+
+	if (atomic_load(&queued) == 0)
+	{
+		long deadline = atomic_load(&next_deadline);
+		if (deadline == LONG_MAX)
+		{
+			pthread_cond_wait(&idle_cond, &idle_lock);
+		}
+		else if (deadline > now_ms())
+		{
+			struct timespec ts = {deadline / 1000, deadline % 1000 * 1000000};
+			pthread_cond_timedwait(&idle_cond, &idle_lock, &ts);
+		}
+	}
+
+	atomic_fetch_sub(&n_sleeping, 1);
+	pthread_mutex_unlock(&idle_lock);
+	/* Critical region idle end */
+}
+
+static void *worker(void *arg)
+{
+	struct task task;
+
+	self = (int)(long)arg;
+
+	while (1)
+	{
+		fire_timers();
+
+		if (find_task(&task))
+			run_task(task);
+		else
+			idle();
+	}
+
+	return NULL;
+}
+
+void tasks_init(int n)
+{
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		n = 1;
+	if (n > TASKS_MAX_WORKERS)
+		n = TASKS_MAX_WORKERS;
+	n_workers = n;
+
+	// Allocated up front so submitting a task only allocates once a deque
+	// (or the timers) outgrow this
+	for (int i = 0; i < n_workers; i++)
+	{
+		memset(&deques[i], 0, sizeof(struct deque));
+		pthread_mutex_init(&deques[i].lock, NULL);
+		deques[i].tasks = malloc(TASKS_DEQUE_SIZE * sizeof(struct task));
+		deques[i].cap = TASKS_DEQUE_SIZE;
+	}
+	timers = malloc(TASKS_DEQUE_SIZE * sizeof(struct timer));
+	timers_cap = TASKS_DEQUE_SIZE;
+
+	// Timer deadlines are on the monotonic clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&idle_cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	atomic_init(&next_deadline, LONG_MAX);
+
+	for (int i = 0; i < n_workers; i++)
+	{
+		pthread_t thread;
+		pthread_create(&thread, NULL, worker, (void *)(long)i);
+		pthread_detach(thread);
+	}
+}
+
+void task_submit(task_fn fn, void *arg)
+{
+	push_task((struct task){fn, arg, NULL});
+}
+
+void task_after(int ms, task_fn fn, void *arg)
+{
+	if (ms <= 0)
+	{
+		task_submit(fn, arg);
+		return;
+	}
+
+	/* Critical region idle start */
+	pthread_mutex_lock(&idle_lock);
+
+	if (n_timers == timers_cap)
+	{
+		timers_cap = timers_cap ? 2 * timers_cap : TASKS_DEQUE_SIZE;
+		timers = realloc(timers, timers_cap * sizeof(struct timer));
+	}
+
+	// At the bottom and up the heap
+	int i = n_timers++;
+	timers[i] = (struct timer){now_ms() + ms, {fn, arg, NULL}};
+	while (i > 0 && timers[(i - 1) / 2].deadline > timers[i].deadline)
+	{
+		timer_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+
+	// A sleeping worker may be waiting for a later deadline
+	if (timers[0].deadline < atomic_load(&next_deadline))
+	{
+		atomic_store(&next_deadline, timers[0].deadline);
+		pthread_cond_signal(&idle_cond);
+	}
+
+	pthread_mutex_unlock(&idle_lock);
+	/* Critical region idle end */
+}
+
+void task_group_init(struct task_group *g)
+{
+	atomic_init(&g->pending, 0);
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->done, NULL);
+}
+
+void task_group_submit(struct task_group *g, task_fn fn, void *arg)
+{
+	atomic_fetch_add(&g->pending, 1);
+	push_task((struct task){fn, arg, g});
+}
+
+void task_group_wait(struct task_group *g)
+{
+	struct task task;
+
+	// The tasks of the group no worker started yet run here, so the group
+	// gets done even while every worker is stuck on something else (such as
+	// a lock the caller holds)
+	for (int i = 0; i < n_workers; i++)
+	{
+		while (deque_take_group(&deques[i], g, &task))
+		{
+			atomic_fetch_sub(&queued, 1);
+			run_task(task);
+		}
+	}
+
+	/* Critical region group start */
+	pthread_mutex_lock(&g->lock);
+	while (atomic_load(&g->pending) > 0)
+		pthread_cond_wait(&g->done, &g->lock);
+	pthread_mutex_unlock(&g->lock);
+	/* Critical region group end */
+}
@@ -0,0 +1,32 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Work-stealing task scheduler: one worker per core, each with its own deque
+// of short tasks. A worker runs its newest task first and, once it runs out,
+// steals the oldest one of another worker, so the load spreads by itself.
+// Tasks must not block for long, anything that waits does it as a timer
+typedef void (*task_fn)(void *arg);
+
+// Tasks somebody waits for all together
+struct task_group
+{
+	atomic_int pending;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+// Starts n_workers workers, one per online core if 0
+void tasks_init(int n_workers);
+
+// Runs a task as soon as a worker is free
+void task_submit(task_fn fn, void *arg);
+// Runs a task no sooner than ms milliseconds from now
+void task_after(int ms, task_fn fn, void *arg);
+
+void task_group_init(struct task_group *g);
+// Runs a task of the group as soon as a worker is free
+void task_group_submit(struct task_group *g, task_fn fn, void *arg);
+// Returns once every task of the group ran, running the ones no worker took
+// yet on the calling thread
+void task_group_wait(struct task_group *g);
@@ -0,0 +1,678 @@
+#include "uring.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#define URING_BGID 0 // Provided buffer group used by every recv
+
+// The low bit of user_data tells recv and send completions apart
+#define URING_TAG_RECV 0
+#define URING_TAG_SEND 1
+
+// Per connection state, shared by its users and the reactor thread
+struct uring_conn
+{
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refs;	  // Owner + armed recv + send in flight
+	bool closed;  // The peer closed the connection (or it was shut down)
+
+	// Received bytes not consumed yet
+	char *in;
+	size_t in_len, in_cap;
+
+	// Bytes waiting to be sent and bytes currently owned by the kernel
+	char *out;
+	size_t out_len, out_cap;
+	char *inflight;
+	size_t inflight_len, inflight_cap;
+	bool sending;
+
+	// Link in the list of connections with sends waiting for a flush
+	bool dirty;
+	struct uring_conn *next_dirty;
+
+	// Link in the list of connections whose recv or send found the
+	// submission queue full, under sq_lock
+	bool deferred, defer_recv, defer_send;
+	struct uring_conn *next_deferred;
+};
+
+static struct uring
+{
+	int fd;
+
+	// Submission queue
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	unsigned sq_local_tail; // Prepared but not published
+	unsigned sq_pending;	// Published but not submitted
+	struct io_uring_sqe *sqes;
+
+	// Completion queue
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+
+	// Provided buffers ring
+	struct io_uring_buf_ring *br;
+	char *bufs;
+
+	// Submission is shared by every sending thread and the reactor
+	pthread_mutex_t sq_lock;
+	struct uring_conn *dirty;
+	struct uring_conn *deferred;
+} ring;
+
+static bool enabled;
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(unsigned opcode, void *arg, unsigned n_args)
+{
+	return syscall(__NR_io_uring_register, ring.fd, opcode, arg, n_args);
+}
+
+// Entries published and not taken by the kernel yet
+static unsigned sq_backlog()
+{
+	return atomic_load_explicit((_Atomic unsigned *)ring.sq_tail, memory_order_acquire) -
+		   atomic_load_explicit((_Atomic unsigned *)ring.sq_head, memory_order_acquire);
+}
+
+// Publishes the prepared entries and submits them, caller holds sq_lock
+// The kernel refuses to take them while the completion queue is overflowing
+// (EBUSY) or it is short of memory (EAGAIN), waiting for that here would
+// keep the lock the reactor needs to drain the completions, so they stay in
+// the queue and the reactor submits them once it did
+static void sq_submit()
+{
+	atomic_store_explicit((_Atomic unsigned *)ring.sq_tail, ring.sq_local_tail, memory_order_release);
+	ring.sq_pending = 0;
+
+	while (sys_enter(sq_backlog(), 0, 0) == -1 && errno == EINTR)
+		;
+}
+
+// Gets a free submission entry, caller holds sq_lock. NULL if the queue is
+// still full after submitting it
+static struct io_uring_sqe *sq_get()
+{
+	unsigned head = atomic_load_explicit((_Atomic unsigned *)ring.sq_head, memory_order_acquire);
+
+	// Queue is full, make the kernel consume what is there first
+	if (ring.sq_local_tail - head >= ring.sq_entries)
+	{
+		sq_submit();
+		head = atomic_load_explicit((_Atomic unsigned *)ring.sq_head, memory_order_acquire);
+		if (ring.sq_local_tail - head >= ring.sq_entries)
+			return NULL;
+	}
+
+	unsigned index = ring.sq_local_tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	ring.sq_local_tail++;
+	ring.sq_pending++;
+	return sqe;
+}
+
+static void buf_recycle(unsigned short bid)
+{
+	struct io_uring_buf *buf = &ring.br->bufs[ring.br->tail & (URING_N_BUFS - 1)];
+	buf->addr = (uint64_t)(uintptr_t)&ring.bufs[bid * URING_BUF_SIZE];
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	atomic_store_explicit((_Atomic unsigned short *)&ring.br->tail, ring.br->tail + 1, memory_order_release);
+}
+
+static void conn_put(struct uring_conn *uc)
+{
+	pthread_mutex_lock(&uc->lock);
+	bool last = --uc->refs == 0;
+	pthread_mutex_unlock(&uc->lock);
+
+	if (!last)
+		return;
+
+	free(uc->in);
+	free(uc->out);
+	free(uc->inflight);
+	pthread_mutex_destroy(&uc->lock);
+	pthread_cond_destroy(&uc->cond);
+	close(uc->fd);
+	free(uc);
+}
+
+// Returns false, leaving the buffer as it was, if there is no memory for it
+static bool buffer_append(char **buf, size_t *len, size_t *cap, const void *data, size_t n)
+{
+	if (*len + n > *cap)
+	{
+		size_t new_cap = *cap ? *cap : 256;
+		while (new_cap < *len + n)
+			new_cap *= 2;
+		char *new_buf = realloc(*buf, new_cap);
+		if (new_buf == NULL)
+			return false;
+		*buf = new_buf;
+		*cap = new_cap;
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+	return true;
+}
+
+static void prep_recv(struct io_uring_sqe *sqe, int fd, uint64_t user_data)
+{
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = user_data;
+}
+
+// The buffer in flight stays put until the send completes
+static void prep_send(struct io_uring_sqe *sqe, struct uring_conn *uc)
+{
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = uc->fd;
+	sqe->addr = (uint64_t)(uintptr_t)uc->inflight;
+	sqe->len = uc->inflight_len;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uint64_t)(uintptr_t)uc | URING_TAG_SEND;
+}
+
+// Leaves a recv or send for the reactor to submit when there is room, the
+// reference it holds keeps the connection around. Caller holds sq_lock
+static void defer(struct uring_conn *uc, bool recv)
+{
+	if (recv)
+		uc->defer_recv = true;
+	else
+		uc->defer_send = true;
+
+	if (!uc->deferred)
+	{
+		uc->deferred = true;
+		uc->next_deferred = ring.deferred;
+		ring.deferred = uc;
+	}
+}
+
+// Prepares what was deferred while there is room, caller holds sq_lock
+static void submit_deferred()
+{
+	while (ring.deferred != NULL)
+	{
+		struct uring_conn *uc = ring.deferred;
+		struct io_uring_sqe *sqe;
+
+		if (uc->defer_recv)
+		{
+			if ((sqe = sq_get()) == NULL)
+				return;
+			prep_recv(sqe, uc->fd, (uint64_t)(uintptr_t)uc | URING_TAG_RECV);
+			uc->defer_recv = false;
+		}
+		if (uc->defer_send)
+		{
+			if ((sqe = sq_get()) == NULL)
+				return;
+			prep_send(sqe, uc);
+			uc->defer_send = false;
+		}
+
+		uc->deferred = false;
+		ring.deferred = uc->next_deferred;
+	}
+}
+
+// Caller holds sq_lock
+static void arm_recv(struct uring_conn *uc)
+{
+	struct io_uring_sqe *sqe = sq_get();
+	if (sqe == NULL)
+		defer(uc, true);
+	else
+		prep_recv(sqe, uc->fd, (uint64_t)(uintptr_t)uc | URING_TAG_RECV);
+}
+
+// Moves the queued bytes to the kernel, caller holds sq_lock and uc->lock
+static void start_send(struct uring_conn *uc)
+{
+	if (uc->sending || uc->out_len == 0 || uc->closed)
+		return;
+
+	// Swap buffers so new data can be queued while this one is in flight
+	char *tmp_buf = uc->inflight;
+	size_t tmp_cap = uc->inflight_cap;
+	uc->inflight = uc->out;
+	uc->inflight_cap = uc->out_cap;
+	uc->inflight_len = uc->out_len;
+	uc->out = tmp_buf;
+	uc->out_cap = tmp_cap;
+	uc->out_len = 0;
+
+	uc->sending = true;
+	uc->refs++;
+
+	struct io_uring_sqe *sqe = sq_get();
+	if (sqe == NULL)
+		defer(uc, false);
+	else
+		prep_send(sqe, uc);
+}
+
+static void handle_recv(struct uring_conn *uc, struct io_uring_cqe *cqe)
+{
+	bool more = cqe->flags & IORING_CQE_F_MORE;
+
+	pthread_mutex_lock(&uc->lock);
+
+	if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+	{
+		// Without room for the bytes the stream is broken, it is closed
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if (!buffer_append(&uc->in, &uc->in_len, &uc->in_cap, &ring.bufs[bid * URING_BUF_SIZE], cqe->res))
+			uc->closed = true;
+		buf_recycle(bid);
+	}
+	else if (cqe->res != -ENOBUFS)
+	{
+		// End of stream or error
+		uc->closed = true;
+	}
+
+	pthread_cond_broadcast(&uc->cond);
+	bool rearm = !more && !uc->closed;
+	pthread_mutex_unlock(&uc->lock);
+
+	if (more)
+		return;
+
+	// The multishot recv ended, either arm it again or drop its reference
+	if (rearm)
+	{
+		pthread_mutex_lock(&ring.sq_lock);
+		arm_recv(uc);
+		sq_submit();
+		pthread_mutex_unlock(&ring.sq_lock);
+	}
+	else
+	{
+		conn_put(uc);
+	}
+}
+
+static void handle_send(struct uring_conn *uc, struct io_uring_cqe *cqe)
+{
+	pthread_mutex_lock(&ring.sq_lock);
+	pthread_mutex_lock(&uc->lock);
+
+	uc->sending = false;
+
+	if (cqe->res < 0)
+	{
+		uc->closed = true;
+		pthread_cond_broadcast(&uc->cond);
+	}
+	else if (cqe->res < uc->inflight_len)
+	{
+		// Short send, what is left goes before anything queued since
+		size_t left = uc->inflight_len - cqe->res;
+		memmove(uc->inflight, uc->inflight + cqe->res, left);
+		if (!buffer_append(&uc->inflight, &left, &uc->inflight_cap, uc->out, uc->out_len))
+		{
+			uc->closed = true;
+			pthread_cond_broadcast(&uc->cond);
+		}
+		char *tmp_buf = uc->out;
+		size_t tmp_cap = uc->out_cap;
+		uc->out = uc->inflight;
+		uc->out_cap = uc->inflight_cap;
+		uc->out_len = left;
+		uc->inflight = tmp_buf;
+		uc->inflight_cap = tmp_cap;
+	}
+
+	start_send(uc);
+	if (ring.sq_pending > 0)
+		sq_submit();
+
+	pthread_mutex_unlock(&uc->lock);
+	pthread_mutex_unlock(&ring.sq_lock);
+
+	conn_put(uc);
+}
+
+// Thread function that reaps every completion
+static void *reactor(void *arg)
+{
+	while (1)
+	{
+		// Entries the kernel refused before are submitted with the wait, an
+		// error (EBUSY on overflow) still leaves completions to drain
+		sys_enter(sq_backlog(), 1, IORING_ENTER_GETEVENTS);
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring.cq_tail, memory_order_acquire);
+
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+			struct uring_conn *uc = (struct uring_conn *)(uintptr_t)(cqe.user_data & ~(uint64_t)1);
+
+			// Release the entry before handling it, handling may submit more
+			atomic_store_explicit((_Atomic unsigned *)ring.cq_head, head + 1, memory_order_release);
+
+			if ((cqe.user_data & 1) == URING_TAG_SEND)
+				handle_send(uc, &cqe);
+			else
+				handle_recv(uc, &cqe);
+		}
+
+		// There is room in the completion queue again for what found the
+		// submission queue full
+		pthread_mutex_lock(&ring.sq_lock);
+		submit_deferred();
+		if (ring.sq_pending > 0 || sq_backlog() > 0)
+			sq_submit();
+		pthread_mutex_unlock(&ring.sq_lock);
+	}
+	return NULL;
+}
+
+// Multishot recv came after the provided buffer rings (5.19 has the rings
+// but not it), so it is tried on a socket pair before the reactor starts:
+// a kernel without it fails the recv instead of keeping it armed
+static bool probe_multishot()
+{
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+		return false;
+
+	bool supported = false, more = true;
+	char byte = 0;
+	struct io_uring_sqe *sqe = sq_get();
+	if (write(sv[1], &byte, 1) == 1 && sqe != NULL)
+	{
+		prep_recv(sqe, sv[0], 0);
+		sq_submit();
+
+		// The first completion tells, the recv then ends with the socket
+		bool first = true;
+		while (more)
+		{
+			if (sys_enter(0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+				break;
+
+			unsigned head = *ring.cq_head;
+			unsigned tail = atomic_load_explicit((_Atomic unsigned *)ring.cq_tail, memory_order_acquire);
+			for (; head != tail; head++)
+			{
+				struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+				atomic_store_explicit((_Atomic unsigned *)ring.cq_head, head + 1, memory_order_release);
+
+				if (cqe.flags & IORING_CQE_F_BUFFER)
+					buf_recycle(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+				more = cqe.flags & IORING_CQE_F_MORE;
+				if (first)
+				{
+					supported = cqe.res == 1 && more;
+					shutdown(sv[0], SHUT_RDWR);
+					first = false;
+				}
+			}
+		}
+	}
+
+	close(sv[0]);
+	close(sv[1]);
+
+	// Nothing of the probe may reach the reactor
+	return supported && !more;
+}
+
+int uring_io_init()
+{
+	struct io_uring_params params = {0};
+
+	// The completion queue has to hold the recvs of every connection
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_ENTRIES * 8;
+
+	ring.fd = sys_setup(URING_ENTRIES, &params);
+	if (ring.fd == -1)
+		return -1;
+
+	// Single mmap for both queues is required to keep this small
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		close(ring.fd);
+		return -1;
+	}
+
+	ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring.cq_size > ring.sq_size)
+		ring.sq_size = ring.cq_size;
+
+	ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED)
+	{
+		close(ring.fd);
+		return -1;
+	}
+	ring.cq_ptr = ring.sq_ptr;
+
+	ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+	{
+		munmap(ring.sq_ptr, ring.sq_size);
+		close(ring.fd);
+		return -1;
+	}
+
+	char *sq = ring.sq_ptr;
+	ring.sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+	ring.sq_entries = params.sq_entries;
+	ring.sq_local_tail = *ring.sq_tail;
+
+	char *cq = ring.cq_ptr;
+	ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// Register the provided buffers ring (needs a page aligned address)
+	ring.br = NULL;
+	ring.bufs = malloc(URING_N_BUFS * URING_BUF_SIZE);
+	struct io_uring_buf_reg reg = {0};
+	reg.ring_entries = URING_N_BUFS;
+	reg.bgid = URING_BGID;
+
+	bool ok = ring.bufs != NULL &&
+			  posix_memalign((void **)&ring.br, sysconf(_SC_PAGESIZE), URING_N_BUFS * sizeof(struct io_uring_buf)) == 0;
+	if (ok)
+	{
+		memset(ring.br, 0, URING_N_BUFS * sizeof(struct io_uring_buf));
+		reg.ring_addr = (uint64_t)(uintptr_t)ring.br;
+		ok = sys_register(IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+	}
+
+	if (ok)
+	{
+		for (int i = 0; i < URING_N_BUFS; i++)
+			buf_recycle(i);
+		ok = probe_multishot();
+	}
+
+	// Closing the ring also drops the buffer registration and anything
+	// the probe left armed
+	if (!ok)
+	{
+		munmap(ring.sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+		munmap(ring.sq_ptr, ring.sq_size);
+		close(ring.fd);
+		free(ring.br);
+		free(ring.bufs);
+		return -1;
+	}
+
+	pthread_mutex_init(&ring.sq_lock, NULL);
+
+	pthread_t reactor_thread;
+	pthread_create(&reactor_thread, NULL, reactor, NULL);
+
+	enabled = true;
+	return 0;
+}
+
+bool uring_io_enabled() { return enabled; }
+
+struct uring_conn *uring_io_attach(int fd)
+{
+	struct uring_conn *uc = calloc(1, sizeof(struct uring_conn));
+	uc->fd = fd;
+	pthread_mutex_init(&uc->lock, NULL);
+	pthread_cond_init(&uc->cond, NULL);
+
+	// One reference for the owner and one for the armed recv
+	uc->refs = 2;
+
+	pthread_mutex_lock(&ring.sq_lock);
+	arm_recv(uc);
+	sq_submit();
+	pthread_mutex_unlock(&ring.sq_lock);
+
+	return uc;
+}
+
+ssize_t uring_io_send(struct uring_conn *uc, const void *buf, size_t len)
+{
+	pthread_mutex_lock(&ring.sq_lock);
+	pthread_mutex_lock(&uc->lock);
+
+	if (uc->closed || !buffer_append(&uc->out, &uc->out_len, &uc->out_cap, buf, len))
+	{
+		pthread_mutex_unlock(&uc->lock);
+		pthread_mutex_unlock(&ring.sq_lock);
+		return -1;
+	}
+
+	if (!uc->dirty)
+	{
+		uc->dirty = true;
+		uc->refs++;
+		uc->next_dirty = ring.dirty;
+		ring.dirty = uc;
+	}
+
+	pthread_mutex_unlock(&uc->lock);
+	pthread_mutex_unlock(&ring.sq_lock);
+	return len;
+}
+
+ssize_t uring_io_pending(struct uring_conn *uc)
+{
+	pthread_mutex_lock(&uc->lock);
+	ssize_t pending = uc->closed ? -1 : uc->out_len + (uc->sending ? uc->inflight_len : 0);
+	pthread_mutex_unlock(&uc->lock);
+	return pending;
+}
+
+void uring_io_flush()
+{
+	pthread_mutex_lock(&ring.sq_lock);
+
+	struct uring_conn *uc = ring.dirty;
+	ring.dirty = NULL;
+
+	struct uring_conn *done = NULL;
+	while (uc != NULL)
+	{
+		struct uring_conn *next = uc->next_dirty;
+
+		pthread_mutex_lock(&uc->lock);
+		uc->dirty = false;
+		start_send(uc);
+		pthread_mutex_unlock(&uc->lock);
+
+		uc->next_dirty = done;
+		done = uc;
+		uc = next;
+	}
+
+	// A single system call for all the connections
+	if (ring.sq_pending > 0)
+		sq_submit();
+
+	pthread_mutex_unlock(&ring.sq_lock);
+
+	// Drop the references taken while the connections were on the dirty list
+	while (done != NULL)
+	{
+		struct uring_conn *next = done->next_dirty;
+		conn_put(done);
+		done = next;
+	}
+}
+
+ssize_t uring_io_recv(struct uring_conn *uc, void *buf, size_t len)
+{
+	pthread_mutex_lock(&uc->lock);
+
+	while (uc->in_len < len && !uc->closed)
+		pthread_cond_wait(&uc->cond, &uc->lock);
+
+	if (uc->in_len < len)
+	{
+		pthread_mutex_unlock(&uc->lock);
+		return 0;
+	}
+
+	memcpy(buf, uc->in, len);
+	memmove(uc->in, uc->in + len, uc->in_len - len);
+	uc->in_len -= len;
+
+	pthread_mutex_unlock(&uc->lock);
+	return len;
+}
+
+void uring_io_close(struct uring_conn *uc)
+{
+	// The recv completes with 0 and wakes up the receiver
+	shutdown(uc->fd, SHUT_RDWR);
+}
+
+void uring_io_free(struct uring_conn *uc)
+{
+	// Whatever is still in the kernel holds its own reference
+	conn_put(uc);
+}
@@ -0,0 +1,36 @@
+#include <stdbool.h>
+#include <sys/types.h>
+
+// io_uring I/O backend for stream sockets
+// A single reactor thread keeps a multishot recv armed on every attached
+// socket, receiving into a ring of provided buffers, and completes the
+// sends. Sends are queued per connection and submitted together by
+// uring_io_flush(), so a broadcast costs one io_uring_enter() for everyone.
+
+#define URING_ENTRIES 256	   // Submission queue entries
+#define URING_N_BUFS 256	   // Provided receive buffers, must be a power of 2
+#define URING_BUF_SIZE 2048	   // Size of each provided receive buffer
+
+struct uring_conn;
+
+// Sets the ring up and starts the reactor thread, returns -1 if io_uring (or
+// any of the features needed) is not available
+int uring_io_init();
+bool uring_io_enabled();
+
+// Starts receiving from the socket through the ring
+struct uring_conn *uring_io_attach(int fd);
+
+// Queues data to be sent, nothing is submitted until uring_io_flush()
+ssize_t uring_io_send(struct uring_conn *uc, const void *buf, size_t len);
+// Bytes queued or in flight that the kernel did not send yet, -1 if closed
+ssize_t uring_io_pending(struct uring_conn *uc);
+// Submits every send queued so far with a single system call
+void uring_io_flush();
+
+// Receives exactly len bytes, 0 if the peer closed the connection
+ssize_t uring_io_recv(struct uring_conn *uc, void *buf, size_t len);
+
+// Wakes a blocked receiver up, the connection goes away with uring_io_free()
+void uring_io_close(struct uring_conn *uc);
+void uring_io_free(struct uring_conn *uc);
@@ -0,0 +1,434 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "world.h"
+
+unsigned char ball_type[MAX_BALLS];
+ball_info_t ball_info[MAX_BALLS];
+
+int active[PRIZE + 1][MAX_BALLS];
+int n_active[PRIZE + 1];
+int active_pos[MAX_BALLS];
+
+static struct world_hooks hooks;
+
+// Ball in each cell of the board, dense at this size but split in chunks
+// that are only there while something is in them on big boards
+static struct chunk_grid board_grid;
+
+// Set while moves are applied from several threads at once, chunks that got
+// empty are only freed outside of that
+static bool concurrent;
+
+// Which cells of board_grid are taken (walls included), for the searches
+// that only need to know that. Only grid_set() writes either of them
+static struct bitboard occupied;
+
+// Bumped by every grid_set(), the bots' flow field is rebuilt only when it
+// changed since the last one. That is once per bot tick, not per move: on
+// this board a rebuild is one pass over 400 cells (a few microseconds),
+// less than keeping distances up to date through every move in between
+static unsigned long grid_version;
+
+// Where the balls are, for the queries about what is near a cell. Balls are
+// added once they are on the board and follow their moves, concurrent moves
+// are left for whoever drives them to index afterwards
+static struct spatial_index ball_index;
+
+// Way from every cell to the nearest player or prize, shared by all the bots
+static struct flow_field chase_flow;
+static unsigned long chase_flow_version = -1;
+
+void world_init(const struct world_hooks *world_hooks)
+{
+	hooks = *world_hooks;
+
+	chunk_grid_init(&board_grid, WINDOW_SIZE, WINDOW_SIZE);
+	flow_init(&chase_flow, WINDOW_SIZE, WINDOW_SIZE);
+	spatial_init(&ball_index, WINDOW_SIZE, WINDOW_SIZE, BALL_INDEX_BUCKET, MAX_BALLS, PRIZE + 1);
+
+	// The border is wall, never free
+	bitboard_init(&occupied, WINDOW_SIZE, WINDOW_SIZE);
+	for (int i = 0; i < WINDOW_SIZE; i++)
+	{
+		bitboard_set(&occupied, i, 0);
+		bitboard_set(&occupied, i, WINDOW_SIZE - 1);
+		bitboard_set(&occupied, 0, i);
+		bitboard_set(&occupied, WINDOW_SIZE - 1, i);
+	}
+
+	for (int i = 0; i < MAX_BALLS; i++)
+		clear_ball(i);
+}
+
+int world_rand()
+{
+	return hooks.rand != NULL ? hooks.rand() : rand();
+}
+
+unsigned int world_hash()
+{
+	unsigned int hash = 2166136261u;
+
+	for (int i = 0; i < MAX_BALLS; i++)
+	{
+		int slot[5] = {ball_type[i], ball_info[i].pos_x, ball_info[i].pos_y, ball_info[i].hp, ball_info[i].ch};
+		for (int j = 0; j < 5; j++)
+			hash = (hash ^ (unsigned int)slot[j]) * 16777619u;
+	}
+	return hash;
+}
+
+void world_set_concurrent(bool on)
+{
+	concurrent = on;
+}
+
+int grid_get(int x, int y)
+{
+	return chunk_grid_get(&board_grid, x, y);
+}
+
+// Chunks emptied are freed when the next ball is put somewhere, so one moving
+// within a chunk keeps it
+void grid_set(int x, int y, int index)
+{
+	__atomic_add_fetch(&grid_version, 1, __ATOMIC_RELAXED);
+
+	// Without memory for its chunk the cell stays empty, in the bitboard too
+	// so the two never disagree (only boards past CHUNK_GRID_DENSE_CELLS
+	// have chunks)
+	if (!chunk_grid_set(&board_grid, x, y, index))
+		return;
+
+	if (index == -1)
+	{
+		bitboard_clear(&occupied, x, y);
+	}
+	else
+	{
+		bitboard_set(&occupied, x, y);
+		if (!concurrent)
+			chunk_grid_release(&board_grid);
+	}
+}
+
+static void changed(int index, const ball_info_t *info)
+{
+	if (hooks.changed != NULL)
+		hooks.changed(index, info);
+}
+
+void set_ball_type(int index, int type)
+{
+	int old = ball_type[index];
+	if (old == type)
+		return;
+
+	// Removed by moving the last one of the list to its place
+	if (old != EMPTY) {
+		int last = active[old][--n_active[old]];
+		active[old][active_pos[index]] = last;
+		active_pos[last] = active_pos[index];
+	}
+
+	if (type != EMPTY) {
+		active_pos[index] = n_active[type];
+		active[type][n_active[type]++] = index;
+	}
+
+	ball_type[index] = type;
+	changed(index, &ball_info[index]);
+
+	if (type == EMPTY)
+		spatial_remove(&ball_index, index);
+}
+
+void clear_ball(int index)
+{
+	set_ball_type(index, EMPTY);
+	memset(&ball_info[index], 0, sizeof(ball_info_t));
+}
+
+void index_ball(int index)
+{
+	if (ball_type[index] != EMPTY)
+		spatial_place(&ball_index, index, ball_type[index], ball_info[index].pos_x, ball_info[index].pos_y);
+}
+
+void place_ball(int index)
+{
+	grid_set(ball_info[index].pos_x, ball_info[index].pos_y, index);
+	index_ball(index);
+}
+
+void take_ball(int index)
+{
+	grid_set(ball_info[index].pos_x, ball_info[index].pos_y, -1);
+}
+
+void eat_ball(int index)
+{
+	clear_ball(index);
+	if (hooks.eaten != NULL)
+		hooks.eaten(index);
+}
+
+bool random_free_cell(int *x, int *y)
+{
+	int n_free = bitboard_count_free(&occupied);
+	if (n_free == 0)
+		return false;
+
+	int cell = bitboard_nth_free(&occupied, world_rand() % n_free);
+	*x = cell % WINDOW_SIZE;
+	*y = cell / WINDOW_SIZE;
+	return true;
+}
+
+ball_info_t create_ball()
+{
+	ball_info_t new_ball;
+
+	// Select a random character to assign to the player
+	char rand_char;
+
+	rand_char = world_rand() % ('Z' - 'A') + 'A';
+
+	// Save player information
+	new_ball.ch = rand_char;
+	new_ball.hp = MAX_HP;
+	// Generate a random position that is not occupied, with no more balls
+	// than BOARD_CELLS there always is one
+	new_ball.pos_x = 0;
+	new_ball.pos_y = 0;
+	random_free_cell(&new_ball.pos_x, &new_ball.pos_y);
+
+	return new_ball;
+}
+
+ball_info_t create_player()
+{
+	ball_info_t new_ball = create_ball();
+	int bot;
+
+	for (int i = 1; i < SPAWN_TRIES; i++)
+	{
+		if (nearest_balls(BALL_MASK(BOT), new_ball.pos_x, new_ball.pos_y, SPAWN_SAFE_DISTANCE, 1, &bot) == 0)
+			break;
+		random_free_cell(&new_ball.pos_x, &new_ball.pos_y);
+	}
+	return new_ball;
+}
+
+int nearest_balls(unsigned int types, int x, int y, int max_dist, int k, int *ids)
+{
+	return spatial_nearest(&ball_index, types, x, y, max_dist, k, ids);
+}
+
+int field_add(ball_info_t *field, int n_field, ball_info_t entry)
+{
+	for (int i = 0; i < n_field; i++) {
+		if (field[i].pos_x == entry.pos_x && field[i].pos_y == entry.pos_y) {
+			field[i] = entry;
+			return n_field;
+		}
+	}
+	if (n_field == MAX_FIELD)
+		return n_field;
+
+	field[n_field] = entry;
+	return n_field + 1;
+}
+
+void apply_effects(struct move_effects *effects)
+{
+	for (int i = 0; i < effects->n_eaten; i++)
+		eat_ball(effects->eaten[i]);
+
+	for (int i = 0; i < effects->n_synced; i++)
+		changed(effects->synced[i], &effects->synced_info[i]);
+}
+
+// Tells about the hp of a ball, now or later
+static void sync_hp(int index, struct move_effects *effects)
+{
+	if (effects == NULL)
+	{
+		changed(index, &ball_info[index]);
+		return;
+	}
+
+	effects->synced_info[effects->n_synced] = ball_info[index];
+	effects->synced[effects->n_synced++] = index;
+}
+
+int apply_move(int ball_id, direction_t dir, ball_info_t *field, int n_field, struct move_effects *effects)
+{
+	// Check if the position the ball wants to move to is clear
+	ball_info_t *local_ball = &ball_info[ball_id];
+	int x = local_ball->pos_x, y = local_ball->pos_y;
+	int new_x = x, new_y = y;
+	switch (dir)
+	{
+	case UP:
+		if (y <= 1)
+		{
+			return n_field;
+		}
+		new_y = y - 1;
+		break;
+	case DOWN:
+		if (y >= WINDOW_SIZE - 2)
+		{
+			return n_field;
+		}
+		new_y = y + 1;
+		break;
+	case LEFT:
+		if (x <= 1)
+		{
+			return n_field;
+		}
+		new_x = x - 1;
+		break;
+	case RIGHT:
+		if (x >= WINDOW_SIZE - 2)
+		{
+			return n_field;
+		}
+		new_x = x + 1;
+		break;
+	default:
+		return n_field;
+	}
+
+	int ball_hit_id = grid_get(new_x, new_y);
+	ball_info_t old_cell = *local_ball;
+	old_cell.ch = ' ';
+
+	// No ball was hit
+	if (ball_hit_id == -1)
+	{
+		// Ball position is updated
+		grid_set(x, y, -1);
+		grid_set(new_x, new_y, ball_id);
+
+		local_ball->pos_x = new_x;
+		local_ball->pos_y = new_y;
+		if (effects == NULL)
+			index_ball(ball_id);
+
+		// First entry indicates old position, second the ball and the new position
+		n_field = field_add(field, n_field, old_cell);
+		return field_add(field, n_field, *local_ball);
+	}
+
+	ball_info_t *ball = &ball_info[ball_id];
+	ball_info_t *ball_hit = &ball_info[ball_hit_id];
+
+	// Player hit a prize
+	if (ball_type[ball_hit_id] == PRIZE && ball_type[ball_id] == PLAYER)
+	{
+		grid_set(x, y, -1);
+		grid_set(new_x, new_y, ball_id);
+
+		// Player's health is updated
+		int prize_hp = ball_hit->hp;
+		int new_hp = ball->hp;
+
+		new_hp += (new_hp + prize_hp > MAX_HP) ? MAX_HP - new_hp : prize_hp;
+
+		if (effects == NULL)
+			eat_ball(ball_hit_id);
+		else
+			effects->eaten[effects->n_eaten++] = ball_hit_id;
+
+		ball->pos_x = new_x;
+		ball->pos_y = new_y;
+		ball->hp = new_hp;
+		if (effects == NULL)
+			index_ball(ball_id);
+		sync_hp(ball_id, effects);
+
+		n_field = field_add(field, n_field, old_cell);
+		return field_add(field, n_field, *ball);
+	}
+
+	// Ball (player or bot) hit a player
+	if (ball_type[ball_hit_id] == PLAYER)
+	{
+		// Ball "steals" 1 HP from the player
+		if (ball_hit->hp > 0) {
+			ball->hp += (ball->hp == MAX_HP) ? 0 : 1;
+			ball_hit->hp -= 1;
+			sync_hp(ball_id, effects);
+			sync_hp(ball_hit_id, effects);
+		}
+
+		n_field = field_add(field, n_field, *ball);
+		return field_add(field, n_field, *ball_hit);
+	}
+
+	return n_field;
+}
+
+void update_chase_flow()
+{
+	static int targets[MAX_BALLS];
+	int n_targets = 0;
+
+	unsigned long version = __atomic_load_n(&grid_version, __ATOMIC_RELAXED);
+	if (version == chase_flow_version)
+		return;
+
+	for_each_ball(i, BALL_MASK(PLAYER) | BALL_MASK(PRIZE))
+		targets[n_targets++] = ball_info[i].pos_y * WINDOW_SIZE + ball_info[i].pos_x;
+
+	flow_build(&chase_flow, &occupied, targets, n_targets);
+	chase_flow_version = version;
+}
+
+// Draws from world_rand() only when there is a choice
+direction_t bot_direction(int index)
+{
+	int x = ball_info[index].pos_x, y = ball_info[index].pos_y;
+
+	unsigned int step = flow_step(&chase_flow, x, y);
+	if (step != 0)
+	{
+		// The BB_* bits are in the order of the directions
+		direction_t dir = __builtin_ctz(step) + UP;
+		int to_x = x + (dir == RIGHT) - (dir == LEFT);
+		int to_y = y + (dir == DOWN) - (dir == UP);
+		int hit = grid_get(to_x, to_y);
+
+		// Bots cannot eat prizes, one next to a prize wanders around it
+		if (hit == -1 || ball_type[hit] == PLAYER)
+			return dir;
+	}
+
+	unsigned int taken = bitboard_neighbors(&occupied, x, y);
+	direction_t dirs[4];
+	int n_dirs = 0;
+
+	for (direction_t dir = UP; dir <= RIGHT; dir++)
+	{
+		// The BB_* bits are in the order of the directions
+		if (taken & (1 << (dir - UP)))
+		{
+			int to_x = x + (dir == RIGHT) - (dir == LEFT);
+			int to_y = y + (dir == DOWN) - (dir == UP);
+			int hit = grid_get(to_x, to_y);
+
+			// Walls and other bots or prizes block the way
+			if (hit == -1 || ball_type[hit] != PLAYER)
+				continue;
+		}
+		dirs[n_dirs++] = dir;
+	}
+
+	if (n_dirs == 0)
+		return NONE;
+	return n_dirs == 1 ? dirs[0] : dirs[world_rand() % n_dirs];
+}
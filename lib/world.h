@@ -0,0 +1,183 @@
+#include <stdbool.h>
+
+#include "bitboard.h"
+#include "chunkgrid.h"
+#include "spatial.h"
+#include "flowfield.h"
+
+// The game itself: the board, the balls on it and the rules of how they
+// move, with no drawing or networking, so anything can drive it in-process.
+// It keeps no locks, whoever drives it keeps the callers of the functions
+// that change it apart (the server with its position and health locks).
+// Functions that pick positions or directions draw from world_rand()
+
+#define WINDOW_SIZE 20 // Window size
+
+// Maximum HP
+#define MAX_HP 10
+// Slots of the ball table, one per cell of the board so slots and cells can
+// share arrays
+#define MAX_BALLS (WINDOW_SIZE * WINDOW_SIZE)
+// Cells inside the wall, the most balls that fit on the board at once.
+// Whoever hands out slots hands out no more than this many, so a ball that
+// got one always finds a free cell
+#define BOARD_CELLS ((WINDOW_SIZE - 2) * (WINDOW_SIZE - 2))
+
+// Most moves of a ball applied together (a BMOV carries up to that many)
+#define MAX_MOVES 8
+// Maximum number of entries in a single field update (two per move in a batch)
+#define MAX_FIELD (2 * MAX_MOVES)
+
+// Side of the buckets of cells the ball index keeps its lists by
+#define BALL_INDEX_BUCKET 4
+
+// New players are put further than this many steps from every bot, if one
+// of SPAWN_TRIES random free cells is
+#define SPAWN_SAFE_DISTANCE 3
+#define SPAWN_TRIES 8
+
+// Direction
+typedef enum direction
+{
+	NONE,
+	UP,
+	DOWN,
+	LEFT,
+	RIGHT
+} direction_t;
+
+// Player information
+typedef struct ball_info
+{
+	int pos_x;
+	int pos_y;
+	int hp;
+	char ch;
+} ball_info_t;
+
+/* Ball types */
+enum ball_type
+{
+	EMPTY,
+	PLAYER,
+	BOT,
+	PRIZE
+};
+
+// What the world tells whoever drives it
+struct world_hooks
+{
+	// A slot changed type or its ball changed hp, info is the ball as it
+	// was then (the change may be applied later, see move_effects)
+	void (*changed)(int index, const ball_info_t *info);
+	// A prize was picked up, its slot is already empty
+	void (*eaten)(int index);
+	// Randomness that shapes the board, rand() if NULL
+	int (*rand)();
+};
+
+// Ball table, stored by column so each scan only touches what it needs:
+// ball_type says what is in each slot and ball_info is what gets drawn and
+// sent (position, hp and glyph)
+extern unsigned char ball_type[MAX_BALLS];
+extern ball_info_t ball_info[MAX_BALLS];
+
+// Dense list of the slots in use by each type, so scans cost what is on the
+// board and not the board area. active_pos is where each slot is in its list
+extern int active[PRIZE + 1][MAX_BALLS];
+extern int n_active[PRIZE + 1];
+extern int active_pos[MAX_BALLS];
+
+// Mask of ball types for the iteration helpers
+#define BALL_MASK(type) (1u << (type))
+#define ANY_BALL (BALL_MASK(PLAYER) | BALL_MASK(BOT) | BALL_MASK(PRIZE))
+
+// Next slot of the lists of the types in the mask, starting at position n of
+// list type, -1 when there are no more
+static inline int next_active(int *type, int *n, unsigned int types)
+{
+	for (; *type <= PRIZE; (*type)++, *n = 0) {
+		if ((types & BALL_MASK(*type)) && *n < n_active[*type])
+			return active[*type][*n];
+	}
+	return -1;
+}
+
+// Loops over the balls of the types in the mask
+#define for_each_ball(i, types) \
+	for (int i##_type = PLAYER, i##_n = 0, i = next_active(&i##_type, &i##_n, types); \
+		 i != -1; i##_n++, i = next_active(&i##_type, &i##_n, types))
+
+// What moves do to the state the whole table shares (slot lists, prizes and
+// whatever the hooks keep). Moves resolved at the same time in different
+// regions of the board keep it here, to be applied in the order of the inputs
+struct move_effects
+{
+	int eaten[MAX_MOVES]; // Prizes picked up
+	int n_eaten;
+	int synced[2 * MAX_MOVES]; // Balls whose hp changed, with the hp they got
+	ball_info_t synced_info[2 * MAX_MOVES];
+	int n_synced;
+};
+
+// Empty board (the border is wall) and ball table
+void world_init(const struct world_hooks *hooks);
+
+// Randomness that shapes the board
+int world_rand();
+
+// FNV-1a over every slot of the ball table
+unsigned int world_hash();
+
+// Set while moves are applied from several threads at once (on balls that
+// cannot reach each other's cells), only then is it safe
+void world_set_concurrent(bool concurrent);
+
+// Ball in a cell, -1 if none
+int grid_get(int x, int y);
+// Puts a ball (or -1 for none) in a cell
+void grid_set(int x, int y, int index);
+
+// Changes what is in a slot, keeping the active lists up to date
+void set_ball_type(int index, int type);
+// Empties a slot of the table
+void clear_ball(int index);
+
+// Puts a ball that just got its slot type and position on the board
+void place_ball(int index);
+// Takes a ball off the board, its slot stays until it is cleared
+void take_ball(int index);
+// Brings the ball index up to date with where a ball is
+void index_ball(int index);
+// Takes a prize somebody picked up off the table
+void eat_ball(int index);
+
+// Picks a free cell at random, returns false if the board is full
+bool random_free_cell(int *x, int *y);
+// A ball with a random glyph in a random free cell, there must be one (see
+// BOARD_CELLS)
+ball_info_t create_ball();
+// A ball for a new player, away from the bots if the board leaves room
+ball_info_t create_player();
+
+// The up to k balls of the types in the mask nearest to a cell and no
+// further than max_dist steps (-1 for any distance), nearest first
+int nearest_balls(unsigned int types, int x, int y, int max_dist, int k, int *ids);
+
+// Adds an entry to a field update list, replacing any previous entry for the
+// same cell so a batch only has the final state of each cell
+int field_add(ball_info_t *field, int n_field, ball_info_t entry);
+
+// Applies a single move of a ball, adding the changed cells to the field list
+// What it does to the shared state is held back in effects unless it is NULL
+int apply_move(int ball_id, direction_t dir, ball_info_t *field, int n_field, struct move_effects *effects);
+// Applies what a batch of moves held back
+void apply_effects(struct move_effects *effects);
+
+// Rebuilds the flow field the bots follow if the board changed since it was
+// built
+void update_chase_flow();
+// Picks the direction of a bot, the way to the nearest player or prize when
+// that cell is free or the player, otherwise a random one among the ones it
+// can actually go, NONE if it is boxed in. The flow field must be up to date
+direction_t bot_direction(int index);
@@ -1,16 +1,44 @@
 #include "../lib/board.h"
+#include "../lib/snapshot.h"
+#include "../lib/delta.h"
+#include "../lib/scoreboard.h"
 #include "../lib/stack.h"
+#include "../lib/impair.h"
+#include "../lib/conn.h"
+#include "../lib/shm_ring.h"
+#include "../lib/uring.h"
+#include "../lib/mpsc.h"
+#include "../lib/pool.h"
+#include "../lib/tasks.h"
+#include "../lib/alloctrack.h"
 
-// Server Socket
+// Server Socket, the local one for shared memory clients is SOCKET_PREFIX-<port>
 #define SOCKET_PREFIX "/tmp/chase-socket"
 
-// Maximum HP
-#define MAX_HP 10
-// Maximum number of balls is the area available in the board
-#define MAX_BALLS (WINDOW_SIZE * WINDOW_SIZE)
 // Maximum number of prizes
 #define MAX_PRIZES 10
 
+// Period (in milliseconds) at which the client samples and sends its input
+#define INPUT_TICK_MS 50
+
+// Capabilities requested by the client in CONN and granted by the server in BINFO
+#define CAP_UDP 0x1 // BMOV and FDELTA are exchanged over a UDP side channel
+#define CAP_SNAP 0x2 // Full board snapshots are sent as a single FSNAP
+#define CAP_SPECTATE 0x4 // Watch only, no ball and no input (implies CAP_SNAP)
+#define CAP_RELAY 0x8 // The peer is a chase-relay multiplexing its clients (implies CAP_SNAP)
+#define CAP_RESUME 0x10 // BINFO: token resumes the session, CONN: resume session with token
+
+// Seconds a player whose connection dropped keeps its ball, waiting for the
+// client to come back with its resume token
+#define RESUME_GRACE_S 15
+
+// Sessions are identified by a random tag in the high bits and the ball index
+// in the low bits
+#define SESSION_INDEX_MASK 0xFFFF
+
+// Sequence number comparison that survives wrap around
+#define SEQ_AFTER(a, b) ((int)((unsigned int)(a) - (unsigned int)(b)) > 0)
+
 // Message types
 typedef enum msg_type
 {
@@ -19,7 +47,14 @@ typedef enum msg_type
 	BMOV,
 	FSTATUS,
 	HP0,
-	CONTGAME
+	CONTGAME,
+	FRESET, // Clear the board, a full FSTATUS snapshot follows
+	FSNAP, // Clear the board and draw the compressed snapshot that follows
+	FDELTA, // UDP only, the board as a delta (see delta.h) against state ack
+	ACK, // UDP only, the client has state ack
+	RELAY // Relay link only, len bytes of the stream of relay channel session
+		  // follow (none when the client behind it is gone), anything else
+		  // on the link is a broadcast for every channel
 } msg_type_t;
 
 // Message data
@@ -27,5 +62,26 @@ struct msg_data
 {
 	msg_type_t type;
 	direction_t dir;
+	// BMOV carries up to MAX_MOVES queued directions, applied in order
+	int n_moves;
+	unsigned char moves[MAX_MOVES];
+	// Capabilities (CAP_*) in CONN and BINFO
+	unsigned int flags;
+	// Session the message belongs to, assigned by the server in BINFO
+	unsigned int session;
+	// Sequence number of messages sent over UDP, older ones are dropped
+	// On the stream, the board version a broadcast or snapshot brings the
+	// client to (what a resuming client presents in ack)
+	unsigned int seq;
+	// FSNAP, FDELTA and RELAY are followed by len bytes of payload
+	unsigned int len;
+	// State (FDELTA sequence number) both ends are known to have, the base of
+	// an FDELTA (0 for a keyframe) or the last one the client applied
+	unsigned int ack;
+	// Secret that lets a client resume its session, given in BINFO
+	unsigned int token;
+	// Secret every datagram of a session carries, given in BINFO. A secret
+	// of its own, a datagram seen on the wire must not resume the session
+	unsigned int udp_token;
 	ball_info_t field[2];
 };
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
 
 /* NCurses */
 #include <ncurses.h>
@@ -14,16 +15,31 @@
 
 /* System libraries */
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 
 /* Local libraries */
 #include "../chase.h"
 
 /* Global variables */
-static int server_socket;
+static conn_t server_conn; // TCP stream or shared memory channel to the server
+static bool use_shm; // Whether server_conn is a shared memory channel
+static int caps; // Capabilities asked for when joining
+static int udp_socket = -1; // UDP side channel, if negotiated with the server
+static bool udp_granted; // Whether the server currently takes our moves over UDP
+static unsigned int session;
+static unsigned int resume_token; // Gets our ball back if the connection drops
+static unsigned int udp_token; // Signs our datagrams, the resume token never goes over UDP
+static unsigned int board_seq; // Board version last drawn, sent back when resuming
+static unsigned int udp_tx_seq;
+static unsigned int udp_acked; // Last FDELTA state applied, sent back in every datagram
+static unsigned int udp_generation; // Bumped when joined() installs a new session
 static WINDOW *game_win;
 static WINDOW *stats_win;
+static struct scoreboard scoreboard; // Players on the board, keyed by cell
 static struct sockaddr_in server_address;
+static int sock_port;
+pthread_mutex_t conn_mtx = PTHREAD_MUTEX_INITIALIZER; // Replacing server_conn vs sending on it
 pthread_mutex_t win_mtx = PTHREAD_MUTEX_INITIALIZER;
 bool dead = false; // Flag to be triggered when the player dies
 pthread_mutex_t dead_mtx = PTHREAD_MUTEX_INITIALIZER;
@@ -34,7 +50,9 @@ void disconnect()
 	// In the HP0 case we don't, but we do in any other case
 	// Even in the CTRL + C case
 
-	close(server_socket);
+	conn_close(&server_conn);
+	if (udp_socket != -1)
+		close(udp_socket);
 	endwin();
 	exit(0);
 }
@@ -42,6 +60,50 @@ void disconnect()
 // Function to deal with CTRL + C as a normal disconnect
 void sigint_handler(int signum) { disconnect(); }
 
+// Monotonic clock in milliseconds, used to pace the input ticks
+long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void send_msg(struct msg_data *msg)
+{
+	char buffer[sizeof(struct msg_data)] = {0};
+
+	memcpy(buffer, msg, sizeof(struct msg_data));
+
+	// A message that can not be sent is lost, the receiving thread notices
+	// the connection dropped and resumes the session
+	pthread_mutex_lock(&conn_mtx);
+	conn_send(&server_conn, buffer, sizeof(buffer));
+	pthread_mutex_unlock(&conn_mtx);
+}
+
+// Datagrams are stamped with the session, its UDP token (the server drops
+// any datagram without it), a sequence number and the last state received
+void send_udp(struct msg_data *msg)
+{
+	msg->session = session;
+	msg->udp_token = udp_token;
+	msg->seq = __atomic_add_fetch(&udp_tx_seq, 1, __ATOMIC_RELAXED);
+	msg->ack = __atomic_load_n(&udp_acked, __ATOMIC_RELAXED);
+	impair_sendto(udp_socket, msg, sizeof(struct msg_data), 0, NULL, 0);
+}
+
+// Movement messages go through the UDP side channel when it is active
+void send_move(struct msg_data *msg)
+{
+	if (!__atomic_load_n(&udp_granted, __ATOMIC_RELAXED))
+	{
+		send_msg(msg);
+		return;
+	}
+
+	send_udp(msg);
+}
+
 direction_t get_direction(int direction)
 {
 	// Translate the key pressed to a direction
@@ -64,6 +126,27 @@ direction_t get_direction(int direction)
 	}
 }
 
+// Keeps the scoreboard in step with a cell of the board, a player drawn over
+// a cell replaces whatever was ranked there
+void track_ball(ball_info_t *ball)
+{
+	int cell = ball->pos_y * WINDOW_SIZE + ball->pos_x;
+
+	if (ball->ch >= 'A' && ball->ch <= 'Z')
+		scoreboard_set(&scoreboard, cell, ball);
+	else
+		scoreboard_remove(&scoreboard, cell);
+}
+
+// Redraws the stats window from the scoreboard
+void show_stats()
+{
+	ball_info_t top[MAX_STATS_LINES];
+	int n_top = scoreboard_top(&scoreboard, MAX_STATS_LINES, top);
+
+	update_top_stats(stats_win, top, n_top);
+}
+
 void update_field(WINDOW *win, ball_info_t players[], int n_players)
 {
 	for (int i = 0; i < n_players; i++)
@@ -71,9 +154,352 @@ void update_field(WINDOW *win, ball_info_t players[], int n_players)
 		if (players[i].ch == 0) {
 			continue;
 		}
-		mvwaddch(win, players[i].pos_y, players[i].pos_x, players[i].ch);
+		add_ball(win, &players[i]);
+		track_ball(&players[i]);
+	}
+}
+
+void field_status(struct msg_data *msg)
+{
+	// Ignore field status messages if the player is dead
+	pthread_mutex_lock(&dead_mtx);
+	if (dead)
+	{
+		pthread_mutex_unlock(&dead_mtx);
+		return;
+	}
+	pthread_mutex_unlock(&dead_mtx);
+
+	board_seq = msg->seq;
+
+	/* == Critical Region == */
+	pthread_mutex_lock(&win_mtx);
+	
+	// Print the field
+	update_field(game_win, msg->field, 2);
+	show_stats();
+	board_flush();
+	
+	pthread_mutex_unlock(&win_mtx);
+	/* ===================== */
+}
+
+// Reads the compressed snapshot that follows an FSNAP and redraws the board
+void field_snapshot(struct msg_data *msg)
+{
+	static unsigned char payload[SNAP_MAX_BYTES];
+	static ball_info_t infos[MAX_BALLS + 1];
+
+	if (msg->len == 0 || msg->len > SNAP_MAX_BYTES ||
+		conn_recv(&server_conn, payload, msg->len) <= 0)
+		disconnect();
+
+	int n_infos = snapshot_decode(payload, msg->len, infos);
+	if (n_infos == -1)
+		disconnect();
+	infos[n_infos].ch = 0;
+	board_seq = msg->seq;
+
+	/* == Critical Region == */
+	pthread_mutex_lock(&win_mtx);
+
+	werase(game_win);
+	box(game_win, 0, 0);
+	scoreboard_clear(&scoreboard);
+	update_field(game_win, infos, n_infos);
+	show_stats();
+	board_flush();
+
+	pthread_mutex_unlock(&win_mtx);
+	/* ===================== */
+}
+
+// Draws the cells of state that differ from shown (all of them if full)
+void field_delta(struct board_state *shown, struct board_state *state, bool full)
+{
+	// Ignore field updates if the player is dead, the next ones draw whatever
+	// changed in the meantime
+	pthread_mutex_lock(&dead_mtx);
+	if (dead)
+	{
+		pthread_mutex_unlock(&dead_mtx);
+		return;
+	}
+	pthread_mutex_unlock(&dead_mtx);
+
+	/* == Critical Region == */
+	pthread_mutex_lock(&win_mtx);
+
+	if (full)
+	{
+		werase(game_win);
+		box(game_win, 0, 0);
+		scoreboard_clear(&scoreboard);
+	}
+
+	for (int cell = 0; cell < MAX_BALLS; cell++)
+	{
+		ball_info_t ball = {cell % WINDOW_SIZE, cell / WINDOW_SIZE, state->hp[cell], state->ch[cell]};
+
+		if (ball.ch != 0 && (full || ball.ch != shown->ch[cell] || ball.hp != shown->hp[cell]))
+		{
+			add_ball(game_win, &ball);
+			track_ball(&ball);
+		}
+		else if (ball.ch == 0 && !full && shown->ch[cell] != 0)
+		{
+			delete_ball(game_win, &ball);
+			track_ball(&ball);
+		}
+	}
+	show_stats();
+	board_flush();
+
+	pthread_mutex_unlock(&win_mtx);
+	/* ===================== */
+
+	*shown = *state;
+}
+
+// Clears the board, a full snapshot follows
+void field_reset()
+{
+	/* == Critical Region == */
+	pthread_mutex_lock(&win_mtx);
+	werase(game_win);
+	box(game_win, 0, 0);
+	scoreboard_clear(&scoreboard);
+	wrefresh(game_win);
+	pthread_mutex_unlock(&win_mtx);
+	/* ===================== */
+}
+
+// Thread function to receive the board deltas from the UDP side channel
+void *recv_udp(void *arg)
+{
+	static struct delta_history history;
+	static struct board_state shown; // What the game window shows
+	char buffer[sizeof(struct msg_data) + DELTA_MAX_BYTES];
+	struct msg_data msg;
+	unsigned int last_seq = 0;
+	unsigned int history_session = 0, history_generation = 0;
+
+	while (1)
+	{
+		int nbytes = recv(udp_socket, buffer, sizeof(buffer), 0);
+		if (nbytes < (int)sizeof(struct msg_data))
+			continue;
+
+		// A new session starts its deltas over from sequence 0, what was
+		// kept from the previous one means nothing for it. joined() bumps
+		// the generation before it changes the session, so a new session is
+		// never seen with the old generation
+		unsigned int current_session = __atomic_load_n(&session, __ATOMIC_ACQUIRE);
+		unsigned int current_generation = __atomic_load_n(&udp_generation, __ATOMIC_ACQUIRE);
+		if (current_session != history_session || current_generation != history_generation)
+		{
+			memset(&history, 0, sizeof(history));
+			last_seq = 0;
+			history_session = current_session;
+			history_generation = current_generation;
+		}
+
+		memcpy(&msg, buffer, sizeof(struct msg_data));
+		if (msg.type != FDELTA || msg.len != nbytes - sizeof(struct msg_data))
+			continue;
+
+		// Deltas still on their way for the previous session
+		if (msg.session != current_session)
+			continue;
+
+		// Deltas older than the last one shown are stale, drop them
+		if (last_seq != 0 && !SEQ_AFTER(msg.seq, last_seq))
+			continue;
+
+		// Rebuild the state from the one the server encoded against
+		struct board_state state = {0};
+		if (msg.ack != 0)
+		{
+			struct board_state *base = delta_find(&history, msg.ack);
+			if (base == NULL)
+				continue;
+			state = *base;
+		}
+		if (delta_apply(&state, (unsigned char *)&buffer[sizeof(struct msg_data)], msg.len) == -1)
+			continue;
+
+		delta_store(&history, msg.seq, &state);
+		last_seq = msg.seq;
+
+		// The next deltas can be encoded against this state
+		__atomic_store_n(&udp_acked, msg.seq, __ATOMIC_RELAXED);
+		struct msg_data ack = {0};
+		ack.type = ACK;
+		send_udp(&ack);
+
+		field_delta(&shown, &state, msg.ack == 0);
+	}
+}
+
+// Opens server_conn, returns -1 if the server can not be reached
+int connect_server()
+{
+	if (use_shm)
+	{
+		// The server hands the shared memory rings over its local socket
+		server_conn.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (server_conn.fd == -1)
+			return -1;
+
+		struct sockaddr_un local_address = {0};
+		local_address.sun_family = AF_UNIX;
+		sprintf(local_address.sun_path, "%s-%d", SOCKET_PREFIX, sock_port);
+
+		if (connect(server_conn.fd, (struct sockaddr *)&local_address,
+					sizeof(local_address)) == -1 ||
+			(server_conn.shm = shm_channel_attach(server_conn.fd)) == NULL)
+		{
+			conn_free(&server_conn);
+			return -1;
+		}
 	}
-	wrefresh(win);
+	else
+	{
+		// open socket
+		server_conn.fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (server_conn.fd == -1)
+			return -1;
+
+		// No need to bind address with stream sockets
+
+		// Send connection request
+		if (connect(server_conn.fd, (struct sockaddr *)&server_address,
+					sizeof(server_address)) == -1)
+		{
+			conn_free(&server_conn);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// Sends the CONN message and draws the board the server sends back until the
+// BINFO, which is left in msg. Returns false if the connection is gone
+bool join(struct msg_data *msg)
+{
+	char buffer[sizeof(struct msg_data)] = {0};
+
+	if (conn_send(&server_conn, msg, sizeof(struct msg_data)) == -1)
+		return false;
+
+	do {
+		// Receive board and BINFO messages from server
+		if (conn_recv(&server_conn, buffer, sizeof(buffer)) <= 0)
+			return false;
+
+		memcpy(msg, buffer, sizeof(struct msg_data));
+
+		if (msg->type == FSNAP)
+		{
+			field_snapshot(msg);
+			continue;
+		}
+		else if (msg->type == FRESET)
+		{
+			field_reset();
+			continue;
+		}
+		else if (msg->type == FSTATUS)
+		{
+			board_seq = msg->seq;
+		}
+
+		/* == Critical Region == */
+		pthread_mutex_lock(&win_mtx);
+		update_field(game_win, msg->field, 2);
+		show_stats();
+		board_flush();
+		pthread_mutex_unlock(&win_mtx);
+		/* ===================== */
+
+	} while (msg->type != BINFO);
+
+	return true;
+}
+
+// Takes the session the server gave us, the UDP side channel is only used
+// while the server grants it
+void joined(struct msg_data *msg)
+{
+	if (msg->session != session)
+	{
+		__atomic_store_n(&udp_acked, 0, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&udp_generation, 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&session, msg->session, __ATOMIC_RELEASE);
+	}
+	resume_token = msg->token;
+	udp_token = msg->udp_token;
+	__atomic_store_n(&udp_granted, udp_socket != -1 && (msg->flags & CAP_UDP), __ATOMIC_RELAXED);
+
+	if (udp_granted)
+	{
+		// Let the server learn our UDP address, some of these may be lost
+		struct msg_data hello = {0};
+		hello.type = CONN;
+		for (int i = 0; i < 3; i++)
+			send_udp(&hello);
+	}
+}
+
+// Reconnects after the connection to the server dropped and asks for our ball
+// back, the server only sends the cells that changed since the board we
+// have. If it does not know us any more we join again with a new ball.
+// Returns false if the server can not be reached for RESUME_GRACE_S
+bool resume()
+{
+	if (caps & CAP_SPECTATE)
+		return false;
+
+	/* == Critical Region == */
+	pthread_mutex_lock(&win_mtx);
+	clear_stats(stats_win);
+	mvwprintw(stats_win, 1, 1, "Reconnecting...");
+	wrefresh(stats_win);
+	pthread_mutex_unlock(&win_mtx);
+	/* ===================== */
+
+	long deadline = now_ms() + RESUME_GRACE_S * 1000;
+	while (now_ms() < deadline)
+	{
+		pthread_mutex_lock(&conn_mtx);
+		conn_close(&server_conn);
+		conn_free(&server_conn);
+		bool connected = connect_server() == 0;
+		pthread_mutex_unlock(&conn_mtx);
+
+		struct msg_data msg = {0};
+		msg.type = CONN;
+		msg.flags = caps | CAP_RESUME;
+		msg.session = session;
+		msg.token = resume_token;
+		msg.ack = board_seq;
+
+		if (connected && join(&msg))
+		{
+			// A new ball is alive
+			if (msg.session != session)
+			{
+				pthread_mutex_lock(&dead_mtx);
+				dead = false;
+				pthread_mutex_unlock(&dead_mtx);
+			}
+			joined(&msg);
+			return true;
+		}
+
+		usleep(500 * 1000);
+	}
+	return false;
 }
 
 // Thread function to recieve field status msgs from server
@@ -89,39 +515,29 @@ void *recv_field(void *arg)
 		msg = (struct msg_data){0};
 		memset(buffer, 0, sizeof(buffer));
 
-		// This guarantees all the data is received using socket streams
-		do
-		{
-			char *ptr = &buffer[nbytes];
-			nbytes += recv(server_socket, ptr, sizeof(buffer) - nbytes, 0);
-		} while (nbytes < sizeof(struct msg_data) && nbytes > 0);
-
+		nbytes = conn_recv(&server_conn, buffer, sizeof(buffer));
 		if (nbytes <= 0)
-
-			disconnect();
+		{
+			if (!resume())
+				disconnect();
+			continue;
+		}
 
 		memcpy(&msg, buffer, sizeof(struct msg_data));
 
 		if (msg.type == FSTATUS)
 		{
-			// Ignore field status messages if the player is dead
-			pthread_mutex_lock(&dead_mtx);
-			if (dead)
-			{
-				pthread_mutex_unlock(&dead_mtx);
-				continue;
-			}
-			pthread_mutex_unlock(&dead_mtx);
-
-			/* == Critical Region == */
-			pthread_mutex_lock(&win_mtx);
-			
-			// Print the field
-			update_field(game_win, msg.field, 2);
-			update_stats(stats_win, msg.field);
-			
-			pthread_mutex_unlock(&win_mtx);
-			/* ===================== */
+			field_status(&msg);
+		}
+		else if (msg.type == FSNAP)
+		{
+			field_snapshot(&msg);
+		}
+		else if (msg.type == FRESET)
+		{
+			// We fell behind and the server dropped our updates, clear the
+			// board and wait for the full snapshot that follows
+			field_reset();
 		}
 		else if (msg.type == HP0)
 		{
@@ -131,8 +547,7 @@ void *recv_field(void *arg)
 			pthread_mutex_unlock(&dead_mtx);
 
 			pthread_mutex_lock(&win_mtx);
-			werase(stats_win);
-			box(stats_win, 0, 0);
+			clear_stats(stats_win);
 			mvwprintw(stats_win, 1, 1, "You died :/");
 			mvwprintw(stats_win, 3, 1, "Keep playing?");
 			mvwprintw(stats_win, 5, 1, "Press any key");
@@ -147,11 +562,12 @@ void *recv_field(void *arg)
 
 int main(int argc, char *argv[])
 {
-	int sock_port = 0;
+	bool use_udp = false;
+	bool spectate = false;
 	// get server address and port from command line
 	if (argc < 3)
 	{
-		printf("Usage: %s <server_address> <server_port>\n", argv[0]);
+		printf("Usage: %s <server_address> <server_port> [-u | -s | -w]\n", argv[0]);
 		exit(-1);
 	}
 	else if (inet_addr(argv[1]) == INADDR_NONE)
@@ -164,19 +580,26 @@ int main(int argc, char *argv[])
 		printf("Invalid server port\n");
 		exit(-1);
 	}
-
-	// We want to catch CTRL + C
-	signal(SIGINT, sigint_handler);
-
-	// open socket
-	server_socket = socket(AF_INET, SOCK_STREAM, 0);
-	if (server_socket == -1)
+	else if (argc > 3)
 	{
-		perror("socket: ");
-		exit(-1);
+		// -u asks the server for the UDP side channel for movement traffic
+		// -s attaches to a server on this host through shared memory
+		// -w only watches the game, without a ball
+		if (strcmp(argv[3], "-u") == 0)
+			use_udp = true;
+		else if (strcmp(argv[3], "-s") == 0)
+			use_shm = true;
+		else if (strcmp(argv[3], "-w") == 0)
+			spectate = true;
+		else
+		{
+			printf("Invalid option %s\n", argv[3]);
+			exit(-1);
+		}
 	}
 
-	// No need to bind address with stream sockets
+	// We want to catch CTRL + C
+	signal(SIGINT, sigint_handler);
 
 	// server address
 	server_address.sin_family = AF_INET;
@@ -187,14 +610,29 @@ int main(int argc, char *argv[])
 		exit(-1);
 	}
 
-	// Send connection request
-	if (connect(server_socket, (struct sockaddr *)&server_address,
-				sizeof(server_address)) == -1)
+	if (connect_server() == -1)
 	{
 		perror("connect: ");
 		exit(-1);
 	}
 
+	// The UDP side channel talks to the same address and port
+	if (use_udp)
+	{
+		udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+		if (udp_socket == -1)
+		{
+			perror("socket: ");
+			exit(-1);
+		}
+		if (connect(udp_socket, (struct sockaddr *)&server_address,
+					sizeof(server_address)) == -1)
+		{
+			perror("connect: ");
+			exit(-1);
+		}
+	}
+
 	// Ncurses initialization
 	initscr();
 	cbreak();
@@ -212,49 +650,30 @@ int main(int argc, char *argv[])
 	box(stats_win, 0, 0);
 	wrefresh(stats_win);
 
-	struct msg_data msg;
-	msg.type = CONN;
-
-	int nbytes = 0;
-	char buffer[sizeof(struct msg_data)] = {0};
+	// Every message is drawn as a single frame
+	board_batch(true);
+	scoreboard_init(&scoreboard, MAX_BALLS, MAX_HP);
 
-	// Send message to server
-	nbytes = 0;
-	memset(buffer, 0, sizeof(struct msg_data));
+	struct msg_data msg = {0};
+	msg.type = CONN;
+	caps = (use_udp ? CAP_UDP : 0) | (spectate ? CAP_SPECTATE : 0) | CAP_SNAP;
+	msg.flags = caps;
 
-	memcpy(buffer, &msg, sizeof(struct msg_data));
+	if (!join(&msg))
+		disconnect();
 
-	do
+	// Keep using TCP only if the server did not grant the UDP side channel
+	if (udp_socket != -1 && !(msg.flags & CAP_UDP))
 	{
-		char *ptr = &buffer[nbytes];
-		nbytes += send(server_socket, ptr, sizeof(buffer) - nbytes, 0);
-	} while (nbytes < sizeof(struct msg_data));
-
-	do {
-		// Receive board and BINFO messages from server
-		nbytes = 0;
-		memset(buffer, 0, sizeof(struct msg_data));
-	
-		// This guarantees all the data is received using socket streams
-		do {
-			char *ptr = &buffer[nbytes];
-			nbytes += recv(server_socket, ptr, sizeof(buffer) - nbytes, 0);
-			if (nbytes == -1)
-				{
-					perror("recv: ");
-					disconnect();
-				}
-		} while (nbytes < sizeof(struct msg_data) && nbytes != 0);
-		
-		if (nbytes == 0)
-			disconnect();
-
-		memcpy(&msg, buffer, sizeof(struct msg_data));
-
-		update_field(game_win, msg.field, 2);
-		update_stats(stats_win, msg.field);
-		
-	} while (msg.type != BINFO);
+		close(udp_socket);
+		udp_socket = -1;
+	}
+	else if (udp_socket != -1)
+	{
+		pthread_t udp_thread;
+		pthread_create(&udp_thread, NULL, recv_udp, NULL);
+	}
+	joined(&msg);
 
 	// Create thread to receive field status messages
 	pthread_t recv_thread;
@@ -263,51 +682,82 @@ int main(int argc, char *argv[])
 
 	int key = -1;
 
-	// Read key and send movement messages to server
-	while (1)
+	// Spectators send nothing, they only wait to be told to quit
+	while (spectate)
 	{
-		msg = (struct msg_data){0};
-		msg.type = BMOV;
-
-		// Read key input
 		key = wgetch(game_win);
-
-		// This key check became messier due to the continue game checking
-		pthread_mutex_lock(&dead_mtx);
 		if (key == 27 || key == 'q')
+			disconnect();
+	}
+
+	// Directions queued during the current input tick
+	struct msg_data batch = {0};
+	batch.type = BMOV;
+	long last_flush = 0;
+
+	// Read keys and send the queued directions to the server once per tick
+	while (1)
+	{
+		// Wait for a key, but never past the end of the current tick
+		// if there are directions waiting to be sent
+		if (batch.n_moves == 0)
 		{
-			pthread_mutex_unlock(&dead_mtx);
-			break;
+			wtimeout(game_win, -1);
 		}
-		else if (dead)
+		else
 		{
-			pthread_mutex_lock(&win_mtx);
-			werase(stats_win);
-			box(stats_win, 0, 0);
-			mvwprintw(stats_win, 1, 1, "Reconnecting...");
-			wrefresh(stats_win);
-			pthread_mutex_unlock(&win_mtx);
-			msg.type = CONTGAME;
-			dead = false;
+			long remaining = last_flush + INPUT_TICK_MS - now_ms();
+			wtimeout(game_win, remaining > 0 ? remaining : 0);
 		}
-		else if (!dead && (key == KEY_UP || key == KEY_DOWN || key == KEY_LEFT || key == KEY_RIGHT))
-			msg.dir = get_direction(key);
-		else
+
+		// Read key input
+		key = wgetch(game_win);
+
+		if (key != ERR)
 		{
+			msg = (struct msg_data){0};
+
+			// This key check became messier due to the continue game checking
+			pthread_mutex_lock(&dead_mtx);
+			if (key == 27 || key == 'q')
+			{
+				pthread_mutex_unlock(&dead_mtx);
+				break;
+			}
+			else if (dead)
+			{
+				pthread_mutex_lock(&win_mtx);
+				clear_stats(stats_win);
+				mvwprintw(stats_win, 1, 1, "Reconnecting...");
+				wrefresh(stats_win);
+				pthread_mutex_unlock(&win_mtx);
+				dead = false;
+				pthread_mutex_unlock(&dead_mtx);
+
+				// Directions typed while dead are discarded
+				batch.n_moves = 0;
+				msg.type = CONTGAME;
+				send_msg(&msg);
+				continue;
+			}
+			else if (key == KEY_UP || key == KEY_DOWN || key == KEY_LEFT || key == KEY_RIGHT)
+			{
+				// Key repeats beyond what fits in one message are coalesced
+				// (dropped) until the next tick
+				if (batch.n_moves < MAX_MOVES)
+					batch.moves[batch.n_moves++] = get_direction(key);
+			}
 			pthread_mutex_unlock(&dead_mtx);
-			continue;
 		}
-		pthread_mutex_unlock(&dead_mtx);
 
-		// Send movement message to server
-		nbytes = 0;
-		memset(buffer, 0, sizeof(struct msg_data));
-		memcpy(buffer, &msg, sizeof(struct msg_data));
-		do
+		// Send the queued movements to the server in a single message
+		if (batch.n_moves > 0 && now_ms() - last_flush >= INPUT_TICK_MS)
 		{
-			char *ptr = &buffer[nbytes];
-			nbytes += send(server_socket, ptr, sizeof(buffer) - nbytes, 0);
-		} while (nbytes < sizeof(struct msg_data));
+			batch.dir = batch.moves[0];
+			send_move(&batch);
+			batch.n_moves = 0;
+			last_flush = now_ms();
+		}
 	}
 
 	disconnect();
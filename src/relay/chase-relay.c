@@ -0,0 +1,485 @@
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* Threads */
+#include <pthread.h>
+
+/* System libraries */
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/* Local libraries */
+#include "../chase.h"
+#include "../server/outq.h"
+
+// The relay sits between clients and chase-server and holds a single link to
+// the server for all of them. Client messages go up wrapped in RELAY messages
+// tagged with the channel of the client, broadcasts come down once and are
+// fanned out here, through the same outbound queues the server uses
+
+// Channels are numbered like sessions, the slot in the low bits and a random
+// tag in the high ones, so nothing meant for a previous client of a slot
+// reaches the next one
+#define MAX_CHANNELS MAX_BALLS
+
+// Workers serving the clients, one each, and the stack they get
+#define CLIENT_WORKERS MAX_CHANNELS
+#define CLIENT_STACK_KB 128
+
+// Milliseconds a client has to send its first message before it is dropped,
+// so idle connections do not keep their worker
+#define HANDSHAKE_MS 5000
+
+// Largest message for a single client: a compressed snapshot
+#define PAYLOAD_MAX_BYTES ((int)sizeof(struct msg_data) + SNAP_MAX_BYTES)
+
+/* Channel information structure */
+struct channel
+{
+	bool active; // A client is connected
+	bool joined; // The server sent it something, its queue is open
+	unsigned int id;
+	conn_t conn;
+};
+
+/* Global variables */
+
+// Global so we can orderly close the sockets on CTRL + C
+int listen_socket;
+
+// Link to the server, client threads send on it and the upstream thread
+// reads from it
+static conn_t upstream;
+static pthread_mutex_t mux_upstream = PTHREAD_MUTEX_INITIALIZER;
+
+static struct channel channels[MAX_CHANNELS];
+static pthread_mutex_t mux_channels = PTHREAD_MUTEX_INITIALIZER;
+
+// The board as broadcast by the server, for the clients that fall behind,
+// and the board version it is at
+static struct board_state mirror;
+static unsigned int mirror_seq;
+static pthread_mutex_t mux_mirror = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to deal with CTRL + C as an orderly shutdown
+void sigint_handler(int signum)
+{
+	for (int i = 0; i < MAX_CHANNELS; i++)
+	{
+		if (channels[i].active)
+			conn_close(&channels[i].conn);
+	}
+	conn_close(&upstream);
+	close(listen_socket);
+	exit(0);
+}
+
+// Sends a message of a channel to the server, an empty one tells it the
+// client is gone
+void upstream_send(unsigned int id, const struct msg_data *msg)
+{
+	char buffer[2 * sizeof(struct msg_data)];
+
+	struct msg_data header = {0};
+	header.type = RELAY;
+	header.session = id;
+	header.len = msg != NULL ? sizeof(struct msg_data) : 0;
+
+	memcpy(buffer, &header, sizeof(header));
+	if (msg != NULL)
+		memcpy(&buffer[sizeof(header)], msg, sizeof(struct msg_data));
+
+	/* Critical region upstream start */
+	pthread_mutex_lock(&mux_upstream);
+
+	conn_send(&upstream, buffer, sizeof(header) + header.len);
+
+	pthread_mutex_unlock(&mux_upstream);
+	/* Critical region upstream end */
+}
+
+// Reads a message from the server and its payload (which must fit in
+// PAYLOAD_MAX_BYTES), returns false if the link is gone
+bool upstream_recv(struct msg_data *msg, char *payload)
+{
+	if (conn_recv(&upstream, msg, sizeof(struct msg_data)) <= 0)
+		return false;
+
+	if (msg->type != FSNAP && msg->type != RELAY)
+		return true;
+	if (msg->len > PAYLOAD_MAX_BYTES)
+		return false;
+
+	return msg->len == 0 || conn_recv(&upstream, payload, msg->len) > 0;
+}
+
+// Keeps the copy of the board up to date with a broadcast
+void mirror_apply(struct msg_data *msg, char *payload)
+{
+	/* Critical region mirror start */
+	pthread_mutex_lock(&mux_mirror);
+
+	if (msg->type == FRESET || msg->type == FSNAP || (msg->type == FSTATUS && SEQ_AFTER(msg->seq, mirror_seq)))
+		mirror_seq = msg->seq;
+
+	if (msg->type == FRESET)
+	{
+		memset(&mirror, 0, sizeof(mirror));
+	}
+	else if (msg->type == FSNAP)
+	{
+		ball_info_t balls[MAX_BALLS];
+		int n_balls = snapshot_decode((unsigned char *) payload, msg->len, balls);
+
+		memset(&mirror, 0, sizeof(mirror));
+		for (int i = 0; i < n_balls; i++)
+			board_state_set(&mirror, &balls[i]);
+	}
+	else if (msg->type == FSTATUS)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			// Cells that got empty come as a blank
+			ball_info_t ball = msg->field[i];
+			if (ball.ch == 0)
+				continue;
+			if (ball.ch == ' ')
+				ball.ch = ball.hp = 0;
+
+			board_state_set(&mirror, &ball);
+		}
+	}
+
+	pthread_mutex_unlock(&mux_mirror);
+	/* Critical region mirror end */
+}
+
+// Sends the whole board to a client that fell behind and had its updates
+// dropped, every client of a relay takes compressed snapshots
+void send_keyframe(int slot)
+{
+	char buffer[PAYLOAD_MAX_BYTES];
+	ball_info_t balls[MAX_BALLS];
+	int n_balls = 0;
+	unsigned int seq;
+
+	/* Critical region mirror start */
+	pthread_mutex_lock(&mux_mirror);
+
+	seq = mirror_seq;
+
+	for (int cell = 0; cell < MAX_BALLS; cell++)
+	{
+		if (mirror.ch[cell] != 0)
+		{
+			ball_info_t ball = {cell % WINDOW_SIZE, cell / WINDOW_SIZE, mirror.hp[cell], mirror.ch[cell]};
+			balls[n_balls++] = ball;
+		}
+	}
+
+	pthread_mutex_unlock(&mux_mirror);
+	/* Critical region mirror end */
+
+	struct msg_data msg = {0};
+	msg.type = FSNAP;
+	msg.seq = seq;
+	msg.len = snapshot_encode(balls, n_balls, (unsigned char *) &buffer[sizeof(msg)]);
+	memcpy(buffer, &msg, sizeof(msg));
+
+	outq_push(slot, buffer, sizeof(msg) + msg.len);
+	outq_flush(slot);
+	conn_flush();
+}
+
+// Thread function that reads the link to the server
+void *upstream_thread(void *arg)
+{
+	static char payload[PAYLOAD_MAX_BYTES];
+	struct msg_data msg;
+
+	while (upstream_recv(&msg, payload))
+	{
+		if (msg.type != RELAY)
+		{
+			// A broadcast, encoded once for every client
+			mirror_apply(&msg, payload);
+
+			int size = sizeof(msg) + (msg.type == FSNAP ? msg.len : 0);
+			char buffer[size];
+			memcpy(buffer, &msg, sizeof(msg));
+			memcpy(&buffer[sizeof(msg)], payload, size - sizeof(msg));
+
+			outq_broadcast(buffer, size);
+
+			for (int i = 0; i < MAX_CHANNELS; i++)
+			{
+				if (channels[i].joined)
+					outq_flush(i);
+			}
+			conn_flush();
+			continue;
+		}
+
+		int slot = msg.session & SESSION_INDEX_MASK;
+		if (slot >= MAX_CHANNELS)
+			continue;
+
+		/* Critical region channels start */
+		pthread_mutex_lock(&mux_channels);
+
+		struct channel *channel = &channels[slot];
+
+		if (channel->active && channel->id == msg.session)
+		{
+			if (msg.len == 0)
+			{
+				// The server dropped the player, its client thread wakes up
+				// and finishes
+				conn_close(&channel->conn);
+			}
+			else
+			{
+				// The first message of a client comes right where its
+				// broadcasts start
+				if (!channel->joined)
+				{
+					outq_open(slot, channel->conn);
+					channel->joined = true;
+				}
+				outq_push(slot, payload, msg.len);
+				outq_flush(slot);
+			}
+		}
+
+		pthread_mutex_unlock(&mux_channels);
+		/* Critical region channels end */
+
+		conn_flush();
+	}
+
+	printf("Lost the link to the server\n");
+	sigint_handler(0);
+	return NULL;
+}
+
+// Thread function that handles each client
+void *client_thread(void *arg)
+{
+	conn_t conn = *(conn_t *)arg;
+	free(arg);
+
+	/* Critical region channels start */
+	pthread_mutex_lock(&mux_channels);
+
+	// If every channel is taken reject the client
+	if (stack_is_empty())
+	{
+		pthread_mutex_unlock(&mux_channels);
+		conn_close(&conn);
+		conn_free(&conn);
+		return NULL;
+	}
+
+	int slot = stack_pop();
+	unsigned int id = ((unsigned int)rand() << 16) | slot;
+
+	channels[slot].active = true;
+	channels[slot].joined = false;
+	channels[slot].id = id;
+	channels[slot].conn = conn;
+
+	pthread_mutex_unlock(&mux_channels);
+	/* Critical region channels end */
+
+	struct msg_data msg;
+
+	// Clients only come in over TCP, so the deadline is a receive timeout
+	// that is lifted once the first message is in
+	struct timeval timeout = {HANDSHAKE_MS / 1000, HANDSHAKE_MS % 1000 * 1000};
+	setsockopt(conn.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	bool waiting = true;
+
+	while (conn_recv(&conn, &msg, sizeof(msg)) > 0)
+	{
+		if (waiting)
+		{
+			timeout = (struct timeval){0};
+			setsockopt(conn.fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			waiting = false;
+		}
+
+		if (msg.type == CONN)
+		{
+			// Spectators and relays cannot go through a relay, and players
+			// behind one only get what the relay link does
+			if (msg.flags & (CAP_SPECTATE | CAP_RELAY))
+				break;
+			msg.flags = (msg.flags & ~CAP_UDP) | CAP_SNAP;
+		}
+
+		upstream_send(id, &msg);
+	}
+
+	upstream_send(id, NULL);
+
+	/* Critical region channels start */
+	pthread_mutex_lock(&mux_channels);
+
+	// Closed before the slot can be reused
+	if (channels[slot].joined)
+		outq_close(slot);
+	channels[slot].active = false;
+	channels[slot].joined = false;
+	stack_push(slot);
+
+	pthread_mutex_unlock(&mux_channels);
+	/* Critical region channels end */
+
+	conn_close(&conn);
+	conn_free(&conn);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	// We want to catch CTRL + C
+	signal(SIGINT, sigint_handler);
+	srand(time(NULL));
+
+	int listen_port = 0;
+	int server_port = 0;
+
+	// Check arguments and its restrictions
+	if (argc != 5)
+	{
+		printf("Usage: %s <relay_IP> <relay_port> <server_IP> <server_port>\n", argv[0]);
+		exit(-1);
+	}
+	else if (inet_addr(argv[1]) == INADDR_NONE || inet_addr(argv[3]) == INADDR_NONE)
+	{
+		printf("Invalid IP address\n");
+		exit(-1);
+	}
+	else if ((listen_port = atoi(argv[2])) < 1024 || listen_port > 65535 ||
+			 (server_port = atoi(argv[4])) < 1024 || server_port > 65535)
+	{
+		printf("Invalid port\n");
+		exit(-1);
+	}
+
+	// Connect to the server
+	struct sockaddr_in server_address = {0};
+	server_address.sin_family = AF_INET;
+	server_address.sin_port = htons(server_port);
+	inet_pton(AF_INET, argv[3], &server_address.sin_addr);
+
+	upstream.fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (upstream.fd == -1)
+	{
+		perror("socket: ");
+		exit(-1);
+	}
+	if (connect(upstream.fd, (struct sockaddr *)&server_address, sizeof(server_address)) == -1)
+	{
+		perror("connect: ");
+		exit(-1);
+	}
+
+	// The server sends the whole board and then BINFO
+	struct msg_data msg = {0};
+	msg.type = CONN;
+	msg.flags = CAP_RELAY | CAP_SNAP;
+	conn_send(&upstream, &msg, sizeof(msg));
+
+	static char payload[PAYLOAD_MAX_BYTES];
+	do
+	{
+		if (!upstream_recv(&msg, payload))
+		{
+			printf("The server closed the link\n");
+			exit(-1);
+		}
+		mirror_apply(&msg, payload);
+	} while (msg.type != BINFO);
+
+	if (!(msg.flags & CAP_RELAY))
+	{
+		printf("The server does not take relays\n");
+		exit(-1);
+	}
+
+	// Open the socket for the clients
+	listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+	if (listen_socket == -1)
+	{
+		perror("socket: ");
+		exit(-1);
+	}
+
+	struct sockaddr_in listen_address = {0};
+	listen_address.sin_family = AF_INET;
+	listen_address.sin_port = htons(listen_port);
+	inet_pton(AF_INET, argv[1], &listen_address.sin_addr);
+
+	if (bind(listen_socket, (struct sockaddr *)&listen_address, sizeof(listen_address)) == -1)
+	{
+		perror("bind: ");
+		exit(-1);
+	}
+	if (listen(listen_socket, SOMAXCONN) == -1)
+	{
+		perror("listen: ");
+		exit(-1);
+	}
+
+	// Initialize the channels and their outbound queues
+	stack_init(MAX_CHANNELS);
+	for (int i = MAX_CHANNELS - 1; i >= 0; i--)
+		stack_push(i);
+
+	outq_init(MAX_CHANNELS, send_keyframe);
+	outq_start_writer();
+
+	// Clients past the workers are turned away
+	static struct pool client_pool;
+	if (!pool_init(&client_pool, CLIENT_WORKERS, CLIENT_STACK_KB * 1024))
+	{
+		printf("Could not start the client workers\n");
+		exit(-1);
+	}
+
+	pthread_t link_thread;
+	pthread_create(&link_thread, NULL, upstream_thread, NULL);
+
+	while (1)
+	{
+		int c_fd;
+
+		// This loop is to handle the case when the accept() call is interrupted by a signal
+		do
+		{
+			c_fd = accept(listen_socket, NULL, NULL);
+		} while (c_fd == -1 && errno == EINTR);
+
+		if (c_fd == -1)
+			continue;
+
+		conn_t *thread_arg = malloc(sizeof(conn_t));
+		thread_arg->fd = c_fd;
+		thread_arg->shm = NULL;
+		thread_arg->uring = NULL;
+
+		if (!pool_submit(&client_pool, client_thread, thread_arg))
+		{
+			free(thread_arg);
+			close(c_fd);
+		}
+	}
+}
@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdbool.h>
+#include <semaphore.h>
 
 /* Threads */
 #include <pthread.h>
@@ -15,33 +17,108 @@
 /* System libraries */
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/un.h>
+#include <sys/random.h>
 #include <arpa/inet.h>
 
 /* Local libraries */
 #include "../chase.h"
+#include "outq.h"
+#include "spectate.h"
+#include "sim.h"
 
 // Error handling function
 extern int errno;
 
-/* Client information structure */
-struct client_info
-{
-	int fd;
-	enum client_type
-	{
-		EMPTY,
-		PLAYER,
-		BOT,
-		PRIZE
-	} type;
-	ball_info_t info;
-};
+// Room for the largest snapshot, a FRESET and one FSTATUS per two balls (an
+// FSNAP is always smaller)
+#define SNAPSHOT_MAX_BYTES (((MAX_BALLS + 1) / 2 + 1) * (int)sizeof(struct msg_data))
+
+// UDP clients get a delta against the empty board at least this often (in
+// FDELTA messages), even if they keep acknowledging
+#define DELTA_KEYFRAME_INTERVAL 64
+
+// Milliseconds between the deltas sent to UDP clients, moves in between
+// are folded into one datagram
+#define DELTA_TICK_MS 30
+
+// Maximum number of relay links, their outbound queues go after the player ones
+#define MAX_RELAYS 16
+#define RELAY_QUEUE(relay) (MAX_BALLS + (relay))
+// A relay link carries the queues of every client behind it
+#define RELAY_QUEUE_LIMIT_BYTES (MAX_BALLS * OUTQ_QUEUE_LIMIT_BYTES)
+
+// Workers serving connections, one each, and the stack they get (both can be
+// set with -w and -k). Connections past the workers are turned away.
+// Spectators only hold a worker until the spectator thread takes them over,
+// the spare ones keep a full board from locking them (and the handshakes of
+// joins that will be turned down) out
+#define CLIENT_WORKERS (MAX_BALLS + MAX_RELAYS + HANDSHAKE_WORKERS)
+#define HANDSHAKE_WORKERS 16
+#define CLIENT_STACK_KB 128
 
-/* Args sent by a client thread to a respawn timer thread it creates */
-struct thread_args
+// Milliseconds a connection has to send its first message before it is
+// closed, so idle connections do not keep their worker
+#define HANDSHAKE_MS 5000
+
+// Moves the simulation collects before resolving them at once
+#define SIM_BATCH_MOVES 1024
+
+// Most regions the simulation splits the board in to resolve moves
+#define SIM_MAX_REGIONS (WINDOW_SIZE - 2)
+
+// Most bots, and the milliseconds between their moves
+#define MAX_BOTS 10
+#define BOTS_TICK_MS 3000
+
+// Milliseconds between prizes, after the first five
+#define PRIZES_TICK_MS 5000
+
+// Milliseconds a dead player has to continue the game
+#define RESPAWN_MS 10000
+
+// Timers of a player carry its slot and the number of the timer, a timer
+// that is no longer the player's current one finds nothing to do
+#define TIMER_ARG(index, timer) ((void *)((timer) << 16 | (unsigned long)(index)))
+#define TIMER_INDEX(arg) ((int)((unsigned long)(arg) & SESSION_INDEX_MASK))
+#define TIMER_NUMBER(arg) ((unsigned long)(arg) >> 16)
+
+/* Client information structure, only players have one */
+struct client_info
 {
-	int client_index;
-	pthread_t client_thread;
+	conn_t conn;
+
+	// Session assigned at CONN, identifies the client on the UDP channel
+	unsigned int session;
+
+	// UDP side channel state
+	bool udp_enabled;			  // Negotiated in CONN
+	bool udp_ready;				  // The client address is already known
+	struct sockaddr_in udp_addr;
+	unsigned int udp_rx_seq;	  // Last sequence number received
+	unsigned int udp_tx_seq;	  // Last FDELTA sequence number sent
+	unsigned int udp_acked;		  // Last FDELTA state the client applied
+	unsigned int udp_keyframe_seq; // Last FDELTA sent against the empty board
+	unsigned int udp_token;		  // Carried by every datagram of the client
+
+	// Full board snapshots go compressed, negotiated in CONN
+	bool compressed;
+
+	// Players behind a relay have no connection of their own, what is for
+	// them goes down the relay link wrapped in RELAY messages for their channel
+	bool relayed;
+	int relay;
+	unsigned int channel;
+
+	// Respawn timer state while the player is dead
+	bool respawning;
+	unsigned long respawn_timer;
+
+	// Resume state, a detached player lost its connection and keeps its ball
+	// until its grace timer runs out
+	unsigned int token;
+	bool detached;
+	unsigned long grace_timer;
 };
 
 /* Global variables */
@@ -49,20 +126,109 @@ struct thread_args
 // Global so we can orderly close the socket on CTRL + C
 int server_socket;
 
-// Array to store the ball information
-static struct client_info balls[MAX_BALLS];
+// Socket for the UDP side channel (same address and port as the TCP one)
+int udp_socket;
+
+// Local socket where co-located clients ask for a shared memory channel
+int local_socket;
+char local_socket_path[108];
+
+// Per connection state of the players, next to the ball table of the world
+static struct client_info clients[MAX_BALLS];
+
+// Players ranked by hp for the stats window, updated under the health lock
+static struct scoreboard scoreboard;
+
+// Updates the scoreboard entry of a slot after its type or hp changed, the
+// world calls it with the health lock held
+static void ball_changed(int index, const ball_info_t *info)
+{
+	if (ball_type[index] == PLAYER)
+		scoreboard_set(&scoreboard, index, info);
+	else
+		scoreboard_remove(&scoreboard, index);
+}
+
+// Relay links, each one carries the players of a chase-relay
+static bool relay_active[MAX_RELAYS];
+static conn_t relay_conns[MAX_RELAYS];
+static pthread_mutex_t mux_relays = PTHREAD_MUTEX_INITIALIZER;
+
+// Queues messages for a channel of a relay link, an empty message tells the
+// relay to drop the client behind it
+void relay_push(int relay, unsigned int channel, const void *msgs, int len)
+{
+	// Field updates fit on the stack, only bigger payloads go to the heap
+	char stack_buffer[sizeof(struct msg_data) * (MAX_FIELD + 1)];
+	int size = sizeof(struct msg_data) + len;
+	char *buffer = size <= sizeof(stack_buffer) ? stack_buffer : malloc(size);
+
+	// A lost frame is never sent again (it may be the snapshot or BINFO of
+	// the client), so without memory for it the relay is told to drop the
+	// client instead, the drop needs no heap and the client can join again
+	if (buffer == NULL)
+	{
+		relay_push(relay, channel, NULL, 0);
+		return;
+	}
+
+	struct msg_data msg = {0};
+	msg.type = RELAY;
+	msg.session = channel;
+	msg.len = len;
+
+	memcpy(buffer, &msg, sizeof(msg));
+	if (len > 0)
+		memcpy(&buffer[sizeof(msg)], msgs, len);
+
+	outq_push(RELAY_QUEUE(relay), buffer, size);
+	if (buffer != stack_buffer)
+		free(buffer);
+}
+
+// Queues messages for a player, wherever it is connected
+void player_push(int index, const void *msgs, int len)
+{
+	if (clients[index].detached)
+		return;
+
+	if (clients[index].relayed)
+		relay_push(clients[index].relay, clients[index].channel, msgs, len);
+	else
+		outq_push(index, msgs, len);
+}
+
+void player_flush(int index)
+{
+	outq_flush(clients[index].relayed ? RELAY_QUEUE(clients[index].relay) : index);
+}
+
+// Version of the board, bumped by every broadcast, and the version each cell
+// last changed at, so a resuming client only gets the cells that changed
+// since the version it has. Broadcasts go into the ring in version order
+static unsigned int board_seq;
+static unsigned int cell_seq[WINDOW_SIZE * WINDOW_SIZE];
+static pthread_mutex_t mux_board_seq = PTHREAD_MUTEX_INITIALIZER;
 
-// Matrix to store the board state
-static int board_grid[WINDOW_SIZE][WINDOW_SIZE] = {0};
+// Board states sent to each UDP client, deltas are encoded against the one
+// the client acknowledged last
+static struct delta_history udp_history[MAX_BALLS];
+static pthread_mutex_t mux_delta = PTHREAD_MUTEX_INITIALIZER;
 
 // These variables are to limit access to the free spaces stack
 static pthread_mutex_t mux_free_spaces = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond_free_spaces = PTHREAD_COND_INITIALIZER;
 
 // Tracks the number of prizes on the board
 static int n_prizes;
 static pthread_mutex_t mux_n_prizes = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond_n_prizes = PTHREAD_COND_INITIALIZER;
+
+// Bots, put on the board once and then moved every BOTS_TICK_MS
+static int n_bots;
+static int bot_index[MAX_BOTS];
+static ball_info_t bots[MAX_BOTS];
+
+// Last timer handed to a player, under the health lock
+static unsigned long timer_seq;
 
 // The two main critical regions are the access to ball positions and health
 static pthread_mutex_t mux_health = PTHREAD_MUTEX_INITIALIZER;
@@ -76,351 +242,484 @@ static pthread_mutex_t mux_stats_win = PTHREAD_MUTEX_INITIALIZER;
 // Function to deal with CTRL + C as an orderly shutdown
 void sigint_handler(int signum)
 {
-	for (int i = 0; i < MAX_BALLS; i++)
-	{
-		if (balls[i].type == PLAYER)
-			close(balls[i].fd);
+	for_each_ball(i, BALL_MASK(PLAYER)) {
+		if (!clients[i].relayed && !clients[i].detached)
+			conn_close(&clients[i].conn);
+	}
+	for (int r = 0; r < MAX_RELAYS; r++) {
+		if (relay_active[r])
+			conn_close(&relay_conns[r]);
 	}
 	close(server_socket);
+	close(udp_socket);
+	close(local_socket);
+	unlink(local_socket_path);
 	endwin();
+	ALLOC_REPORT(stderr);
 	exit(0);
 }
 
-// Thread function to broadcast the field status to all clients
+// Copies every cell of the board, also used by the spectator thread
+void capture_world(struct board_state *world)
+{
+	memset(world, 0, sizeof(*world));
+
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
+
+	for_each_ball(i, ANY_BALL)
+		board_state_set(world, &ball_info[i]);
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+}
+
+// Sends every UDP client the whole board as a delta against the last state it
+// acknowledged, a lost datagram is just covered by the next one. Runs every
+// DELTA_TICK_MS, a tick with no change since the last one only sends to the
+// clients that never got a delta
+void send_deltas()
+{
+	static struct board_state world, empty;
+	static char buffer[sizeof(struct msg_data) + DELTA_MAX_BYTES];
+	static unsigned int sent_seq;
+
+	/* Critical region board sequence start */
+	pthread_mutex_lock(&mux_board_seq);
+	bool changed = board_seq != sent_seq;
+	sent_seq = board_seq;
+	pthread_mutex_unlock(&mux_board_seq);
+	/* Critical region board sequence end */
+
+	/* Critical region delta start */
+	pthread_mutex_lock(&mux_delta);
+
+	bool captured = false;
+
+	for_each_ball(i, BALL_MASK(PLAYER)) {
+		if (!clients[i].udp_ready)
+			continue;
+
+		struct client_info *client = &clients[i];
+		struct msg_data *msg = (struct msg_data *) buffer;
+
+		if (!changed && client->udp_tx_seq != 0)
+			continue;
+
+		// The board is captured once per tick, for every client that needs it
+		if (!captured) {
+			capture_world(&world);
+			captured = true;
+		}
+
+		// 0 means no state at all
+		unsigned int seq = ++client->udp_tx_seq;
+		if (seq == 0)
+			seq = ++client->udp_tx_seq;
+
+		struct board_state *base = NULL;
+		if (seq - client->udp_keyframe_seq < DELTA_KEYFRAME_INTERVAL)
+			base = delta_find(&udp_history[i], client->udp_acked);
+		if (base == NULL)
+			client->udp_keyframe_seq = seq;
+
+		memset(msg, 0, sizeof(struct msg_data));
+		msg->type = FDELTA;
+		msg->session = client->session;
+		msg->seq = seq;
+		msg->ack = base != NULL ? client->udp_acked : 0;
+		msg->len = delta_encode(base != NULL ? base : &empty, &world,
+								(unsigned char *) &buffer[sizeof(struct msg_data)]);
+
+		delta_store(&udp_history[i], seq, &world);
+
+		impair_sendto(udp_socket, buffer, sizeof(struct msg_data) + msg->len, 0,
+					  (struct sockaddr *) &client->udp_addr, sizeof(client->udp_addr));
+	}
+
+	pthread_mutex_unlock(&mux_delta);
+	/* Critical region delta end */
+}
+
+// Task that sends the deltas, every DELTA_TICK_MS
+void delta_tick(void *arg)
+{
+	send_deltas();
+	task_after(DELTA_TICK_MS, delta_tick, NULL);
+}
+
+// Broadcasts the field status to all clients, called right on the thread that
+// changed the board (it used to get a thread of its own every time)
+// The argument is a list of changed entries terminated by an entry with ch == 0
+// (at most MAX_FIELD), sent as consecutive FSTATUS messages in a single pass
 void *field_update(void *arg)
 {
 	ball_info_t *field = (ball_info_t *) arg;
-	
-	struct msg_data msg = {0};
+	ALLOC_PHASE_BEGIN("broadcast");
+
+	int n_field = 0;
+	while (n_field < MAX_FIELD && field[n_field].ch != 0)
+		n_field++;
+
+	int n_msgs = (n_field + 1) / 2;
+	struct msg_data msgs[(MAX_FIELD + 1) / 2] = {0};
+
+	for (int i = 0; i < n_field; i++) {
+		msgs[i / 2].type = FSTATUS;
+		msgs[i / 2].field[i % 2] = field[i];
+	}
+
+	int size = n_msgs * sizeof(struct msg_data);
+
+	if (n_msgs > 0) {
+		/* Critical region board sequence start */
+		pthread_mutex_lock(&mux_board_seq);
+
+		unsigned int seq = ++board_seq;
+		for (int i = 0; i < n_msgs; i++)
+			msgs[i].seq = seq;
+		for (int i = 0; i < n_field; i++)
+			cell_seq[field[i].pos_y * WINDOW_SIZE + field[i].pos_x] = seq;
 
-	msg.type = FSTATUS;
-	msg.field[0] = field[0];
-	msg.field[1] = field[1];
+		// Encoded once for every stream client, each one sends it straight
+		// from the broadcast ring
+		outq_broadcast(msgs, size);
+
+		pthread_mutex_unlock(&mux_board_seq);
+		/* Critical region board sequence end */
 
-	for (int i = 0; i < MAX_BALLS; i++) {
 		// Send to (active) clients only
-		if (balls[i].type != PLAYER)
-			continue;
+		for_each_ball(i, BALL_MASK(PLAYER)) {
+			// UDP clients get deltas instead
+			if (clients[i].udp_ready)
+				continue;
 
-		// Send message to client
-		int nbytes = 0;
-		char buffer[sizeof(struct msg_data)] = {0};
+			// Never blocks, slow clients only fall behind on the ring
+			outq_flush(i);
+		}
 
-		memcpy(buffer, &msg, sizeof(struct msg_data));
+		// Relays get the broadcast once and fan it out to their clients
+		for (int r = 0; r < MAX_RELAYS; r++) {
+			if (relay_active[r])
+				outq_flush(RELAY_QUEUE(r));
+		}
 
-		do {
-			char *ptr = &buffer[nbytes];
-			nbytes += send(balls[i].fd, ptr, sizeof(buffer) - nbytes, MSG_NOSIGNAL);
-		} while (nbytes < sizeof(struct msg_data));
+		// Backends that batch submit the sends to every client at once
+		conn_flush();
 	}
 
-	pthread_mutex_lock(&mux_health);
+	// The scoreboard is kept up to date as hp changes, only the top is read
+	ball_info_t top[MAX_STATS_LINES];
 
-	ball_info_t balls_copy[MAX_BALLS] = {0};
-	int f_index = 0;
-	
-	for (int i = 0; i < MAX_BALLS; i++) {
-		if (balls[i].type != PLAYER)
-			continue;
-		memcpy(&balls_copy[f_index++], &balls[i].info, sizeof(ball_info_t));
-	}
-	
+	pthread_mutex_lock(&mux_health);
+	int n_top = scoreboard_top(&scoreboard, MAX_STATS_LINES, top);
 	pthread_mutex_unlock(&mux_health);
 
 	/* Critical region stat window start */
 	pthread_mutex_lock(&mux_stats_win);
 	
-	update_stats(stats_win, balls_copy);
+	update_top_stats(stats_win, top, n_top);
+
+	// Everything drawn since the last update goes to the screen at once
+	board_flush();
 	
 	pthread_mutex_unlock(&mux_stats_win);
 	/* Critical region stat window end */
 
+	ALLOC_PHASE_END();
 	return NULL;
 }
 
+// Randomness that shapes the board, which a simulation has to replay
+static int board_rand()
+{
+	return sim_running() ? (int)(sim_rand() & RAND_MAX) : rand();
+}
 
-ball_info_t create_ball()
+// Writes the whole board to buf and returns the bytes used, as a single FSNAP
+// for clients that negotiated compressed snapshots or as FSTATUS messages
+// (after a FRESET if reset is set) otherwise
+// The caller must hold the health lock
+int build_snapshot(bool compressed, bool reset, char *buf)
 {
-	ball_info_t new_ball;
+	struct msg_data *msgs = (struct msg_data *) buf;
 
-	// Select a random character to assign to the player
-	char rand_char;
+	// The snapshot has every broadcast already in the ring
+	pthread_mutex_lock(&mux_board_seq);
+	unsigned int seq = board_seq;
+	pthread_mutex_unlock(&mux_board_seq);
 
-	rand_char = rand() % ('Z' - 'A') + 'A';
+	if (compressed) {
+		ball_info_t infos[MAX_BALLS];
+		int n_infos = 0;
 
-	// Save player information
-	new_ball.ch = rand_char;
-	new_ball.hp = MAX_HP;
-	// Generate a random position that is not occupied
-	do
-	{
-		new_ball.pos_x = rand() % (WINDOW_SIZE - 2) + 1;
-		new_ball.pos_y = rand() % (WINDOW_SIZE - 2) + 1;
-	} while (board_grid[new_ball.pos_x][new_ball.pos_y] != -1);
+		for_each_ball(i, ANY_BALL)
+			infos[n_infos++] = ball_info[i];
+
+		memset(&msgs[0], 0, sizeof(struct msg_data));
+		msgs[0].type = FSNAP;
+		msgs[0].seq = seq;
+		msgs[0].len = snapshot_encode(infos, n_infos, (unsigned char *) &msgs[1]);
+
+		return sizeof(struct msg_data) + msgs[0].len;
+	}
+
+	int n_msgs = 0;
+	int j = 0;
+
+	if (reset) {
+		memset(&msgs[n_msgs], 0, sizeof(struct msg_data));
+		msgs[n_msgs].seq = seq;
+		msgs[n_msgs++].type = FRESET;
+	}
+
+	for_each_ball(i, ANY_BALL) {
+		if (j == 0) {
+			memset(&msgs[n_msgs], 0, sizeof(struct msg_data));
+			msgs[n_msgs].type = FSTATUS;
+			msgs[n_msgs].seq = seq;
+		}
+		msgs[n_msgs].field[j++] = ball_info[i];
+		if (j == 2) {
+			n_msgs++;
+			j = 0;
+		}
+	}
 
-	return new_ball;
+	return (j == 0 ? n_msgs : n_msgs + 1) * sizeof(struct msg_data);
 }
 
-void delete_player(int index)
+// Sends the whole board to a client (or relay link) that fell behind and had
+// its updates dropped, the client clears its board first
+void send_keyframe(int index)
 {
+	static char buffer[SNAPSHOT_MAX_BYTES];
+	static pthread_mutex_t buffer_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+	pthread_mutex_lock(&buffer_mtx);
+
 	/* Critical region position start */
 	pthread_mutex_lock(&mux_position);
 
 	/* Critical region health start */
 	pthread_mutex_lock(&mux_health);
-	
-	// Delete the player from the board
-	delete_ball(game_win, &balls[index].info);
-	board_grid[balls[index].info.pos_x][balls[index].info.pos_y] = -1;
-	
+
+	// Relays always take compressed snapshots, a plain one is for all the
+	// clients behind it
+	bool compressed = index >= MAX_BALLS || clients[index].compressed;
+	int size = build_snapshot(compressed, true, buffer);
+	outq_push(index, buffer, size);
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+
 	pthread_mutex_unlock(&mux_position);
 	/* Critical region position end */
 
-	// Delete player information
-	close(balls[index].fd);
+	pthread_mutex_unlock(&buffer_mtx);
+
+	outq_flush(index);
+	conn_flush();
+}
+
+// Takes a player off the board, leaving the blank cell in cell. Returns false
+// if it was already gone
+// The caller must hold the position and health locks
+bool remove_player(int index, unsigned int session, ball_info_t *cell)
+{
+	// The player may have already been deleted by its respawn timer
+	if (ball_type[index] != PLAYER || clients[index].session != session)
+		return false;
+	
+	// Delete the player from the board
+	delete_ball(game_win, &ball_info[index]);
+	take_ball(index);
+
+	// Delete player information, the relay drops the client behind it once
+	// it gets the (empty) message. A replay has no connections
+	if (sim_replaying()) {
+		// Nothing to close
+	} else if (clients[index].detached) {
+		// The connection is already gone, the grace timer finds nothing to do
+		clients[index].detached = false;
+	} else if (clients[index].relayed) {
+		relay_push(clients[index].relay, clients[index].channel, NULL, 0);
+	} else {
+		outq_close(index);
+		conn_close(&clients[index].conn);
+	}
 
-	ball_info_t field[2] = {0};
-	field[0] = balls[index].info;
-	field[0].ch = ' ';
+	*cell = ball_info[index];
+	cell->ch = ' ';
 	
-	memset(&balls[index], 0, sizeof(struct client_info));
+	clear_ball(index);
+	memset(&clients[index], 0, sizeof(struct client_info));
+
+	// Slots are only handed out by the run being replayed
+	if (sim_replaying())
+		return true;
 
 	/* Critical region free spaces start */
 	pthread_mutex_lock(&mux_free_spaces);
 
 	stack_push(index);
-	pthread_cond_signal(&cond_free_spaces);
 	
 	pthread_mutex_unlock(&mux_free_spaces);
 	/* Critical region free spaces end */
 
-	pthread_mutex_unlock(&mux_health);
-	/* Critical region health end */
-
-	pthread_t field_update_thread;
-
-	pthread_create(&field_update_thread, NULL, field_update, field);
-	pthread_join(field_update_thread, NULL);
+	return true;
 }
 
-void handle_move(int ball_id, direction_t dir, ball_info_t *local_ball)
+void delete_player(int index, unsigned int session)
 {
-	// Check if the position the ball wants to move to is clear
-	int ball_hit_id;
-	int x = local_ball->pos_x, y = local_ball->pos_y;
-	int new_x, new_y;
-	switch (dir)
+	// The simulation owns the board, the player goes in its next tick
+	if (sim_running())
 	{
-	case UP:
-		if (y <= 1)
-		{
-			return;
-		}
-		new_x = x;
-		new_y = y - 1;
-		
-		/* Critical Region position start */
-		pthread_mutex_lock(&mux_position);
-		
-		ball_hit_id = board_grid[new_x][new_y];
-		break;
-	case DOWN:
-		if (y >= WINDOW_SIZE - 2)
-		{
-			return;
-		}
-		new_x = x;
-		new_y = y + 1;
-		
-		/* Critical Region position start */
-		pthread_mutex_lock(&mux_position);
-		
-		ball_hit_id = board_grid[new_x][new_y];
-		break;
-	case LEFT:
-		if (x <= 1)
-		{
-			return;
-		}
-		new_x = x - 1;
-		new_y = y;
-		
-		/* Critical Region position start */
-		pthread_mutex_lock(&mux_position);
-		
-		ball_hit_id = board_grid[new_x][new_y];
-		break;
-	case RIGHT:
-		if (x >= WINDOW_SIZE - 2)
-		{
-			return;
-		}
-		new_x = x + 1;
-		new_y = y;
-		
-		/* Critical Region position start */
-		pthread_mutex_lock(&mux_position);
-		
-		ball_hit_id = board_grid[new_x][new_y];
-		break;
-	default:
-		break;
+		struct sim_input input = {0};
+		input.kind = SIM_LEAVE;
+		input.index = index;
+		input.session = session;
+		sim_push(&input);
+		return;
 	}
 
-	ball_info_t field[2] = {0};
-
-	// No ball was hit
-	if (ball_hit_id == -1)
-	{
-
-		// Only one ball has moved, first entry indicates
-		// old position
-		field[0] = *local_ball;
-		field[0].ch = ' ';
+	ball_info_t field[MAX_FIELD + 1] = {0};
 
-		// Ball position is updated
-		board_grid[x][y] = -1;
-		board_grid[new_x][new_y] = ball_id;
-
-		move_ball(game_win, &balls[ball_id].info, dir);
+	/* Critical region position start */
+	pthread_mutex_lock(&mux_position);
 
-		pthread_mutex_unlock(&mux_position);
-		/* Critical region position end */
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
 
-		local_ball->pos_x = new_x;
-		local_ball->pos_y = new_y;
+	bool removed = remove_player(index, session, &field[0]);
 
-		// Second entry indicates the player and the new position
-		field[1] = *local_ball;
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
 
-		pthread_t field_update_thread;
+	pthread_mutex_unlock(&mux_position);
+	/* Critical region position end */
 
-		pthread_create(&field_update_thread, NULL, field_update, field);
-		pthread_join(field_update_thread, NULL);
-		
+	if (!removed)
 		return;
-	}
-
-	/* Critical region health start */
-	pthread_mutex_lock(&mux_health);
-	
-	struct client_info ball = balls[ball_id];
-	struct client_info ball_hit = balls[ball_hit_id];
-
-	// Player hit a prize
-	if (ball_hit.type == PRIZE && ball.type == PLAYER)
-	{
-		board_grid[x][y] = -1;
-		board_grid[new_x][new_y] = ball_id;
-
-		// Player's health is updated
-		int prize_hp = ball_hit.info.hp;
-		int new_hp = ball.info.hp;
 
-		new_hp += (new_hp + prize_hp > MAX_HP) ? MAX_HP - new_hp : prize_hp;
-	    
-		balls[ball_id].info.hp = new_hp;
-		balls[ball_id].info.pos_x = new_x;
-		balls[ball_id].info.pos_y = new_y;
+	field_update(field);
+}
 
-		memset(&balls[ball_hit_id], 0, sizeof(struct client_info));
+// Queues the moves of a player for the simulation, which drops them if the
+// session is gone by then
+void sim_move(int index, unsigned int session, const unsigned char *moves, int n_moves)
+{
+	struct sim_input input = {0};
+	input.kind = SIM_MOVE;
+	input.index = index;
+	input.session = session;
+	input.n_moves = n_moves;
+	memcpy(input.moves, moves, n_moves);
+	sim_push(&input);
+}
 
+// Gives back the slot of a prize somebody picked up, the world already
+// emptied it and calls this with the health lock held
+static void prize_eaten(int index)
+{
+	// Slots are only handed out by the run being replayed
+	if (!sim_replaying())
+	{
 		/* Critical region free_spaces start */
 		pthread_mutex_lock(&mux_free_spaces);
 
-		stack_push(ball_hit_id);
-		pthread_cond_signal(&cond_free_spaces);
+		stack_push(index);
 		
 		pthread_mutex_unlock(&mux_free_spaces);
 		/* Critical region free_spaces end */
+	}
 
-		/* Critical region n_prizes start */
-		pthread_mutex_lock(&mux_n_prizes);
-		
-		n_prizes--;
-		pthread_cond_signal(&cond_n_prizes);
-		
-		pthread_mutex_unlock(&mux_n_prizes);
-		/* Critical region n_prizes end */
-		
-		pthread_mutex_unlock(&mux_health);
-		/* Critical region health end */
-		
-		move_ball(game_win, &ball.info, dir);
-		
-		pthread_mutex_unlock(&mux_position);
-		/* Critical region position end */
-
-		field[0] = *local_ball;
-		field[0].ch = ' ';
+	/* Critical region n_prizes start */
+	pthread_mutex_lock(&mux_n_prizes);
+	
+	n_prizes--;
+	
+	pthread_mutex_unlock(&mux_n_prizes);
+	/* Critical region n_prizes end */
+}
 
-		local_ball->hp = new_hp;
-		local_ball->pos_x = new_x;
-		local_ball->pos_y = new_y;
+// Draws the cells a batch of moves changed
+void draw_field(const ball_info_t *field, int n_field)
+{
+	for (int i = 0; i < n_field; i++)
+	{
+		ball_info_t cell = field[i];
+		add_ball(game_win, &cell);
+	}
+}
 
-		field[1] = *local_ball;
+// Applies a batch of moves of the same ball with a single lock acquisition
+// and a single broadcast of the resulting field changes
+void handle_moves(int ball_id, const unsigned char *moves, int n_moves, ball_info_t *local_ball)
+{
+	ball_info_t field[MAX_FIELD + 1] = {0};
+	int n_field = 0;
+	ALLOC_PHASE_BEGIN("move");
 
-		pthread_t field_update_thread;
+	/* Critical region position start */
+	pthread_mutex_lock(&mux_position);
 
-		pthread_create(&field_update_thread, NULL, field_update, field);
-		pthread_join(field_update_thread, NULL);
-		
-		return;
-	}
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
 
-	// Ball (player or bot) hit a player
-	if (ball_hit.type == PLAYER)
-	{
-		pthread_mutex_unlock(&mux_position);
-		/* Critical region position end */
+	for (int i = 0; i < n_moves; i++)
+		n_field = apply_move(ball_id, moves[i], field, n_field, NULL);
+	draw_field(field, n_field);
 
-		int ball_hit_hp = ball_hit.info.hp;
-		int ball_hp = ball.info.hp;
+	*local_ball = ball_info[ball_id];
 
-		if (ball_hit_hp > 0) {
-			ball_hp += (ball_hp == MAX_HP) ? 0 : 1;
-			ball_hit_hp -= 1;
-		}
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
 
-		// Ball "steals" 1 HP from the player
-		balls[ball_id].info.hp = ball_hp;
-		balls[ball_hit_id].info.hp = ball_hit_hp;
+	pthread_mutex_unlock(&mux_position);
+	/* Critical region position end */
 
-		pthread_mutex_unlock(&mux_health);
-		/* Critical region health end */
+	if (n_field > 0)
+		field_update(field);
 
-		local_ball->hp = ball_hp;
+	ALLOC_PHASE_END();
+}
 
-		ball.info.hp = ball_hp;
-		ball_hit.info.hp = ball_hit_hp;
+void handle_move(int ball_id, direction_t dir, ball_info_t *local_ball)
+{
+	unsigned char move = dir;
+	handle_moves(ball_id, &move, 1, local_ball);
+}
 
-		field[0] = ball.info;
-		field[1] = ball_hit.info;
+// Task that moves the bots, every BOTS_TICK_MS
+void move_bots(void *arg)
+{
+	direction_t dirs[MAX_BOTS];
 
-		pthread_t field_update_thread;
+	// Directions are drawn from one flow field before any bot moves,
+	// moving them one at a time would change the board in between
+	/* Critical region position start */
+	pthread_mutex_lock(&mux_position);
 
-		pthread_create(&field_update_thread, NULL, field_update, field);
-		pthread_join(field_update_thread, NULL);
-			
-		return;
-	}
+	update_chase_flow();
+	for (int i = 0; i < n_bots; i++)
+		dirs[i] = bot_direction(bot_index[i]);
 
-	pthread_mutex_unlock(&mux_health);
-	/* Critical region health end */
-	
 	pthread_mutex_unlock(&mux_position);
 	/* Critical region position end */
 
+	for (int i = 0; i < n_bots; i++)
+	{
+		if (dirs[i] != NONE)
+			handle_move(bot_index[i], dirs[i], &bots[i]);
+	}
+
+	task_after(BOTS_TICK_MS, move_bots, NULL);
 }
 
-// Thread function that handles bots
-void *handle_bots(void *arg)
+// Task that puts the bots on the board and starts moving them
+void spawn_bots(void *arg)
 {
-	int n_bots = *(int *)arg;
-	int bot_index[n_bots];
-	struct client_info bots[n_bots];
-
-	// Create bots
 	for (int i = 0; i < n_bots; i++)
 	{
 		int x;
@@ -432,18 +731,13 @@ void *handle_bots(void *arg)
 		/* Critical region health start */
 		pthread_mutex_lock(&mux_health);
 		
-		do
-		{
-			x = rand() % (WINDOW_SIZE - 2) + 1;
-			y = rand() % (WINDOW_SIZE - 2) + 1;
-		} while (board_grid[x][y] != -1);
+		random_free_cell(&x, &y);
 
 		// Initialize bots information
-		bots[i].type = BOT;
-		bots[i].info.ch = '*';
-		bots[i].info.hp = MAX_HP;
-		bots[i].info.pos_x = x;
-		bots[i].info.pos_y = y;
+		bots[i].ch = '*';
+		bots[i].hp = MAX_HP;
+		bots[i].pos_x = x;
+		bots[i].pos_y = y;
 
 		/* Critical region free_spaces start */
 		pthread_mutex_lock(&mux_free_spaces);
@@ -453,360 +747,1454 @@ void *handle_bots(void *arg)
 		pthread_mutex_unlock(&mux_free_spaces);
 		/* Critical region free_spaces end */
 		
-		memcpy(&balls[bot_index[i]], &bots[i], sizeof(bots[i]));
+		set_ball_type(bot_index[i], BOT);
+		ball_info[bot_index[i]] = bots[i];
 		
-		board_grid[bots[i].info.pos_x][bots[i].info.pos_y] = bot_index[i];
+		place_ball(bot_index[i]);
+
+		pthread_mutex_unlock(&mux_health);
+		/* Critical region health end */
+
+		add_ball(game_win, &bots[i]);
+		
+		pthread_mutex_unlock(&mux_position);
+		/* Critical region position end */
+	}
+
+	task_after(BOTS_TICK_MS, move_bots, NULL);
+}
+
+// Task that puts a prize on the board, the first five right away and then
+// one every PRIZES_TICK_MS if there is room for it
+void spawn_prize(void *arg)
+{
+	static int first_prizes = 0;
+	ball_info_t new_prize;
+	int index = -1;
+
+	/* Critical region n_prizes start */
+	pthread_mutex_lock(&mux_n_prizes);
+	bool full = n_prizes == MAX_PRIZES;
+	pthread_mutex_unlock(&mux_n_prizes);
+	/* Critical region n_prizes end */
+
+	/* Critical region free_spaces start */
+	pthread_mutex_lock(&mux_free_spaces);
+
+	// do nothing if the board is full or there are already
+	// the maximum number of prizes
+	if (!full && !stack_is_empty())
+		index = stack_pop();
+	
+	pthread_mutex_unlock(&mux_free_spaces);
+	/* Critical region free_spaces end */
+
+	if (index == -1)
+	{
+		task_after(PRIZES_TICK_MS, spawn_prize, NULL);
+		return;
+	}
+
+	// Generate the first five prizes
+	if (first_prizes < 5)
+		first_prizes++;
+
+	/* Critical region position start */
+	pthread_mutex_lock(&mux_position);
+	
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
+
+	int x;
+	int y;
+
+	// Generate a random position that is not occupied
+	random_free_cell(&x, &y);
+
+	// Generate a prize with a random value between 1 and 5
+	int value = rand() % 5 + 1;
+
+	new_prize.pos_x = x;
+	new_prize.pos_y = y;
+	new_prize.ch = value + '0';
+	new_prize.hp = value;
+
+	set_ball_type(index, PRIZE);
+	ball_info[index] = new_prize;
+	
+	place_ball(index);
+
+	/* Critical region n_prizes start */
+	pthread_mutex_lock(&mux_n_prizes);
+	n_prizes++;
+	pthread_mutex_unlock(&mux_n_prizes);
+	/* Critical region n_prizes end */
+	
+	add_ball(game_win, &new_prize);
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+	
+	pthread_mutex_unlock(&mux_position);
+	/* Critical region position end */
+	
+	if (first_prizes == 5) {
+		ball_info_t field[MAX_FIELD + 1] = {0};
+		field[0] = new_prize;
+		
+		field_update(field);
+	}
+
+	task_after(first_prizes < 5 ? 0 : PRIZES_TICK_MS, spawn_prize, NULL);
+}
+
+// Task run once a dead player's RESPAWN_MS to continue the game are up
+void respawn_expired(void *arg)
+{
+	int index = TIMER_INDEX(arg);
+
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
+
+	// The player may have continued (and died again) since
+	bool expired = clients[index].respawning && clients[index].respawn_timer == TIMER_NUMBER(arg);
+	unsigned int session = clients[index].session;
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+
+	// If not, just delete the ball and disconnect the player, closing the
+	// connection wakes its client thread up so it can finish
+	if (expired)
+		delete_player(index, session);
+}
+
+// Tells a dead player it died and starts its respawn timer (if not started yet)
+void player_dead(int index)
+{
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
+
+	if (!clients[index].respawning)
+	{
+		// The timer disconnects the client if it expires
+		clients[index].respawning = true;
+		clients[index].respawn_timer = ++timer_seq;
+		task_after(RESPAWN_MS, respawn_expired, TIMER_ARG(index, timer_seq));
+	}
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+
+	struct msg_data msg = {0};
+	msg.type = HP0;
+
+	char buffer[sizeof(struct msg_data)] = {0};
+
+	// Copy the data to a byte buffer so there are no problems with
+	// byte order
+	memcpy(buffer, &msg, sizeof(struct msg_data));
+
+	player_push(index, buffer, sizeof(buffer));
+	player_flush(index);
+	conn_flush();
+}
+
+// Stops the respawn timer of a player that sent a message in time
+void stop_respawn_timer(int index)
+{
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
+
+	// The timer finds nothing to do when it runs
+	clients[index].respawning = false;
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+}
+
+// Task run once a detached player's RESUME_GRACE_S to resume are up
+void grace_expired(void *arg)
+{
+	int index = TIMER_INDEX(arg);
+
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
+
+	// Resuming needs the token, a player that resumed just before is kept
+	// From here on the player is gone, even if the client comes back
+	bool expired = clients[index].detached && clients[index].grace_timer == TIMER_NUMBER(arg);
+	unsigned int session = clients[index].session;
+	if (expired)
+		clients[index].token = 0;
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+
+	if (expired)
+		delete_player(index, session);
+}
+
+// Keeps the ball of a player whose connection dropped, the client has
+// RESUME_GRACE_S to come back for it
+void detach_player(int index, unsigned int session)
+{
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
+
+	if (ball_type[index] != PLAYER || clients[index].session != session || clients[index].detached)
+	{
+		pthread_mutex_unlock(&mux_health);
+		return;
+	}
+
+	if (!clients[index].relayed)
+	{
+		outq_close(index);
+		conn_close(&clients[index].conn);
+	}
+	clients[index].detached = true;
+
+	clients[index].grace_timer = ++timer_seq;
+	task_after(RESUME_GRACE_S * 1000, grace_expired, TIMER_ARG(index, timer_seq));
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+}
+
+// Secret of a session, one resumes the session and another one signs its
+// datagrams. rand() is seeded with the time, so it only fills in if the
+// kernel has no entropy
+static unsigned int random_token()
+{
+	unsigned int token;
+	if (getrandom(&token, sizeof(token), GRND_NONBLOCK) != sizeof(token))
+		token = ((unsigned int)rand() << 16) ^ (unsigned int)rand();
+	return token | 1;
+}
+
+// Thread function that receives the datagrams of the UDP side channel
+void *udp_thread(void *arg)
+{
+	struct msg_data msg;
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+
+	while (1)
+	{
+		addr_len = sizeof(addr);
+		int nbytes = recvfrom(udp_socket, &msg, sizeof(msg), 0, (struct sockaddr *)&addr, &addr_len);
+
+		if (nbytes == -1 && errno == EINTR)
+			continue;
+		if (nbytes != sizeof(struct msg_data))
+			continue;
+
+		// Find the session the datagram belongs to
+		int index = msg.session & SESSION_INDEX_MASK;
+		if (index >= MAX_BALLS)
+			continue;
+
+		/* Critical region health start */
+		pthread_mutex_lock(&mux_health);
+
+		// The session is no secret (its low bits are the slot), only a
+		// datagram carrying the UDP token of the session counts, anything
+		// else could move the player or take its deltas elsewhere
+		if (ball_type[index] != PLAYER || !clients[index].udp_enabled ||
+			clients[index].session != msg.session || clients[index].udp_token != msg.udp_token)
+		{
+			pthread_mutex_unlock(&mux_health);
+			continue;
+		}
+
+		// Messages older than the last one received are stale, drop them
+		if (clients[index].udp_ready && !SEQ_AFTER(msg.seq, clients[index].udp_rx_seq))
+		{
+			pthread_mutex_unlock(&mux_health);
+			continue;
+		}
+		clients[index].udp_rx_seq = msg.seq;
+
+		// The client address is learnt from its datagrams, and only moves
+		// when an authenticated one comes from somewhere else
+		if (!clients[index].udp_ready || clients[index].udp_addr.sin_addr.s_addr != addr.sin_addr.s_addr ||
+			clients[index].udp_addr.sin_port != addr.sin_port)
+			clients[index].udp_addr = addr;
+		if (!clients[index].udp_ready)
+			outq_set_broadcast(index, false);
+		clients[index].udp_ready = true;
+
+		int hp = ball_info[index].hp;
+
+		pthread_mutex_unlock(&mux_health);
+		/* Critical region health end */
+
+		// Every datagram carries the last state the client applied, the next
+		// deltas are encoded against it
+		/* Critical region delta start */
+		pthread_mutex_lock(&mux_delta);
+
+		if (msg.ack != 0 && SEQ_AFTER(msg.ack, clients[index].udp_acked) &&
+			!SEQ_AFTER(msg.ack, clients[index].udp_tx_seq))
+			clients[index].udp_acked = msg.ack;
+
+		pthread_mutex_unlock(&mux_delta);
+		/* Critical region delta end */
+
+		if (msg.type != BMOV)
+			continue;
+
+		stop_respawn_timer(index);
+
+		if (sim_running())
+		{
+			if (msg.n_moves > 0 && msg.n_moves <= MAX_MOVES)
+				sim_move(index, msg.session, msg.moves, msg.n_moves);
+			continue;
+		}
+
+		if (hp == 0)
+		{
+			player_dead(index);
+		}
+		else if (msg.n_moves > 0 && msg.n_moves <= MAX_MOVES)
+		{
+			ball_info_t local_ball;
+			handle_moves(index, msg.moves, msg.n_moves, &local_ball);
+		}
+	}
+}
+
+void *client_thread(void *arg);
+
+static struct pool client_pool;
+
+// Shared by a connection waiting for its first message and its deadline
+// timer, whichever of them is done last frees it
+struct handshake
+{
+	pthread_mutex_t lock;
+	conn_t conn;
+	bool over;
+	int refs;
+};
+
+static void handshake_put(struct handshake *hs)
+{
+	pthread_mutex_lock(&hs->lock);
+	int refs = --hs->refs;
+	pthread_mutex_unlock(&hs->lock);
+
+	if (refs == 0)
+	{
+		pthread_mutex_destroy(&hs->lock);
+		free(hs);
+	}
+}
+
+// Closing the connection wakes its worker up, which then lets it go
+void handshake_expired(void *arg)
+{
+	struct handshake *hs = arg;
+
+	pthread_mutex_lock(&hs->lock);
+	if (!hs->over)
+		conn_close(&hs->conn);
+	hs->over = true;
+	pthread_mutex_unlock(&hs->lock);
+
+	handshake_put(hs);
+}
+
+// Returns false if the deadline already closed the connection
+static bool handshake_done(struct handshake *hs)
+{
+	pthread_mutex_lock(&hs->lock);
+	bool in_time = !hs->over;
+	hs->over = true;
+	pthread_mutex_unlock(&hs->lock);
+
+	handshake_put(hs);
+	return in_time;
+}
+
+// Hands a connection to a worker, or drops it if they are all busy
+void serve_client(conn_t conn)
+{
+	conn_t *thread_arg = malloc(sizeof(conn_t));
+	*thread_arg = conn;
+
+	if (!pool_submit(&client_pool, client_thread, thread_arg))
+	{
+		free(thread_arg);
+		conn_close(&conn);
+		conn_free(&conn);
+	}
+}
+
+// Thread function that attaches co-located clients through shared memory
+void *local_accept_thread(void *arg)
+{
+	while (1)
+	{
+		int c_fd = accept(local_socket, NULL, NULL);
+		if (c_fd == -1)
+			continue;
+
+		// The client gets the rings over the local socket, which is then
+		// only kept open to notice when the client goes away
+		struct shm_channel *shm = shm_channel_create(c_fd);
+		if (shm == NULL)
+		{
+			close(c_fd);
+			continue;
+		}
+
+		serve_client((conn_t){.fd = c_fd, .shm = shm, .uring = NULL});
+	}
+}
+
+/* Per connection state of a player, kept by its client thread or, for the
+   players behind a relay, by the relay link thread */
+struct player_conn
+{
+	struct client_info client;
+	ball_info_t info; // ch is 0 until the player joins
+	int index;
+};
+
+// Puts a new player on the board, in the slot the client got for it, and
+// queues it the board and its BINFO before any broadcast that shows it
+// The caller must hold the position and health locks
+void join_player(struct player_conn *pc, struct msg_data *msg)
+{
+	struct client_info *client = &pc->client;
+	char buffer[sizeof(struct msg_data)];
+	int index = pc->index;
+
+	// Create a new ball structure
+	pc->info = create_player();
+	client->session = ((unsigned int)rand() << 16) | index;
+	client->token = random_token();
+	client->udp_token = random_token();
+
+	// Players behind a relay only get what the relay link does
+	client->udp_enabled = !client->relayed && (msg->flags & CAP_UDP) != 0;
+	client->compressed = client->relayed || (msg->flags & CAP_SNAP) != 0;
+
+	// Send entire board to the new client, it is queued before
+	// the player shows up for the broadcasts
+	if (!client->relayed)
+		outq_open(index, client->conn);
+
+	// Update balls structure with new player, the queue helpers below
+	// need to know how to reach it
+	ball_info[index] = pc->info;
+	clients[index] = *client;
+
+	// No new balls can join while we are sending
+	// the board data
+	
+	/* Critical region free_spaces start */
+	pthread_mutex_lock(&mux_free_spaces);
+
+	// Static, only one client joins at a time. A client that could not
+	// resume clears what it had first
+	static char snapshot[SNAPSHOT_MAX_BYTES];
+	int size = build_snapshot(client->compressed, (msg->flags & CAP_RESUME) != 0, snapshot);
+
+	player_push(index, snapshot, size);
+
+	pthread_mutex_unlock(&mux_free_spaces);
+	/* Critical region free_spaces end */
+	
+	set_ball_type(index, PLAYER);
+
+	// Update the board
+	place_ball(index);
+	add_ball(game_win, &pc->info);
+
+	// Send BINFO message back to the client
+	struct msg_data reply = {0};
+
+	reply.type = BINFO;
+	reply.field[0] = pc->info;
+	reply.session = client->session;
+	reply.token = client->token;
+	reply.udp_token = client->udp_token;
+	reply.flags = (client->udp_enabled ? CAP_UDP : 0) | (client->compressed ? CAP_SNAP : 0) | CAP_RESUME;
+
+	memset(buffer, 0, sizeof(struct msg_data));
+
+	// Copy the data to a byte buffer so there are no problems with
+	// byte order
+	memcpy(buffer, &reply, sizeof(struct msg_data));
+
+	player_push(index, buffer, sizeof(buffer));
+}
+
+// Client threads waiting for the simulation to put their player on the board,
+// by slot (a slot belongs to its client thread until then)
+struct join_request
+{
+	struct player_conn *pc;
+	struct msg_data *msg;
+	sem_t done;
+};
+static struct join_request *joining[MAX_BALLS];
+
+// Board changes of the current simulation tick, the last one of each cell
+static ball_info_t tick_field[MAX_BALLS];
+static int tick_slot[MAX_BALLS]; // Entry of each cell in tick_field, -1 if none
+static int n_tick_field;
+
+// Players that joined and dead players that tried to move during the tick,
+// they are told once the tick is over
+static int tick_joined[MAX_BALLS], n_tick_joined;
+static int tick_dead[MAX_BALLS], n_tick_dead;
+
+static void tick_add(ball_info_t entry)
+{
+	int cell = entry.pos_y * WINDOW_SIZE + entry.pos_x;
+
+	if (tick_slot[cell] == -1)
+		tick_slot[cell] = n_tick_field++;
+	tick_field[tick_slot[cell]] = entry;
+}
+
+// Moves of the current tick waiting to be resolved, in the order they came (a
+// step of a bot is one as well). Every ball only touches the cells within as
+// many steps of it as it has moves in the batch, balls whose cells all fall
+// in the same region of the board and away from any other region's balls are
+// resolved in parallel, one thread per region, and the rest one after the
+// other afterwards. They touch different cells, so the board ends up as if
+// the moves had been applied one by one, and what they did to the shared
+// state is applied in their order
+struct batch_move
+{
+	int ball;
+	unsigned char moves[MAX_MOVES];
+	int n_moves;
+
+	// Results, the ball could not move if it was dead
+	bool dead;
+	ball_info_t field[MAX_FIELD + 1];
+	int n_field;
+	struct move_effects effects;
+};
+static struct batch_move batch[SIM_BATCH_MOVES];
+static int n_batch;
+
+// Regions are strips of columns, 1 resolves everything one by one
+static int sim_regions = 1;
+
+// Region of the cells each ball touches in the batch, -1 if they are shared
+// (ball_shared once they are marked as such)
+static int ball_region[MAX_BALLS];
+static bool ball_shared[MAX_BALLS];
+static int ball_steps[MAX_BALLS][RIGHT + 1]; // Moves of each ball in the batch, by direction
+
+static int column_region(int x)
+{
+	return (x - 1) * sim_regions / (WINDOW_SIZE - 2);
+}
+
+// Cells a ball can reach with its moves in the batch, whichever of them are
+// blocked it never gets further in a direction than the moves it has that way
+static void ball_box(int ball, int *x0, int *y0, int *x1, int *y1)
+{
+	int *steps = ball_steps[ball];
+	*x0 = ball_info[ball].pos_x - steps[LEFT] < 1 ? 1 : ball_info[ball].pos_x - steps[LEFT];
+	*y0 = ball_info[ball].pos_y - steps[UP] < 1 ? 1 : ball_info[ball].pos_y - steps[UP];
+	*x1 = ball_info[ball].pos_x + steps[RIGHT] > WINDOW_SIZE - 2 ? WINDOW_SIZE - 2 : ball_info[ball].pos_x + steps[RIGHT];
+	*y1 = ball_info[ball].pos_y + steps[DOWN] > WINDOW_SIZE - 2 ? WINDOW_SIZE - 2 : ball_info[ball].pos_y + steps[DOWN];
+}
+
+static void resolve_move(struct batch_move *move, bool defer)
+{
+	move->dead = ball_info[move->ball].hp == 0 && ball_type[move->ball] == PLAYER;
+	if (move->dead)
+		return;
+
+	for (int i = 0; i < move->n_moves; i++)
+		move->n_field = apply_move(move->ball, move->moves[i], move->field, move->n_field,
+								   defer ? &move->effects : NULL);
+}
+
+// Task that resolves the moves of the balls of a region
+void resolve_region(void *arg)
+{
+	int region = (int)(long)arg;
+
+	for (int i = 0; i < n_batch; i++)
+	{
+		if (ball_region[batch[i].ball] == region)
+			resolve_move(&batch[i], true);
+	}
+}
+
+// Resolves the moves of the batch
+// The caller must hold the position and health locks
+static void batch_resolve()
+{
+	if (n_batch == 0)
+		return;
+
+	ALLOC_PHASE_BEGIN("move");
+
+	if (sim_regions == 1)
+	{
+		// The reference, every move right away
+		for (int i = 0; i < n_batch; i++)
+			resolve_move(&batch[i], false);
+	}
+	else
+	{
+		static bool shared[WINDOW_SIZE][WINDOW_SIZE];
+		int x0, y0, x1, y1;
+
+		memset(shared, 0, sizeof(shared));
+
+		// Balls reaching into more than one region go last, and so does
+		// any ball that can reach their cells, until no more are added
+		for (int i = 0; i < n_batch; i++)
+		{
+			ball_box(batch[i].ball, &x0, &y0, &x1, &y1);
+			ball_region[batch[i].ball] = column_region(x0) == column_region(x1) ? column_region(x0) : -1;
+		}
+
+		bool changed = true;
+		while (changed)
+		{
+			changed = false;
+			for (int i = 0; i < n_batch; i++)
+			{
+				int ball = batch[i].ball;
+				if (ball_shared[ball])
+					continue;
+
+				ball_box(ball, &x0, &y0, &x1, &y1);
+
+				bool last = ball_region[ball] == -1;
+				for (int x = x0; x <= x1 && !last; x++)
+					for (int y = y0; y <= y1 && !last; y++)
+						last = shared[x][y];
+
+				if (!last)
+					continue;
+
+				for (int x = x0; x <= x1; x++)
+					for (int y = y0; y <= y1; y++)
+						shared[x][y] = true;
+				ball_region[ball] = -1;
+				ball_shared[ball] = true;
+				changed = true;
+			}
+		}
+
+		// Regions are stolen by whichever workers are free, this thread
+		// takes the ones they leave
+		static struct task_group regions;
+		static bool regions_init = false;
+		if (!regions_init)
+		{
+			task_group_init(&regions);
+			regions_init = true;
+		}
+
+		world_set_concurrent(true);
+		for (int r = 0; r < sim_regions; r++)
+			task_group_submit(&regions, resolve_region, (void *)(long)r);
+		task_group_wait(&regions);
+		world_set_concurrent(false);
+
+		for (int i = 0; i < n_batch; i++)
+		{
+			if (ball_region[batch[i].ball] == -1)
+				resolve_move(&batch[i], true);
+		}
+	}
+
+	// Merged in the order of the moves
+	for (int i = 0; i < n_batch; i++)
+	{
+		struct batch_move *move = &batch[i];
+
+		if (move->dead && !sim_replaying())
+			tick_dead[n_tick_dead++] = move->ball;
+		apply_effects(&move->effects);
+		index_ball(move->ball);
+		draw_field(move->field, move->n_field);
+		for (int j = 0; j < move->n_field; j++)
+			tick_add(move->field[j]);
+
+		memset(ball_steps[move->ball], 0, sizeof(ball_steps[move->ball]));
+		ball_shared[move->ball] = false;
+	}
+	n_batch = 0;
+
+	ALLOC_PHASE_END();
+}
+
+// Adds the moves of a ball to the batch, resolving it first if it is full
+static void batch_add(int ball, const unsigned char *moves, int n_moves)
+{
+	if (n_batch == SIM_BATCH_MOVES)
+		batch_resolve();
+
+	struct batch_move *move = &batch[n_batch++];
+	memset(move, 0, sizeof(*move));
+	move->ball = ball;
+	move->n_moves = n_moves;
+	memcpy(move->moves, moves, n_moves);
+
+	// Anything that is not a direction does not move the ball
+	for (int i = 0; i < n_moves; i++)
+	{
+		if (moves[i] >= UP && moves[i] <= RIGHT)
+			ball_steps[ball][moves[i]]++;
+	}
+}
+
+// Waits for the simulation to put the player on the board
+void sim_join(struct player_conn *pc, struct msg_data *msg)
+{
+	struct join_request request = {pc, msg};
+	sem_init(&request.done, 0, 0);
+	joining[pc->index] = &request;
+
+	struct sim_input input = {0};
+	input.kind = SIM_JOIN;
+	input.index = pc->index;
+	sim_push(&input);
+
+	sem_wait(&request.done);
+	sem_destroy(&request.done);
+}
+
+// The simulation has the board locks for the whole tick, only the threads that
+// read the board (spectators, keyframes, resumes) ever wait on them
+static void sim_begin()
+{
+	/* Critical region position start */
+	pthread_mutex_lock(&mux_position);
+
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
+
+	n_tick_joined = n_tick_dead = 0;
+}
+
+// Takes a free slot for a new ball, the one the run took when replaying
+static bool sim_slot(struct sim_input *input)
+{
+	if (sim_replaying())
+		return true;
+
+	/* Critical region free_spaces start */
+	pthread_mutex_lock(&mux_free_spaces);
+
+	bool found = !stack_is_empty();
+	if (found)
+		input->index = stack_pop();
+
+	pthread_mutex_unlock(&mux_free_spaces);
+	/* Critical region free_spaces end */
+
+	return found;
+}
+
+static bool sim_apply(struct sim_input *input)
+{
+	int index = input->index;
+	ball_info_t field[MAX_FIELD + 1] = {0};
+
+	// Inputs of players that are gone by now are dropped, moves do not
+	// change who is on the board
+	if ((input->kind == SIM_LEAVE || input->kind == SIM_MOVE || input->kind == SIM_REVIVE) &&
+		(ball_type[index] != PLAYER || clients[index].session != input->session))
+		return false;
+
+	// Anything but moves has to see the moves before it resolved
+	if (input->kind != SIM_MOVE && input->kind != SIM_BOTS_MOVE)
+		batch_resolve();
+
+	switch (input->kind)
+	{
+	case SIM_JOIN:
+		// A replay only needs the ball, and the session the run gave it
+		if (sim_replaying())
+		{
+			ball_info[index] = create_player();
+			clients[index].session = input->session;
+			set_ball_type(index, PLAYER);
+			place_ball(index);
+			add_ball(game_win, &ball_info[index]);
+		}
+		else
+		{
+			join_player(joining[index]->pc, joining[index]->msg);
+			input->session = clients[index].session;
+			tick_joined[n_tick_joined++] = index;
+		}
+		tick_add(ball_info[index]);
+		return true;
+
+	case SIM_LEAVE:
+		remove_player(index, input->session, &field[0]);
+		tick_add(field[0]);
+		return true;
+
+	case SIM_MOVE:
+		batch_add(index, input->moves, input->n_moves < MAX_MOVES ? input->n_moves : MAX_MOVES);
+		return true;
+
+	case SIM_REVIVE:
+		ball_info[index].hp = MAX_HP;
+		ball_changed(index, &ball_info[index]);
+		return true;
+
+	case SIM_BOT:
+		if (!sim_slot(input))
+			return false;
+		index = input->index;
+
+		ball_info[index] = create_ball();
+		ball_info[index].ch = '*';
+		set_ball_type(index, BOT);
+		place_ball(index);
+		add_ball(game_win, &ball_info[index]);
+		tick_add(ball_info[index]);
+		return true;
+
+	case SIM_BOTS_MOVE:
+		// Directions are drawn in the order of the bots, before any of
+		// them moves
+		update_chase_flow();
+		for_each_ball(i, BALL_MASK(BOT))
+		{
+			unsigned char move = bot_direction(i);
+			if (move != NONE)
+				batch_add(i, &move, 1);
+		}
+		return true;
+
+	case SIM_PRIZE:
+		if (n_prizes == MAX_PRIZES || !sim_slot(input))
+			return false;
+		index = input->index;
+
+		ball_info[index] = create_ball();
+		ball_info[index].hp = world_rand() % 5 + 1;
+		ball_info[index].ch = ball_info[index].hp + '0';
+		set_ball_type(index, PRIZE);
+		place_ball(index);
+		add_ball(game_win, &ball_info[index]);
+		tick_add(ball_info[index]);
+
+		/* Critical region n_prizes start */
+		pthread_mutex_lock(&mux_n_prizes);
+		n_prizes++;
+		pthread_mutex_unlock(&mux_n_prizes);
+		/* Critical region n_prizes end */
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+// Tells everybody what the tick changed
+static unsigned int sim_end()
+{
+	ALLOC_PHASE_BEGIN("tick");
+	batch_resolve();
+
+	unsigned int hash = world_hash();
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+
+	pthread_mutex_unlock(&mux_position);
+	/* Critical region position end */
+
+	for (int i = 0; i < n_tick_field; i++)
+	{
+		ball_info_t *entry = &tick_field[i];
+		tick_slot[entry->pos_y * WINDOW_SIZE + entry->pos_x] = -1;
+	}
+
+	if (sim_replaying())
+	{
+		n_tick_field = 0;
+		ALLOC_PHASE_END();
+		return hash;
+	}
+
+	// New players have their board and BINFO queued already
+	for (int i = 0; i < n_tick_joined; i++)
+	{
+		player_flush(tick_joined[i]);
+		sem_post(&joining[tick_joined[i]]->done);
+		joining[tick_joined[i]] = NULL;
+	}
+	conn_flush();
+
+	for (int i = 0; i < n_tick_dead; i++)
+		player_dead(tick_dead[i]);
+
+	// As many broadcasts as it takes, of at most MAX_FIELD cells each
+	for (int i = 0; i < n_tick_field; i += MAX_FIELD)
+	{
+		ball_info_t field[MAX_FIELD + 1] = {0};
+		int n = n_tick_field - i < MAX_FIELD ? n_tick_field - i : MAX_FIELD;
+		memcpy(field, &tick_field[i], n * sizeof(ball_info_t));
+
+		field_update(field);
+	}
+	n_tick_field = 0;
+
+	ALLOC_PHASE_END();
+	return hash;
+}
+
+static const struct sim_world sim_world = {sim_begin, sim_end, sim_apply};
+
+// Task that tells the simulation to move the bots, every BOTS_TICK_MS
+void sim_move_bots(void *arg)
+{
+	struct sim_input input = {0};
+	input.kind = SIM_BOTS_MOVE;
+	sim_push(&input);
+
+	task_after(BOTS_TICK_MS, sim_move_bots, NULL);
+}
+
+// Task that spawns the bots in the simulation and starts moving them
+void sim_spawn_bots(void *arg)
+{
+	struct sim_input input = {0};
+	input.kind = SIM_BOT;
+	for (int i = 0; i < n_bots; i++)
+		sim_push(&input);
+
+	task_after(BOTS_TICK_MS, sim_move_bots, NULL);
+}
+
+// Task that offers the simulation a prize, the first five right away and
+// then one every PRIZES_TICK_MS
+void sim_offer_prize(void *arg)
+{
+	static int n_offered = 0;
+	struct sim_input input = {0};
+	input.kind = SIM_PRIZE;
+	sim_push(&input);
+
+	n_offered++;
+	task_after(n_offered < 5 ? 0 : PRIZES_TICK_MS, sim_offer_prize, NULL);
+}
+
+// Empty board and ball table
+void init_world()
+{
+	static const struct world_hooks hooks = {ball_changed, prize_eaten, board_rand};
+
+	memset(tick_slot, -1, sizeof(tick_slot));
+	scoreboard_init(&scoreboard, MAX_BALLS, MAX_HP);
+	world_init(&hooks);
+}
+
+// Hands a detached player over to the connection of a client that presented
+// its session and resume token, which only gets the cells that changed since
+// the board version it has. Returns false if there is nothing to resume
+bool resume_player(struct player_conn *pc, struct msg_data *msg)
+{
+	// Static, resumes happen one at a time under the position lock
+	static struct msg_data msgs[(MAX_BALLS + 1) / 2];
+
+	int index = msg->session & SESSION_INDEX_MASK;
+	if (index >= MAX_BALLS)
+		return false;
+
+	/* Critical region position start */
+	pthread_mutex_lock(&mux_position);
+
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
+
+	struct client_info *client = &clients[index];
+
+	if (ball_type[index] != PLAYER || !client->detached || client->session != msg->session ||
+		client->token == 0 || client->token != msg->token)
+	{
+		pthread_mutex_unlock(&mux_health);
+		pthread_mutex_unlock(&mux_position);
+		return false;
+	}
+
+	// The session stays so that the respawn timer still finds the player,
+	// the grace timer sees it resumed. The tokens are only good once
+	client->detached = false;
+	client->token = random_token();
+	client->udp_token = random_token();
+
+	// The UDP side channel state is kept, the client keeps its socket
+	client->conn = pc->client.conn;
+	client->relayed = pc->client.relayed;
+	client->relay = pc->client.relay;
+	client->channel = pc->client.channel;
+	client->udp_enabled = client->udp_enabled && !client->relayed && (msg->flags & CAP_UDP) != 0;
+	client->compressed = client->relayed || (msg->flags & CAP_SNAP) != 0;
+
+	pc->index = index;
+	pc->client = *client;
+	pc->info = ball_info[index];
+
+	if (!client->relayed)
+	{
+		outq_open(index, client->conn);
+		if (client->udp_ready && client->udp_enabled)
+			outq_set_broadcast(index, false);
+	}
+
+	// UDP clients catch up with their next delta, the others get the cells
+	// that changed since the version they have, before any broadcast after it
+	/* Critical region board sequence start */
+	pthread_mutex_lock(&mux_board_seq);
+
+	int n_msgs = 0;
+	int j = 0;
+
+	for (int y = 1; y < WINDOW_SIZE - 1 && !(client->udp_ready && client->udp_enabled); y++) {
+		for (int x = 1; x < WINDOW_SIZE - 1; x++) {
+			if (!SEQ_AFTER(cell_seq[y * WINDOW_SIZE + x], msg->ack))
+				continue;
+
+			ball_info_t cell = {x, y, 0, ' '};
+			if (grid_get(x, y) != -1)
+				cell = ball_info[grid_get(x, y)];
+
+			if (j == 0) {
+				memset(&msgs[n_msgs], 0, sizeof(struct msg_data));
+				msgs[n_msgs].type = FSTATUS;
+				msgs[n_msgs].seq = board_seq;
+			}
+			msgs[n_msgs].field[j++] = cell;
+			if (j == 2) {
+				n_msgs++;
+				j = 0;
+			}
+		}
+	}
+	if (j != 0)
+		n_msgs++;
+
+	if (n_msgs > 0)
+		player_push(index, msgs, n_msgs * sizeof(struct msg_data));
+
+	pthread_mutex_unlock(&mux_board_seq);
+	/* Critical region board sequence end */
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
+
+	pthread_mutex_unlock(&mux_position);
+	/* Critical region position end */
+
+	struct msg_data reply = {0};
+	reply.type = BINFO;
+	reply.field[0] = pc->info;
+	reply.session = pc->client.session;
+	reply.token = pc->client.token;
+	reply.udp_token = pc->client.udp_token;
+	reply.flags = (pc->client.udp_enabled ? CAP_UDP : 0) | (pc->client.compressed ? CAP_SNAP : 0) | CAP_RESUME;
+
+	player_push(index, &reply, sizeof(reply));
+	player_flush(index);
+	conn_flush();
+
+	return true;
+}
+
+// Handles a message of a player connection, returns false if the connection
+// has to be closed because the board is full
+bool player_message(struct player_conn *pc, struct msg_data *msg)
+{
+	struct client_info *client = &pc->client;
+
+	// Stop the respawn timer thread if the client sent a message
+	if (pc->info.ch != 0)
+		stop_respawn_timer(pc->index);
+
+	switch (msg->type)
+	{
+	case (CONN):
+
+		// A client that lost its connection gets its ball back
+		if (pc->info.ch == 0 && (msg->flags & CAP_RESUME) && resume_player(pc, msg))
+			break;
+		
+		/* Critical region free_spaces start */
+		pthread_mutex_lock(&mux_free_spaces);
+		
+		// If the board is full reject the player
+		if (stack_is_empty())
+		{
+			pthread_mutex_unlock(&mux_free_spaces);
+			/* Critical region free_spaces end */
+			
+			return false;
+		}
+
+		pc->index = stack_pop();
+
+		pthread_mutex_unlock(&mux_free_spaces);
+		/* Critical region free_spaces end */
+
+		int index = pc->index;
+
+		// Nothing from a previous client in this slot can be a delta base
+		pthread_mutex_lock(&mux_delta);
+		memset(udp_history[index].seq, 0, sizeof(udp_history[index].seq));
+		pthread_mutex_unlock(&mux_delta);
+
+		// The simulation puts the player on the board in its next tick
+		if (sim_running())
+		{
+			sim_join(pc, msg);
+			break;
+		}
+
+		/* Critical region position start */
+		pthread_mutex_lock(&mux_position);
+
+		/* Critical region health start */
+		pthread_mutex_lock(&mux_health);
+
+		join_player(pc, msg);
 
 		pthread_mutex_unlock(&mux_health);
 		/* Critical region health end */
-
-		add_ball(game_win, &bots[i].info);
 		
 		pthread_mutex_unlock(&mux_position);
 		/* Critical region position end */
-	}
 
-	while (1)
-	{
-		sleep(3);
-		for (int i = 0; i < n_bots; i++)
-		{
-			// Get a random direction
-			direction_t dir = random() % 4 + 1;
-			handle_move(bot_index[i], dir, &(bots[i].info));
-		}
-	}
-}
+		player_flush(index);
+		conn_flush();
 
-// Thread function that handles the prizes
-void *handle_prizes(void *arg)
-{
-	struct client_info new_prize;
-	int first_prizes = 0;
+		// Send FSTATUS message to all the other players
+		ball_info_t field[MAX_FIELD + 1] = {0};
 
-	// Generate a new prize every 5 seconds
-	while (1)
-	{
-		/* Critical region n_prizes start */
-		pthread_mutex_lock(&mux_n_prizes);
+		field[0] = pc->info;
+
+		field_update(field);
 		
-		// do nothing if the board is full or there are already
-		// the maximum number of prizes
-		if (n_prizes == MAX_PRIZES)
+		break;
+
+	case (BMOV):
+		// Not in the game yet
+		if (pc->info.ch == 0)
+			break;
+
+		// The simulation checks the health when it applies the moves
+		if (sim_running())
 		{
-		    pthread_cond_wait(&cond_n_prizes, &mux_n_prizes);
+			if (msg->n_moves > 0 && msg->n_moves <= MAX_MOVES)
+				sim_move(pc->index, client->session, msg->moves, msg->n_moves);
+			else
+			{
+				unsigned char move = msg->dir;
+				sim_move(pc->index, client->session, &move, 1);
+			}
+			break;
 		}
-		
-		pthread_mutex_unlock(&mux_n_prizes);
-		/* Critical region n_prizes end */
 
-		/* Critical region free_spaces start */
-		pthread_mutex_lock(&mux_free_spaces);
+		// Health may have changed in the meantime
+		/* Critical region health start */
+		pthread_mutex_lock(&mux_health);
 
-		if (stack_is_empty()) {
-			pthread_cond_wait(&cond_free_spaces, &mux_free_spaces);
-		}
-		
-		int index = stack_pop();
-		
-		pthread_mutex_unlock(&mux_free_spaces);
-		/* Critical region free_spaces end */
+		pc->info.hp = ball_info[pc->index].hp;
+
+		pthread_mutex_unlock(&mux_health);
+		/* Critical region health end */
 
-		// Generate the first five prizes
-		if (first_prizes < 5)
+		if (pc->info.hp == 0)
 		{
-			first_prizes++;
+			// Player is dead
+			player_dead(pc->index);
+		}
+		else if (msg->n_moves > 0 && msg->n_moves <= MAX_MOVES)
+		{
+			handle_moves(pc->index, msg->moves, msg->n_moves, &pc->info);
 		}
 		else
 		{
-			sleep(5);
+			handle_move(pc->index, msg->dir, &pc->info);
 		}
 
-		/* Critical region position start */
-		pthread_mutex_lock(&mux_position);
-		
-		/* Critical region health start */
-		pthread_mutex_lock(&mux_health);
-
-		int x;
-		int y;
+		break;
+	case (CONTGAME):
+		if (pc->info.ch == 0)
+			break;
 
-		// Generate a random position that is not occupied
-		do
+		if (sim_running())
 		{
-			x = rand() % (WINDOW_SIZE - 2) + 1;
-			y = rand() % (WINDOW_SIZE - 2) + 1;
-		} while (board_grid[x][y] != -1);
-
-		// Generate a prize with a random value between 1 and 5
-		int value = rand() % 5 + 1;
-
-		new_prize.info.pos_x = x;
-		new_prize.info.pos_y = y;
-		new_prize.info.ch = value + '0';
-		new_prize.info.hp = value;
-		new_prize.type = PRIZE;
-
-		memcpy(&balls[index], &new_prize, sizeof(struct client_info));
-		
-		board_grid[x][y] = index;
+			struct sim_input input = {0};
+			input.kind = SIM_REVIVE;
+			input.index = pc->index;
+			input.session = client->session;
+			sim_push(&input);
+			break;
+		}
 
-		/* Critical region n_prizes start */
-		pthread_mutex_lock(&mux_n_prizes);
-		n_prizes++;
-		pthread_mutex_unlock(&mux_n_prizes);
-		/* Critical region n_prizes end */
+		// Revive the player
+		/* Critical region health start */
+		pthread_mutex_lock(&mux_health);
 		
-		add_ball(game_win, &new_prize.info);
+		ball_info[pc->index].hp = MAX_HP;
+		ball_changed(pc->index, &ball_info[pc->index]);
+		pc->info = ball_info[pc->index];
 
 		pthread_mutex_unlock(&mux_health);
 		/* Critical region health end */
-		
-		pthread_mutex_unlock(&mux_position);
-		/* Critical region position end */
-		
-		if (first_prizes == 5) {
-			ball_info_t field[2] = {0};
-			field[0] = new_prize.info;
-			
-			pthread_t field_update_thread;
-
-			pthread_create(&field_update_thread, NULL, field_update, field);
-			pthread_join(field_update_thread, NULL);
-		}
+		break;
+	default:
+		break;
 	}
+
+	return true;
 }
 
-// Thread function to wait 10s for a dead player's continue game
-void *respawn_timer(void *args)
+// Detaches the ball of a player connection that went away, the client may
+// still resume it
+void player_close(struct player_conn *pc)
 {
-	// This thread will be killed if the client sends a msg
-	struct thread_args params = *(struct thread_args *)args;
-	int index = params.client_index;
-	pthread_t c_thread = params.client_thread;
+	// Connections that never joined the game have no ball to keep
+	if (pc->info.ch == 0)
+		return;
 
-	sleep(10);
-	// If not, just delete the ball and disconnect the player
-	delete_player(index);
-	pthread_cancel(c_thread);
-	return NULL;
+	detach_player(pc->index, pc->client.session);
 }
 
-// Thread function that handles each client
-void *client_thread(void *arg)
+// Serves a relay link until it goes away, every client behind it is a
+// player of its own, identified by its channel on the link
+void relay_link(conn_t conn)
 {
-	struct client_info client = {0};
-	int index = 0;
-	int nbytes = 0;
-	struct msg_data msg;
-	char buffer[sizeof(struct msg_data)];
-	pthread_t respawn_thread; // Respawn timer thread variable in case we need it
-	pthread_t self_thread = pthread_self();
+	/* Critical region relays start */
+	pthread_mutex_lock(&mux_relays);
 
-	client.fd = *(int *)arg;
+	int relay = 0;
+	while (relay < MAX_RELAYS && relay_active[relay])
+		relay++;
 
-	while (client.fd != -1)
+	if (relay == MAX_RELAYS)
 	{
-		msg = (struct msg_data){0};
+		pthread_mutex_unlock(&mux_relays);
+		conn_close(&conn);
+		conn_free(&conn);
+		return;
+	}
 
-		// Receive message from client
-		memset(buffer, 0, sizeof(buffer));
-		nbytes = 0;
+	// Taken before the lock goes, so two relays connecting at once never
+	// get the same slot
+	relay_active[relay] = true;
+	relay_conns[relay] = conn;
 
-		// Check if the client sent any message after dying (to reconnect)
-		if (client.info.ch != 0 && client.info.hp == 0)
-		{
-			// Send this thread's ID to the respawn timer thread in case it needs to shut it down
-			struct thread_args args = {index, self_thread};
-			// Create thread to countdown the respawn time
-			pthread_create(&respawn_thread, NULL, respawn_timer, &args);
-		}
+	pthread_mutex_unlock(&mux_relays);
+	/* Critical region relays end */
 
-		// Receive message from client
-		do
-		{
-			nbytes = 0;
-			char *ptr = &buffer[nbytes];
-			nbytes += recv(client.fd, ptr, sizeof(buffer) - nbytes, 0);
-		} while (nbytes < sizeof(struct msg_data) && nbytes > 0);
+	// Channels reuse the slot bits the way sessions do, a channel whose tag
+	// changed belongs to a new client
+	struct player_conn *players = calloc(MAX_BALLS, sizeof(struct player_conn));
+	if (players == NULL)
+	{
+		/* Critical region relays start */
+		pthread_mutex_lock(&mux_relays);
+		relay_active[relay] = false;
+		pthread_mutex_unlock(&mux_relays);
+		/* Critical region relays end */
+
+		conn_close(&conn);
+		conn_free(&conn);
+		return;
+	}
 
-		// Socket was closed, either by the client or by the respawn timeout
-		if (nbytes <= 0)
-			break;
+	// The relay keeps its own copy of the board from the broadcasts, so it
+	// gets the whole board before any of them (and then its BINFO)
+	static char buffer[SNAPSHOT_MAX_BYTES];
+	static pthread_mutex_t buffer_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-		// Stop the respawn timer thread if the client sent a message
-		if (client.info.ch != 0 && client.info.hp == 0)
-			pthread_cancel(respawn_thread);
+	pthread_mutex_lock(&buffer_mtx);
 
-		memcpy(&msg, buffer, sizeof(buffer));
+	/* Critical region position start */
+	pthread_mutex_lock(&mux_position);
 
-		switch (msg.type)
-		{
-		case (CONN):
-			
-			/* Critical region free_spaces start */
-			pthread_mutex_lock(&mux_free_spaces);
-			
-			// If the board is full reject the player
-			if (stack_is_empty())
-			{
-				close(client.fd);
-				client.fd = -1;
+	/* Critical region health start */
+	pthread_mutex_lock(&mux_health);
 
-				pthread_mutex_unlock(&mux_free_spaces);
-				/* Critical region free_spaces end */
-				
-				return NULL;
-			}
+	outq_open(RELAY_QUEUE(relay), conn);
+	outq_set_limit(RELAY_QUEUE(relay), RELAY_QUEUE_LIMIT_BYTES);
+	int size = build_snapshot(true, false, buffer);
+	outq_push(RELAY_QUEUE(relay), buffer, size);
+
+	pthread_mutex_unlock(&mux_health);
+	/* Critical region health end */
 
-			index = stack_pop();
+	pthread_mutex_unlock(&mux_position);
+	/* Critical region position end */
 
-			pthread_mutex_unlock(&mux_free_spaces);
-			/* Critical region free_spaces end */
+	pthread_mutex_unlock(&buffer_mtx);
 
-			/* Critical region position start */
-			pthread_mutex_lock(&mux_position);
+	struct msg_data msg = {0};
+	msg.type = BINFO;
+	msg.flags = CAP_RELAY | CAP_SNAP;
+	outq_push(RELAY_QUEUE(relay), &msg, sizeof(msg));
 
-			// Create a new ball structure
-			client.info = create_ball();
-			client.type = PLAYER;
+	outq_flush(RELAY_QUEUE(relay));
+	conn_flush();
 
-			/* Critical region health start */
-			pthread_mutex_lock(&mux_health);
+	struct msg_data inner;
 
-			// Send entire board to the new client
-			memset(&msg, 0, sizeof(struct msg_data));
+	while (conn_recv(&conn, &msg, sizeof(msg)) > 0)
+	{
+		int slot = msg.session & SESSION_INDEX_MASK;
 
-			// No new balls can join while we are sending
-			// the board data
-			
-			/* Critical region free_spaces start */
-			pthread_mutex_lock(&mux_free_spaces);
-			
-			msg.type = FSTATUS;
-			int j = 0;
-			for (int i = 0; i < MAX_BALLS; i++) {
-				if (balls[i].type == EMPTY) {
-					continue;
-				}
-				msg.field[j++] = balls[i].info;
-				if (j == 2) {
-					nbytes = 0;
-					memset(buffer, 0, sizeof(struct msg_data));
-
-					memcpy(buffer, &msg, sizeof(struct msg_data));
-
-					// This guarantees that all the data is sent
-					do
-						{
-							char *ptr = &buffer[nbytes];
-							nbytes += send(client.fd, ptr, sizeof(buffer) - nbytes, MSG_NOSIGNAL);
-						} while (nbytes < sizeof(struct msg_data));
-					j = 0;
-				}
+		if (msg.type != RELAY || slot >= MAX_BALLS ||
+			(msg.len != 0 && msg.len != sizeof(struct msg_data)))
+			break;
+		if (msg.len > 0 && conn_recv(&conn, &inner, sizeof(inner)) <= 0)
+			break;
+
+		struct player_conn *pc = &players[slot];
+		bool known = pc->client.relayed && pc->client.channel == msg.session;
+
+		// The client behind the channel is gone
+		if (msg.len == 0)
+		{
+			if (known)
+			{
+				player_close(pc);
+				memset(pc, 0, sizeof(struct player_conn));
 			}
+			continue;
+		}
 
-			pthread_mutex_unlock(&mux_free_spaces);
-			/* Critical region free_spaces end */
-			
-			// Update balls structure with new player
-			balls[index] = client;
+		if (!known)
+		{
+			if (inner.type != CONN)
+				continue;
+
+			player_close(pc);
+			memset(pc, 0, sizeof(struct player_conn));
+			pc->client.conn = conn;
+			pc->client.relayed = true;
+			pc->client.relay = relay;
+			pc->client.channel = msg.session;
+		}
 
-			pthread_mutex_unlock(&mux_health);
-			/* Critical region health end */
-			
-			// Update the board
-			board_grid[client.info.pos_x][client.info.pos_y] = index;
-			add_ball(game_win, &client.info);
-			
-			pthread_mutex_unlock(&mux_position);
-			/* Critical region position end */
+		// Board full, the relay drops the client
+		if (!player_message(pc, &inner))
+		{
+			relay_push(relay, msg.session, NULL, 0);
+			outq_flush(RELAY_QUEUE(relay));
+			conn_flush();
+			memset(pc, 0, sizeof(struct player_conn));
+		}
+	}
 
-			// Send BINFO message back to the client
-			memset(&msg, 0, sizeof(struct msg_data));
+	for (int slot = 0; slot < MAX_BALLS; slot++)
+		player_close(&players[slot]);
+	free(players);
 
-			msg.type = BINFO;
-			msg.field[0] = client.info;
+	/* Critical region relays start */
+	pthread_mutex_lock(&mux_relays);
+	relay_active[relay] = false;
+	pthread_mutex_unlock(&mux_relays);
+	/* Critical region relays end */
 
-			nbytes = 0;
-			memset(buffer, 0, sizeof(struct msg_data));
+	outq_close(RELAY_QUEUE(relay));
+	conn_close(&conn);
+	conn_free(&conn);
+}
 
-			// Copy the data to a byte buffer so there are no problems with
-			// byte order
-			memcpy(buffer, &msg, sizeof(struct msg_data));
+// Thread function that handles each client
+void *client_thread(void *arg)
+{
+	struct player_conn pc = {0};
+	int nbytes = 0;
+	struct msg_data msg;
+	char buffer[sizeof(struct msg_data)];
 
-			// This guarantees that all the data is sent
-			do
-			{
-				char *ptr = &buffer[nbytes];
-				nbytes += send(client.fd, ptr, sizeof(buffer) - nbytes, MSG_NOSIGNAL);
-			} while (nbytes < sizeof(struct msg_data));
+	pc.client.conn = *(conn_t *)arg;
+	free(arg);
+
+	struct handshake *hs = malloc(sizeof(struct handshake));
+	if (hs != NULL)
+	{
+		pthread_mutex_init(&hs->lock, NULL);
+		hs->conn = pc.client.conn;
+		hs->over = false;
+		hs->refs = 2;
+		task_after(HANDSHAKE_MS, handshake_expired, hs);
+	}
 
-			// Send FSTATUS message to all the other players
-			ball_info_t field[2] = {0};
+	while (1)
+	{
+		msg = (struct msg_data){0};
 
-			field[0] = client.info;
+		// Receive message from client
+		memset(buffer, 0, sizeof(buffer));
+		nbytes = conn_recv(&pc.client.conn, buffer, sizeof(buffer));
 
-			pthread_t field_update_thread;
+		// Past the first message the deadline is off
+		if (hs != NULL && !handshake_done(hs))
+			nbytes = 0;
+		hs = NULL;
 
-			pthread_create(&field_update_thread, NULL, field_update, field);
-			pthread_join(field_update_thread, NULL);
-			
+		// Socket was closed, either by the client, by the respawn timeout or
+		// by the handshake deadline
+		if (nbytes <= 0)
 			break;
 
-		case (BMOV):
-			// Health may have changed in the meantime
-			/* Critical region health start */
-			pthread_mutex_lock(&mux_health);
+		memcpy(&msg, buffer, sizeof(buffer));
 
-			client.info.hp = balls[index].info.hp;
+		// Spectators get no ball, the spectator thread takes the
+		// connection over and this thread is done
+		if (msg.type == CONN && pc.info.ch == 0 && (msg.flags & CAP_SPECTATE))
+		{
+			memset(&msg, 0, sizeof(struct msg_data));
+			msg.type = BINFO;
+			msg.flags = CAP_SPECTATE | CAP_SNAP;
 
-			pthread_mutex_unlock(&mux_health);
-			/* Critical region health end */
+			memcpy(buffer, &msg, sizeof(struct msg_data));
 
-			if (client.info.hp == 0)
-			{
-				// Player is dead
-				memset(&msg, 0, sizeof(struct msg_data));
-				msg.type = HP0;
-
-				nbytes = 0;
-				memset(buffer, 0, sizeof(struct msg_data));
-
-				// Copy the data to a byte buffer so there are no problems with
-				// byte order
-				memcpy(buffer, &msg, sizeof(struct msg_data));
-
-				// This guarantees that all the data is sent
-				do
-				{
-					char *ptr = &buffer[nbytes];
-					nbytes += send(client.fd, ptr, sizeof(buffer) - nbytes, MSG_NOSIGNAL);
-				} while (nbytes < sizeof(struct msg_data));
-			}
-			else
+			if (conn_send(&pc.client.conn, buffer, sizeof(buffer)) == -1 || !spectate_add(pc.client.conn))
 			{
-				handle_move(index, msg.dir, &client.info);
+				conn_close(&pc.client.conn);
+				conn_free(&pc.client.conn);
 			}
+			return NULL;
+		}
 
-			break;
-		case (CONTGAME):
-			// Revive the player
-			/* Critical region health start */
-			pthread_mutex_lock(&mux_health);
-			
-			balls[index].info.hp = MAX_HP;
-			client = balls[index];
+		// Relays get no ball either, this thread serves the link instead
+		if (msg.type == CONN && pc.info.ch == 0 && (msg.flags & CAP_RELAY))
+		{
+			relay_link(pc.client.conn);
+			return NULL;
+		}
 
-			pthread_mutex_unlock(&mux_health);
-			/* Critical region health end */
+		if (!player_message(&pc, &msg))
 			break;
-		default:
-			continue;
-		}
 	}
 
-	delete_player(index);
+	// Clients that never joined the game have no ball to keep, for the
+	// others detach_player() closes the connection
+	if (pc.info.ch == 0)
+		conn_close(&pc.client.conn);
+	else
+		player_close(&pc);
+	conn_free(&pc.client.conn);
 
 	return NULL;
 }
@@ -817,12 +2205,126 @@ int main(int argc, char *argv[])
 	signal(SIGINT, sigint_handler);
 	srand(time(NULL));
 
-	int n_bots = 0;
 	int sock_port = 0;
+	bool use_uring = false;
+	bool use_sim = false;
+	char *log_path = NULL;
+	char *replay_path = NULL;
+	bool assert_no_move_allocs = false;
+	int n_workers = CLIENT_WORKERS;
+	int stack_kb = CLIENT_STACK_KB;
+
+	// Options go before the positional arguments
+	int opt;
+	while ((opt = getopt(argc, argv, "i:sl:r:ap:w:k:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p':
+			// Regions of the board the simulation resolves moves in at once
+			use_sim = true;
+			sim_regions = atoi(optarg);
+			if (sim_regions < 1 || sim_regions > SIM_MAX_REGIONS)
+			{
+				printf("Regions must be an integer in range [1,%d]\n", SIM_MAX_REGIONS);
+				exit(-1);
+			}
+			break;
+		case 's':
+			// A single simulation thread applies every input
+			use_sim = true;
+			break;
+		case 'l':
+			// Log the inputs of the simulation, to replay them later
+			use_sim = true;
+			log_path = optarg;
+			break;
+		case 'r':
+			// Replay a simulation log and check it ends on the same board
+			replay_path = optarg;
+			break;
+		case 'a':
+			// Fail the replay if applying moves allocated anything
+			assert_no_move_allocs = true;
+			break;
+		case 'w':
+			// Connections served at once
+			n_workers = atoi(optarg);
+			if (n_workers < 1)
+			{
+				printf("Workers must be a positive integer\n");
+				exit(-1);
+			}
+			break;
+		case 'k':
+			// Stack of each connection worker, in KiB
+			stack_kb = atoi(optarg);
+			if (stack_kb < 1)
+			{
+				printf("Stack size must be a positive integer\n");
+				exit(-1);
+			}
+			break;
+		case 'i':
+			// I/O backend for client sockets
+			if (strcmp(optarg, "uring") == 0)
+				use_uring = true;
+			else if (strcmp(optarg, "blocking") != 0)
+			{
+				printf("Unknown I/O backend %s\n", optarg);
+				exit(-1);
+			}
+			break;
+		default:
+			exit(-1);
+		}
+	}
+	argv[optind - 1] = argv[0];
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	// Workers for the bots, prizes, timers and simulation regions, one per core
+	tasks_init(0);
+
+	// A replay needs nothing but the board, and nothing is drawn
+	if (replay_path != NULL)
+	{
+		board_batch(true);
+		init_world();
+
+		unsigned int bad_tick = 0;
+		long n_ticks = sim_replay(&sim_world, replay_path, &bad_tick);
+		if (n_ticks == -1)
+			printf("Could not read the log %s\n", replay_path);
+		else if (n_ticks == -2)
+			printf("The board differs from the logged run after tick %u\n", bad_tick);
+		else
+			printf("Replayed %ld ticks, the board matches the logged run\n", n_ticks);
+		ALLOC_REPORT(stderr);
+
+		// Only builds with the allocation tracker can tell
+		if (assert_no_move_allocs)
+		{
+			long n_allocs = ALLOC_COUNT("move");
+			if (n_allocs == -1)
+			{
+				printf("Checking allocations needs a build with make ALLOC_TRACK=1\n");
+				exit(-1);
+			}
+			if (n_allocs > 0)
+			{
+				printf("Applying moves allocated %ld times\n", n_allocs);
+				exit(-1);
+			}
+		}
+		exit(n_ticks < 0 ? -1 : 0);
+	}
+
 	// Check arguments and its restrictions
 	if (argc != 4)
 	{
-		printf("Usage: %s <server_IP> <server_port> <number_of_bots [1,10]>", argv[0]);
+		printf("Usage: %s [-i blocking|uring] [-s] [-l <log>] [-p <regions>] [-w <workers>] [-k <stack_KiB>] <server_IP> <server_port> <number_of_bots [1,10]>\n"
+			   "       %s [-p <regions>] [-a] -r <log>\n", argv[0], argv[0]);
 		exit(-1);
 	}
 	else if (inet_addr(argv[1]) == INADDR_NONE)
@@ -835,12 +2337,18 @@ int main(int argc, char *argv[])
 		printf("Invalid server port\n");
 		exit(-1);
 	}
-	else if ((n_bots = atoi(argv[3])) < 1 || n_bots > 10)
+	else if ((n_bots = atoi(argv[3])) < 1 || n_bots > MAX_BOTS)
 	{
 		printf("Bots number must be an integer in range [1,10]\n");
 		exit(-1);
 	}
 
+	// Fall back to blocking sockets if io_uring is not available
+	if (use_uring && uring_io_init() == -1)
+	{
+		printf("io_uring not available, using blocking sockets\n");
+	}
+
 	// Open socket
 	server_socket = socket(AF_INET, SOCK_STREAM, 0);
 	if (server_socket == -1)
@@ -868,7 +2376,8 @@ int main(int argc, char *argv[])
 		perror("bind: ");
 		exit(-1);
 	}
-	if (listen(server_socket, 10) == -1)
+	// Spectators may show up by the thousand, do not drop their SYNs
+	if (listen(server_socket, SOMAXCONN) == -1)
 	{
 		perror("listen: ");
 		exit(-1);
@@ -889,30 +2398,96 @@ int main(int argc, char *argv[])
 	box(stats_win, 0, 0);
 	wrefresh(stats_win);
 
+	// The board is drawn once per field update
+	board_batch(true);
+
+	// Open the UDP side channel on the same address
+	udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+	if (udp_socket == -1)
+	{
+		perror("socket: ");
+		exit(-1);
+	}
+	if (bind(udp_socket, (struct sockaddr *)&server_address,
+			 sizeof(server_address)) == -1)
+	{
+		perror("bind: ");
+		exit(-1);
+	}
+
+	// Open the local socket for shared memory clients on this port
+	local_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (local_socket == -1)
+	{
+		perror("socket: ");
+		exit(-1);
+	}
+
+	struct sockaddr_un local_address = {0};
+	local_address.sun_family = AF_UNIX;
+	sprintf(local_socket_path, "%s-%d", SOCKET_PREFIX, sock_port);
+	strcpy(local_address.sun_path, local_socket_path);
+	unlink(local_socket_path);
+
+	if (bind(local_socket, (struct sockaddr *)&local_address, sizeof(local_address)) == -1)
+	{
+		perror("bind: ");
+		exit(-1);
+	}
+	if (listen(local_socket, 10) == -1)
+	{
+		perror("listen: ");
+		exit(-1);
+	}
+
 	// Store client information
 	struct sockaddr_in client_address;
 	socklen_t client_address_size;
 
 	// Initialize global variables
-	memset(board_grid, -1, sizeof(board_grid));
-	memset(balls, 0, sizeof(balls));
+	init_world();
+
+	// Initialize the outbound queues, slow clients get keyframes
+	outq_init(MAX_BALLS + MAX_RELAYS, send_keyframe);
+	outq_start_writer();
+
+	// Spectators are fed from the board on their own, coarser, clock
+	spectate_init(capture_world);
+	spectate_start();
 
-	// Initialize free spaces stack
-	stack_init(MAX_BALLS);
-	for(int i = MAX_BALLS - 1; i >= 0; i--) {
+	// Initialize free spaces stack, with a slot for every cell inside the
+	// wall so no ball (bot, prize or player) is ever handed one on a full
+	// board and joins past that are turned down
+	stack_init(BOARD_CELLS);
+	for(int i = BOARD_CELLS - 1; i >= 0; i--) {
 		stack_push(i);
 	}
 
-	// Create thread for handling bots
-	pthread_t bots_thread;
-	pthread_create(&bots_thread, NULL, handle_bots, &n_bots);
+	// Workers for the connections, started before anything is accepted
+	if (!pool_init(&client_pool, n_workers, (size_t)stack_kb * 1024))
+	{
+		printf("Could not start %d connection workers\n", n_workers);
+		exit(-1);
+	}
+
+	// Bots and prizes are inputs like any other for the simulation
+	if (use_sim)
+		sim_start(&sim_world, log_path);
 
-	// Create thread to handle prizes
-	pthread_t prizes_thread;
-	pthread_create(&prizes_thread, NULL, handle_prizes, NULL);
+	// Bots and prizes are tasks, they only take a worker while they run
+	task_submit(use_sim ? sim_spawn_bots : spawn_bots, NULL);
+	task_submit(use_sim ? sim_offer_prize : spawn_prize, NULL);
 
-	pthread_t client_threads[MAX_BALLS];
-	int n_clients = 0;
+	// UDP clients get the board on a clock rather than on every move
+	task_submit(delta_tick, NULL);
+
+	// Create thread to receive the UDP side channel datagrams
+	pthread_t udp_recv_thread;
+	pthread_create(&udp_recv_thread, NULL, udp_thread, NULL);
+
+	// Create thread to accept shared memory clients
+	pthread_t local_thread;
+	pthread_create(&local_thread, NULL, local_accept_thread, NULL);
 
 	while (1)
 	{
@@ -929,11 +2504,11 @@ int main(int argc, char *argv[])
 			c_fd = accept(server_socket, (struct sockaddr *)&client_address, &client_address_size);
 		} while (c_fd == -1 && errno == EINTR);
 
-		/* Create threads for each client */
-
-		int *thread_arg = malloc(sizeof(int));
-		*thread_arg = c_fd;
+		if (c_fd == -1)
+			continue;
 
-		pthread_create(&client_threads[n_clients++], NULL, client_thread, thread_arg);
+		// Spectators hand their connection over and free their worker
+		serve_client((conn_t){.fd = c_fd, .shm = NULL,
+							  .uring = uring_io_enabled() ? uring_io_attach(c_fd) : NULL});
 	}
 }
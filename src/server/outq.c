@@ -0,0 +1,649 @@
+/* Standard libraries */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+
+/* System libraries */
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "../chase.h"
+#include "outq.h"
+
+// One queue per connection slot, only the ones in use are ever opened
+static struct outq *queues;
+static int n_queues;
+static keyframe_fn make_keyframe;
+
+// Broadcast ring, new messages go at the end of the tail block
+// Lock order: queue lock first, then the ring lock
+static pthread_mutex_t bcast_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bcast_block *bcast_tail;
+static long bcast_head; // Ring position of the next message
+static unsigned int bcast_lost; // Broadcasts that did not fit in the ring
+
+// Wakes the writer thread up when a queue could not be drained
+static int writer_efd;
+
+// Header of every chunk pushed to a single client
+struct chunk
+{
+	long pos; // Broadcasts before this ring position go out first
+	int len;
+};
+
+static long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Size of the message starting at frame, FSNAP and RELAY carry a payload
+static int frame_len(const char *frame)
+{
+	struct msg_data msg;
+	memcpy(&msg, frame, sizeof(msg));
+	return sizeof(msg) + (msg.type == FSNAP || msg.type == RELAY ? msg.len : 0);
+}
+
+// The ring holds the only reference of a new block, NULL without memory
+static struct bcast_block *block_new(long start, int cap)
+{
+	struct bcast_block *block = malloc(sizeof(struct bcast_block) + cap);
+	if (block == NULL)
+		return NULL;
+
+	block->refs = 1;
+	block->start = start;
+	block->len = 0;
+	block->cap = cap;
+	block->next = NULL;
+	return block;
+}
+
+// Drops a reference, freeing the blocks nobody can reach any more
+// Caller holds the ring lock
+static void block_put(struct bcast_block *block)
+{
+	while (block != NULL && --block->refs == 0)
+	{
+		struct bcast_block *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+// Ring cursor helpers, caller holds the ring lock
+static long cursor_pos(struct outq *q) { return q->block->start + q->offset; }
+
+static void cursor_attach(struct outq *q)
+{
+	q->block = bcast_tail;
+	q->block->refs++;
+	q->offset = q->frame_end = q->block->len;
+}
+
+static void cursor_release(struct outq *q)
+{
+	block_put(q->block);
+	q->block = NULL;
+}
+
+static void cursor_advance(struct outq *q, int n)
+{
+	while (n > 0)
+	{
+		struct bcast_block *block = q->block;
+		int step = block->len - q->offset < n ? block->len - q->offset : n;
+
+		q->offset += step;
+		n -= step;
+		while (q->frame_end < q->offset)
+			q->frame_end += frame_len(&block->data[q->frame_end]);
+
+		// Messages never span blocks, so the next one starts a message
+		if (q->offset == block->len && block->next != NULL)
+		{
+			q->block = block->next;
+			q->block->refs++;
+			q->offset = q->frame_end = 0;
+			block_put(block);
+		}
+	}
+}
+
+void outq_init(int n, keyframe_fn keyframe)
+{
+	make_keyframe = keyframe;
+	writer_efd = eventfd(0, EFD_NONBLOCK);
+	bcast_tail = block_new(0, OUTQ_BLOCK_BYTES);
+
+	n_queues = n;
+	queues = calloc(n_queues, sizeof(struct outq));
+	for (int i = 0; i < n_queues; i++)
+		pthread_mutex_init(&queues[i].lock, NULL);
+}
+
+void outq_open(int index, conn_t conn)
+{
+	struct outq *q = &queues[index];
+
+	// Keep the kernel buffer small so a backlog builds up here, where the
+	// policies above can act on it, instead of in the socket
+	if (conn.shm == NULL && conn.uring == NULL) {
+		int sndbuf = OUTQ_SNDBUF_BYTES;
+		setsockopt(conn.fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	}
+
+	pthread_mutex_lock(&q->lock);
+	q->conn = conn;
+	q->active = true;
+	q->head = q->len = q->sent = 0;
+	q->limit = OUTQ_QUEUE_LIMIT_BYTES;
+	q->broadcast = true;
+	q->need_keyframe = false;
+	q->drained_at = now_ms();
+
+	pthread_mutex_lock(&bcast_lock);
+	if (q->block != NULL)
+		cursor_release(q);
+	cursor_attach(q);
+	q->lost = bcast_lost;
+	pthread_mutex_unlock(&bcast_lock);
+
+	pthread_mutex_unlock(&q->lock);
+}
+
+void outq_close(int index)
+{
+	struct outq *q = &queues[index];
+
+	pthread_mutex_lock(&q->lock);
+	q->active = false;
+	q->head = q->len = q->sent = 0;
+
+	pthread_mutex_lock(&bcast_lock);
+	if (q->block != NULL)
+		cursor_release(q);
+	pthread_mutex_unlock(&bcast_lock);
+
+	pthread_mutex_unlock(&q->lock);
+}
+
+void outq_set_limit(int index, int limit)
+{
+	struct outq *q = &queues[index];
+
+	pthread_mutex_lock(&q->lock);
+	q->limit = limit;
+	pthread_mutex_unlock(&q->lock);
+}
+
+void outq_set_broadcast(int index, bool broadcast)
+{
+	struct outq *q = &queues[index];
+
+	// The cursor is only let go of between messages, on the next drain
+	pthread_mutex_lock(&q->lock);
+	q->broadcast = broadcast;
+	if (broadcast && q->active && q->block == NULL)
+	{
+		pthread_mutex_lock(&bcast_lock);
+		cursor_attach(q);
+		pthread_mutex_unlock(&bcast_lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+// Queues messages ahead of everything else queued, for a client that is not
+// in the middle of sending a chunk. Caller holds the lock
+static bool push_front(struct outq *q, long pos, const void *msgs, int len)
+{
+	struct chunk chunk = {pos, len};
+	int size = sizeof(chunk) + len;
+
+	// Make room before the head, growing if the space already sent is not
+	// enough
+	if (q->head < size)
+	{
+		int queued = q->len - q->head;
+		if (queued + size > q->cap)
+		{
+			int new_cap = q->cap ? q->cap : 16 * sizeof(struct msg_data);
+			while (new_cap < queued + size)
+				new_cap *= 2;
+			char *data = realloc(q->data, new_cap);
+			if (data == NULL)
+				return false;
+			q->data = data;
+			q->cap = new_cap;
+		}
+
+		memmove(&q->data[size], &q->data[q->head], queued);
+		q->head = size;
+		q->len = size + queued;
+	}
+
+	q->head -= size;
+	memcpy(&q->data[q->head], &chunk, sizeof(chunk));
+	memcpy(&q->data[q->head + sizeof(chunk)], msgs, len);
+	return true;
+}
+
+// Replaces the ring up to limit (where the next message for the client alone
+// goes) with the latest entry of each cell it changes, pushed ahead of the
+// queue. Only FSTATUS broadcasts are coalesced, anything else in the way (or a
+// catch-up that would not be shorter) leaves the ring as it is.
+// Caller holds the lock and the ring lock, the cursor is between messages
+static bool catch_up(struct outq *q, long limit)
+{
+	// Only used under the ring lock
+	static ball_info_t latest[WINDOW_SIZE * WINDOW_SIZE];
+	static bool changed[WINDOW_SIZE * WINDOW_SIZE];
+	static int cells[WINDOW_SIZE * WINDOW_SIZE];
+	static struct msg_data msgs[(WINDOW_SIZE * WINDOW_SIZE + 1) / 2];
+
+	int n_cells = 0;
+	unsigned int first_seq = 0, last_seq = 0;
+	bool coalesced = true;
+
+	for (struct bcast_block *b = q->block; b != NULL && b->start < limit && coalesced; b = b->next)
+	{
+		int end = limit - b->start < b->len ? limit - b->start : b->len;
+		for (int from = b == q->block ? q->offset : 0; from < end && coalesced; from += frame_len(&b->data[from]))
+		{
+			struct msg_data msg;
+			memcpy(&msg, &b->data[from], sizeof(msg));
+			if (msg.type != FSTATUS)
+			{
+				coalesced = false;
+				break;
+			}
+
+			if (first_seq == 0)
+				first_seq = msg.seq;
+			last_seq = msg.seq;
+
+			for (int i = 0; i < 2; i++)
+			{
+				ball_info_t *entry = &msg.field[i];
+				int cell = entry->pos_y * WINDOW_SIZE + entry->pos_x;
+
+				if (entry->ch == 0)
+					continue;
+				if (entry->pos_x < 0 || entry->pos_x >= WINDOW_SIZE || entry->pos_y < 0 || entry->pos_y >= WINDOW_SIZE)
+				{
+					coalesced = false;
+					break;
+				}
+				if (!changed[cell])
+				{
+					changed[cell] = true;
+					cells[n_cells++] = cell;
+				}
+				latest[cell] = *entry;
+			}
+		}
+	}
+
+	int n_msgs = (n_cells + 1) / 2;
+	int len = n_msgs * sizeof(struct msg_data);
+	coalesced = coalesced && n_cells > 0 && len < limit - cursor_pos(q);
+
+	if (coalesced)
+	{
+		// A client cut off halfway through only has the board of the version
+		// before the first change, the last message brings it to the last one
+		memset(msgs, 0, len);
+		for (int i = 0; i < n_cells; i++)
+		{
+			msgs[i / 2].type = FSTATUS;
+			msgs[i / 2].seq = i / 2 == n_msgs - 1 ? last_seq : first_seq - 1;
+			msgs[i / 2].field[i % 2] = latest[cells[i]];
+		}
+		coalesced = push_front(q, limit, msgs, len);
+	}
+
+	for (int i = 0; i < n_cells; i++)
+		changed[cells[i]] = false;
+
+	if (coalesced)
+		cursor_advance(q, limit - cursor_pos(q));
+	return coalesced;
+}
+
+// Nothing left to send, caller holds the lock
+static bool drained(struct outq *q)
+{
+	pthread_mutex_lock(&bcast_lock);
+	bool ring_drained = q->block == NULL || cursor_pos(q) == bcast_head;
+	pthread_mutex_unlock(&bcast_lock);
+
+	return q->head == q->len && ring_drained;
+}
+
+// Writes without blocking, caller holds the lock
+// Returns true if the keyframe has to be generated now
+static bool drain(struct outq *q)
+{
+	while (q->active)
+	{
+		struct chunk chunk;
+		bool has_chunk = q->head < q->len;
+		if (has_chunk)
+			memcpy(&chunk, &q->data[q->head], sizeof(chunk));
+
+		struct iovec iov[OUTQ_IOV_MAX];
+		int iovcnt = 0;
+		size_t total = 0;
+		bool due = has_chunk;
+
+		/* Critical region ring start */
+		pthread_mutex_lock(&bcast_lock);
+
+		if (q->block != NULL)
+		{
+			long lag = bcast_head - cursor_pos(q);
+
+			// Too far behind, or a broadcast never made it to the ring, skip
+			// the ring and drop to a keyframe
+			if (lag > OUTQ_LIMIT_BYTES || q->lost != bcast_lost)
+			{
+				q->need_keyframe = true;
+				q->lost = bcast_lost;
+			}
+			// Behind, catch up on the cells that changed, with nothing of
+			// the client's own due first
+			else if (lag > OUTQ_COALESCE_BYTES && q->broadcast && !q->need_keyframe &&
+					 q->frame_end == q->offset && !(has_chunk && chunk.pos <= cursor_pos(q)) &&
+					 catch_up(q, has_chunk && chunk.pos < bcast_head ? chunk.pos : bcast_head))
+			{
+				pthread_mutex_unlock(&bcast_lock);
+				continue;
+			}
+
+			// Skipping is only possible between messages
+			if (q->frame_end == q->offset)
+			{
+				if (!q->broadcast)
+				{
+					cursor_release(q);
+				}
+				else if (q->need_keyframe)
+				{
+					cursor_release(q);
+					cursor_attach(q);
+				}
+			}
+		}
+
+		if (q->block != NULL)
+		{
+			// Send the ring up to where the next chunk was pushed, or just
+			// finish the current message when skipping
+			long limit = has_chunk && chunk.pos < bcast_head ? chunk.pos : bcast_head;
+			if (q->need_keyframe || !q->broadcast)
+				limit = q->block->start + q->frame_end;
+
+			due = has_chunk && chunk.pos <= cursor_pos(q);
+
+			for (struct bcast_block *b = q->block; b != NULL && b->start < limit && iovcnt < OUTQ_IOV_MAX; b = b->next)
+			{
+				int from = b == q->block ? q->offset : 0;
+				int to = limit - b->start < b->len ? limit - b->start : b->len;
+				if (to > from)
+				{
+					iov[iovcnt].iov_base = &b->data[from];
+					iov[iovcnt++].iov_len = to - from;
+					total += to - from;
+				}
+			}
+		}
+
+		pthread_mutex_unlock(&bcast_lock);
+		/* Critical region ring end */
+
+		if (due)
+		{
+			char *data = &q->data[q->head + sizeof(chunk)];
+			ssize_t n = conn_try_send(&q->conn, &data[q->sent], chunk.len - q->sent);
+			if (n == -1)
+				q->active = false; // The client thread notices the connection is gone
+			if (n <= 0)
+				break;
+
+			q->sent += n;
+			if (q->sent == chunk.len)
+			{
+				q->head += sizeof(chunk) + chunk.len;
+				q->sent = 0;
+			}
+		}
+		else if (total > 0)
+		{
+			// Straight from the ring, the blocks cannot go away while the
+			// cursor holds them
+			ssize_t n = conn_try_sendv(&q->conn, iov, iovcnt);
+			if (n == -1)
+				q->active = false;
+			if (n <= 0)
+				break;
+
+			pthread_mutex_lock(&bcast_lock);
+			cursor_advance(q, n);
+			pthread_mutex_unlock(&bcast_lock);
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if (!q->active || !drained(q))
+		return false;
+
+	q->head = q->len = q->sent = 0;
+	q->drained_at = now_ms();
+	return q->need_keyframe;
+}
+
+void outq_flush(int index)
+{
+	struct outq *q = &queues[index];
+
+	pthread_mutex_lock(&q->lock);
+	bool keyframe = q->active && drain(q);
+	if (keyframe)
+		q->need_keyframe = false;
+	bool pending = q->active && !drained(q);
+	pthread_mutex_unlock(&q->lock);
+
+	if (keyframe)
+		make_keyframe(index);
+
+	// Let the writer thread retry what did not fit
+	if (pending)
+	{
+		uint64_t value = 1;
+		write(writer_efd, &value, sizeof(value));
+	}
+}
+
+void outq_push(int index, const void *msgs, int len)
+{
+	struct outq *q = &queues[index];
+
+	pthread_mutex_lock(&q->lock);
+
+	if (!q->active)
+	{
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+
+	struct chunk chunk = {0, len};
+	pthread_mutex_lock(&bcast_lock);
+	chunk.pos = bcast_head;
+	pthread_mutex_unlock(&bcast_lock);
+
+	// Over the cap the client is as good as gone, evict it like the writer
+	// does past the deadline instead of letting the queue grow
+	int size = sizeof(chunk) + len;
+	if (q->len - q->head + size > q->limit)
+	{
+		q->active = false;
+		conn_close(&q->conn);
+		pthread_mutex_unlock(&q->lock);
+		return;
+	}
+
+	// Reclaim the space of what was already sent before growing
+	if (q->head > 0 && q->len + size > q->cap)
+	{
+		memmove(q->data, &q->data[q->head], q->len - q->head);
+		q->len -= q->head;
+		q->head = 0;
+	}
+
+	if (q->len + size > q->cap)
+	{
+		int new_cap = q->cap ? q->cap : 16 * sizeof(struct msg_data);
+		while (new_cap < q->len + size)
+			new_cap *= 2;
+		char *data = realloc(q->data, new_cap);
+		if (data == NULL)
+		{
+			q->active = false;
+			conn_close(&q->conn);
+			pthread_mutex_unlock(&q->lock);
+			return;
+		}
+		q->data = data;
+		q->cap = new_cap;
+	}
+
+	memcpy(&q->data[q->len], &chunk, sizeof(chunk));
+	memcpy(&q->data[q->len + sizeof(chunk)], msgs, len);
+	q->len += size;
+
+	pthread_mutex_unlock(&q->lock);
+}
+
+void outq_broadcast(const void *msgs, int len)
+{
+	/* Critical region ring start */
+	pthread_mutex_lock(&bcast_lock);
+
+	// Start a new block, the old one stays around while somebody reads it
+	if (bcast_tail->len + len > bcast_tail->cap)
+	{
+		struct bcast_block *block = block_new(bcast_head, len > OUTQ_BLOCK_BYTES ? len : OUTQ_BLOCK_BYTES);
+		struct bcast_block *old = bcast_tail;
+
+		// Without memory for it the broadcast is lost for every reader, all
+		// of them get a keyframe instead
+		if (block == NULL)
+		{
+			bcast_lost++;
+			pthread_mutex_unlock(&bcast_lock);
+			return;
+		}
+
+		block->refs++; // Referenced by the old tail too
+		old->next = block;
+		bcast_tail = block;
+		block_put(old);
+	}
+
+	memcpy(&bcast_tail->data[bcast_tail->len], msgs, len);
+	bcast_tail->len += len;
+	bcast_head += len;
+
+	pthread_mutex_unlock(&bcast_lock);
+	/* Critical region ring end */
+}
+
+// Thread function that drains the queues the pushers could not
+void *outq_writer(void *arg)
+{
+	struct pollfd *fds = malloc((n_queues + 1) * sizeof(struct pollfd));
+	int *indexes = malloc(n_queues * sizeof(int));
+
+	while (1)
+	{
+		int n_fds = 0;
+		bool retry = false;
+		long now = now_ms();
+
+		fds[n_fds].fd = writer_efd;
+		fds[n_fds++].events = POLLIN;
+
+		for (int i = 0; i < n_queues; i++)
+		{
+			struct outq *q = &queues[i];
+
+			pthread_mutex_lock(&q->lock);
+			if (!q->active || drained(q))
+			{
+				pthread_mutex_unlock(&q->lock);
+				continue;
+			}
+
+			// The client could not keep up for too long, evict it
+			if (now - q->drained_at > OUTQ_DEADLINE_MS)
+			{
+				q->active = false;
+				conn_close(&q->conn);
+				pthread_mutex_unlock(&q->lock);
+				continue;
+			}
+
+			// Shared memory and io_uring have no socket to poll, retry each tick
+			if (q->conn.shm != NULL || q->conn.uring != NULL)
+			{
+				retry = true;
+			}
+			else
+			{
+				indexes[n_fds - 1] = i;
+				fds[n_fds].fd = q->conn.fd;
+				fds[n_fds++].events = POLLOUT;
+			}
+			pthread_mutex_unlock(&q->lock);
+		}
+
+		poll(fds, n_fds, retry || n_fds > 1 ? OUTQ_TICK_MS : -1);
+
+		if (fds[0].revents & POLLIN)
+		{
+			uint64_t value;
+			read(writer_efd, &value, sizeof(value));
+		}
+
+		for (int i = 1; i < n_fds; i++)
+		{
+			if (fds[i].revents)
+				outq_flush(indexes[i - 1]);
+		}
+
+		if (retry)
+		{
+			for (int i = 0; i < n_queues; i++)
+			{
+				if (queues[i].conn.shm != NULL || queues[i].conn.uring != NULL)
+					outq_flush(i);
+			}
+			conn_flush();
+		}
+	}
+	return NULL;
+}
+
+void outq_start_writer()
+{
+	pthread_t writer_thread;
+	pthread_create(&writer_thread, NULL, outq_writer, NULL);
+}
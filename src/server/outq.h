@@ -0,0 +1,97 @@
+#include <pthread.h>
+#include <stdbool.h>
+
+// Broadcasts are encoded once into a shared ring every connection reads
+// from, anything addressed to a single client goes through its own queue.
+// Slow consumer policies:
+// - a client more than OUTQ_COALESCE_BYTES behind on the ring gets what it
+//   missed as one FSTATUS entry per changed cell (the latest one) instead of
+//   every change, as long as that is shorter
+// - a client more than OUTQ_LIMIT_BYTES behind on the ring skips to its
+//   head and gets a keyframe (FRESET + full board) once it catches up
+// - a client that could not drain its queue for OUTQ_DEADLINE_MS is
+//   disconnected
+// - so is a client with more than OUTQ_QUEUE_LIMIT_BYTES of its own messages
+//   waiting, before the deadline gets to it
+#define OUTQ_COALESCE_BYTES (16 * (int)sizeof(struct msg_data))
+#define OUTQ_LIMIT_BYTES (MAX_BALLS * (int)sizeof(struct msg_data))
+#define OUTQ_DEADLINE_MS 5000
+#define OUTQ_QUEUE_LIMIT_BYTES (4 * OUTQ_LIMIT_BYTES)
+
+// Kernel send buffer of stream sockets, kept small so the backlog stays
+// where the policies can see it
+#define OUTQ_SNDBUF_BYTES (16 * (int)sizeof(struct msg_data))
+
+// Size of the broadcast ring blocks and how many of them go in one sendmsg()
+#define OUTQ_BLOCK_BYTES (64 * (int)sizeof(struct msg_data))
+#define OUTQ_IOV_MAX 16
+
+// Period of the writer thread that drains the queues that did not fit in the
+// socket right away
+#define OUTQ_TICK_MS 20
+
+// The ring is a list of blocks, each one referenced by the block before it,
+// by the readers currently in it and, for the last one, by the ring itself.
+// Written bytes never change, so readers send them without any lock held
+struct bcast_block
+{
+	int refs;
+	long start; // Ring position of data[0]
+	int len, cap;
+	struct bcast_block *next;
+	char data[];
+};
+
+struct outq
+{
+	pthread_mutex_t lock;
+	conn_t conn;
+	bool active;
+
+	// Messages for this client only, in chunks tagged with the ring position
+	// they were pushed at, data[head..len) still has to go out and the first
+	// sent bytes of the head chunk already did
+	char *data;
+	int head, len, cap;
+	int sent;
+	int limit; // Most unsent bytes allowed in data
+
+	// Ring read cursor, NULL when the client gets no broadcasts
+	bool broadcast;
+	struct bcast_block *block;
+	int offset;
+	int frame_end; // End of the message offset points into
+
+	bool need_keyframe;
+	unsigned int lost; // Lost broadcasts the client already got a keyframe for
+	long drained_at; // Last time the queue was empty
+};
+
+// Called (without any queue lock held) when a client that fell behind caught
+// up and needs the whole board, must push it with outq_push()
+typedef void (*keyframe_fn)(int index);
+
+// Queues are numbered from 0 to n_queues - 1
+void outq_init(int n_queues, keyframe_fn keyframe);
+void outq_open(int index, conn_t conn);
+void outq_close(int index);
+
+// Raises the byte cap of an open queue, for connections that carry the
+// messages of many clients
+void outq_set_limit(int index, int limit);
+
+// Whether the client reads the broadcast ring (clients on the UDP side
+// channel get their broadcasts there)
+void outq_set_broadcast(int index, bool broadcast);
+
+// Queues messages for a single client
+void outq_push(int index, const void *msgs, int len);
+// Encodes messages once for every client reading the ring, they still have
+// to be flushed
+void outq_broadcast(const void *msgs, int len);
+// Sends as much as possible without blocking, batched connections still
+// need a conn_flush()
+void outq_flush(int index);
+
+// Starts the thread that drains the queues and evicts slow clients
+void outq_start_writer();
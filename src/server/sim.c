@@ -0,0 +1,203 @@
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+
+/* Threads */
+#include <pthread.h>
+
+#include "../chase.h"
+#include "sim.h"
+
+#define SIM_LOG_MAGIC "CHASESIM"
+
+struct sim_log_header
+{
+	char magic[8];
+	unsigned int seed;
+};
+
+// Every input applied, in order, with the tick it was applied in
+struct sim_record
+{
+	unsigned int tick;
+	struct sim_input input;
+};
+
+static const struct sim_world *world;
+static struct mpsc queue;
+static FILE *sim_log;
+static bool running, replaying;
+
+// Owned by the simulation thread
+static unsigned int tick;
+static unsigned int rng_state;
+
+unsigned int sim_rand()
+{
+	// xorshift32, the state is never 0
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+bool sim_running() { return running; }
+bool sim_replaying() { return replaying; }
+
+void sim_push(const struct sim_input *input)
+{
+	// Only full if the simulation is more than a whole queue behind, the
+	// producer waits for it to drain rather than losing the input
+	while (!mpsc_push(&queue, input))
+		sched_yield();
+}
+
+static void log_input(const struct sim_input *input)
+{
+	if (sim_log == NULL)
+		return;
+
+	struct sim_record record = {tick, *input};
+	fwrite(&record, sizeof(record), 1, sim_log);
+}
+
+// Applies the inputs of a tick and logs the ones that applied, followed by
+// the hash of the world they left
+static void run_tick(struct sim_input *inputs, int n_inputs)
+{
+	world->begin();
+
+	for (int i = 0; i < n_inputs; i++)
+	{
+		if (world->apply(&inputs[i]))
+			log_input(&inputs[i]);
+	}
+
+	struct sim_input hash = {0};
+	hash.kind = SIM_HASH;
+	hash.session = world->end();
+
+	if (sim_log != NULL)
+	{
+		log_input(&hash);
+		fflush(sim_log);
+	}
+}
+
+// Thread function that owns the world, one tick every SIM_TICK_MS
+static void *sim_thread(void *arg)
+{
+	static struct sim_input inputs[SIM_QUEUE_SLOTS];
+	struct timespec next;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (1)
+	{
+		next.tv_nsec += SIM_TICK_MS * 1000000L;
+		if (next.tv_nsec >= 1000000000L)
+		{
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		// A tick takes what was queued when it started, at most a queue's
+		// worth, anything pushed later waits for the next one
+		int n_inputs = 0;
+		while (n_inputs < SIM_QUEUE_SLOTS && mpsc_pop(&queue, &inputs[n_inputs]))
+			n_inputs++;
+
+		tick++;
+		if (n_inputs > 0)
+			run_tick(inputs, n_inputs);
+	}
+	return NULL;
+}
+
+void sim_start(const struct sim_world *sim_world, const char *log_path)
+{
+	world = sim_world;
+	mpsc_init(&queue, SIM_QUEUE_SLOTS, sizeof(struct sim_input));
+
+	rng_state = (unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16);
+	if (rng_state == 0)
+		rng_state = 1;
+
+	if (log_path != NULL)
+	{
+		sim_log = fopen(log_path, "wb");
+		if (sim_log == NULL)
+		{
+			perror("fopen: ");
+			exit(-1);
+		}
+
+		struct sim_log_header header = {SIM_LOG_MAGIC, rng_state};
+		fwrite(&header, sizeof(header), 1, sim_log);
+	}
+
+	running = true;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, sim_thread, NULL);
+}
+
+long sim_replay(const struct sim_world *sim_world, const char *log_path, unsigned int *bad_tick)
+{
+	FILE *file = fopen(log_path, "rb");
+	if (file == NULL)
+		return -1;
+
+	struct sim_log_header header;
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+		memcmp(header.magic, SIM_LOG_MAGIC, sizeof(header.magic)) != 0)
+	{
+		fclose(file);
+		return -1;
+	}
+
+	world = sim_world;
+	rng_state = header.seed;
+	running = replaying = true;
+
+	struct sim_record record;
+	bool in_tick = false;
+	long n_ticks = 0;
+
+	while (fread(&record, sizeof(record), 1, file) == 1)
+	{
+		tick = record.tick;
+
+		if (record.input.kind != SIM_HASH)
+		{
+			if (!in_tick)
+				world->begin();
+			in_tick = true;
+
+			world->apply(&record.input);
+			continue;
+		}
+
+		// Logged inputs always applied, and to the same world as now
+		in_tick = false;
+		n_ticks++;
+		if (world->end() != record.input.session)
+		{
+			*bad_tick = tick;
+			fclose(file);
+			return -2;
+		}
+	}
+
+	// The run stopped in the middle of writing a tick
+	if (in_tick)
+		world->end();
+
+	fclose(file);
+	return n_ticks;
+}
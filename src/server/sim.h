@@ -0,0 +1,67 @@
+#include <stdbool.h>
+
+// Alternative to applying input on whichever thread received it: the network
+// threads push inputs into a lock-free queue and a single simulation thread,
+// the only one that writes the world, applies them in the order they came
+// once every SIM_TICK_MS. Everything random in the world comes from
+// sim_rand(), so the inputs of a run, logged as they were applied, replay to
+// exactly the same world
+#define SIM_TICK_MS 20
+
+// Inputs waiting for the next tick, producers wait while it is full
+#define SIM_QUEUE_SLOTS 4096
+
+// Kinds of input
+enum sim_kind
+{
+	SIM_JOIN,	   // A player joins in slot index
+	SIM_LEAVE,	   // The player in slot index (with session) is gone
+	SIM_MOVE,	   // n_moves moves of the player in slot index (with session)
+	SIM_REVIVE,	   // The player in slot index (with session) keeps playing
+	SIM_BOT,	   // A new bot, in the slot chosen for it
+	SIM_BOTS_MOVE, // Every bot takes a random step
+	SIM_PRIZE,	   // A new prize if there is room, in the slot chosen for it
+	SIM_HASH	   // Log only, ends a tick with the hash of the world (session)
+};
+
+struct sim_input
+{
+	unsigned char kind;
+	unsigned char n_moves;
+	unsigned short index;
+	unsigned int session;
+	unsigned char moves[MAX_MOVES];
+};
+
+// How the simulation reaches the world, called from its thread only
+struct sim_world
+{
+	// Called around the inputs of every tick that has any, end returns the
+	// hash of the world after them
+	void (*begin)();
+	unsigned int (*end)();
+
+	// Applies an input, filling in what the simulation chose for it (the
+	// slot of a spawn). Returns false if it did not apply, e.g. it came from
+	// a player that is gone, those are left out of the log
+	bool (*apply)(struct sim_input *input);
+};
+
+// Starts the simulation thread, logging the inputs to log_path unless NULL
+void sim_start(const struct sim_world *world, const char *log_path);
+
+// Applies the log written by a run on this thread, checking every tick ends
+// on the same world as in the run. Returns the number of ticks replayed, -1
+// if the log can not be read or -2 with the tick that did not match in
+// bad_tick
+long sim_replay(const struct sim_world *world, const char *log_path, unsigned int *bad_tick);
+
+// Whether the world is owned by the simulation, and whether it is replaying
+bool sim_running();
+bool sim_replaying();
+
+// Queues an input for the next tick
+void sim_push(const struct sim_input *input);
+
+// Randomness of the world, simulation thread only
+unsigned int sim_rand();
@@ -0,0 +1,314 @@
+/* Standard libraries */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+
+/* System libraries */
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "../chase.h"
+#include "spectate.h"
+
+// A tick as written to the ring
+struct frame
+{
+	long start; // Ring position of its first byte
+	int len;
+};
+
+struct spectator
+{
+	conn_t conn;
+	long frame; // First tick not completely sent yet
+	long pos;	// Ring position of the next byte to send
+};
+
+static world_fn get_world;
+
+// Ring of encoded ticks, only the spectator thread ever touches it
+static char ring[SPECTATE_RING_BYTES];
+static long ring_head; // Ring position of the next byte written
+static struct frame frames[SPECTATE_FRAMES];
+static long n_frames;
+static long last_keyframe = -1;
+
+// Owned by the spectator thread too
+static struct spectator spectators[SPECTATE_MAX];
+static int n_spectators;
+
+// Connections handed over by the client threads, picked up on the next tick,
+// n_total also counts the ones already picked up
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static conn_t pending[SPECTATE_MAX];
+static int n_pending, n_total;
+
+static long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static struct frame *frame_at(long n) { return &frames[n % SPECTATE_FRAMES]; }
+
+static void frame_push(const char *data, int len, bool keyframe)
+{
+	struct frame *frame = frame_at(n_frames);
+	frame->start = ring_head;
+	frame->len = len;
+
+	int at = ring_head % SPECTATE_RING_BYTES;
+	int first = SPECTATE_RING_BYTES - at < len ? SPECTATE_RING_BYTES - at : len;
+	memcpy(&ring[at], data, first);
+	memcpy(ring, &data[first], len - first);
+	ring_head += len;
+
+	if (keyframe)
+		last_keyframe = n_frames;
+	n_frames++;
+}
+
+// Encodes what changed since the last tick, or the whole board when a
+// keyframe is due, and appends it to the ring (nothing if nothing changed)
+static void tick()
+{
+	static struct board_state world, shown;
+	static char buffer[SPECTATE_FRAME_MAX_BYTES];
+	static int ticks; // Since the last keyframe
+
+	get_world(&world);
+
+	struct msg_data *msgs = (struct msg_data *) buffer;
+	int max_msgs = SPECTATE_FRAME_MAX_BYTES / sizeof(struct msg_data);
+	int n_msgs = 0;
+	int j = 0;
+	bool fits = true;
+
+	for (int cell = 0; cell < MAX_BALLS && fits; cell++)
+	{
+		if (world.ch[cell] == shown.ch[cell] && world.hp[cell] == shown.hp[cell])
+			continue;
+
+		if (j == 0)
+		{
+			if (n_msgs == max_msgs)
+			{
+				fits = false;
+				break;
+			}
+			memset(&msgs[n_msgs], 0, sizeof(struct msg_data));
+			msgs[n_msgs].type = FSTATUS;
+		}
+
+		// Cells that got empty are drawn as a blank
+		ball_info_t ball = {cell % WINDOW_SIZE, cell / WINDOW_SIZE, world.hp[cell], world.ch[cell]};
+		if (ball.ch == 0)
+			ball.ch = ' ';
+
+		msgs[n_msgs].field[j++] = ball;
+		if (j == 2)
+		{
+			n_msgs++;
+			j = 0;
+		}
+	}
+	if (j != 0)
+		n_msgs++;
+
+	bool changed = n_msgs > 0 || !fits;
+	ticks++;
+
+	// Keyframes are only written when something changed, until then the last
+	// one and the ticks after it are all still in the ring
+	if (last_keyframe == -1 || !fits || (changed && ticks >= SPECTATE_KEYFRAME_TICKS))
+	{
+		ball_info_t balls[MAX_BALLS];
+		int n_balls = 0;
+
+		for (int cell = 0; cell < MAX_BALLS; cell++)
+		{
+			if (world.ch[cell] != 0)
+			{
+				ball_info_t ball = {cell % WINDOW_SIZE, cell / WINDOW_SIZE, world.hp[cell], world.ch[cell]};
+				balls[n_balls++] = ball;
+			}
+		}
+
+		memset(&msgs[0], 0, sizeof(struct msg_data));
+		msgs[0].type = FSNAP;
+		msgs[0].len = snapshot_encode(balls, n_balls, (unsigned char *) &msgs[1]);
+
+		frame_push(buffer, sizeof(struct msg_data) + msgs[0].len, true);
+		ticks = 0;
+	}
+	else if (changed)
+	{
+		frame_push(buffer, n_msgs * sizeof(struct msg_data), false);
+	}
+
+	shown = world;
+}
+
+// Sends the spectator what it did not get yet without blocking, returns false
+// if it has to be disconnected
+static bool feed(struct spectator *s)
+{
+	// Too far behind, skip to the latest keyframe, which is only possible
+	// between ticks
+	if (s->frame < n_frames - SPECTATE_KEYFRAME_TICKS)
+	{
+		if (s->pos != frame_at(s->frame)->start)
+			return false;
+
+		s->frame = last_keyframe;
+		s->pos = frame_at(last_keyframe)->start;
+	}
+
+	while (s->pos < ring_head)
+	{
+		int at = s->pos % SPECTATE_RING_BYTES;
+		int len = ring_head - s->pos;
+		int first = SPECTATE_RING_BYTES - at < len ? SPECTATE_RING_BYTES - at : len;
+
+		struct iovec iov[2] = {{&ring[at], first}, {ring, len - first}};
+		ssize_t n = conn_try_sendv(&s->conn, iov, len > first ? 2 : 1);
+		if (n == -1)
+			return false;
+		if (n == 0)
+			break;
+
+		s->pos += n;
+	}
+
+	while (s->frame < n_frames && s->pos >= frame_at(s->frame)->start + frame_at(s->frame)->len)
+		s->frame++;
+
+	return true;
+}
+
+static void spectator_remove(int i)
+{
+	conn_close(&spectators[i].conn);
+	conn_free(&spectators[i].conn);
+	spectators[i] = spectators[--n_spectators];
+
+	pthread_mutex_lock(&pending_lock);
+	n_total--;
+	pthread_mutex_unlock(&pending_lock);
+}
+
+// Picks up the new spectators, they start from the latest keyframe
+static void adopt_pending()
+{
+	pthread_mutex_lock(&pending_lock);
+
+	for (int i = 0; i < n_pending; i++)
+	{
+		struct spectator *s = &spectators[n_spectators++];
+		s->conn = pending[i];
+		s->frame = last_keyframe;
+		s->pos = frame_at(last_keyframe)->start;
+	}
+	n_pending = 0;
+
+	pthread_mutex_unlock(&pending_lock);
+}
+
+// Thread function that ticks and feeds every spectator
+void *spectate_thread(void *arg)
+{
+	static struct pollfd fds[SPECTATE_MAX];
+	long next_tick = now_ms();
+
+	while (1)
+	{
+		long now = now_ms();
+		if (now >= next_tick)
+		{
+			next_tick += SPECTATE_TICK_MS;
+			if (next_tick <= now)
+				next_tick = now + SPECTATE_TICK_MS;
+
+			tick();
+			adopt_pending();
+
+			for (int i = n_spectators - 1; i >= 0; i--)
+			{
+				if (!feed(&spectators[i]))
+					spectator_remove(i);
+			}
+			conn_flush();
+		}
+
+		// Spectators never send anything, their sockets are only polled to
+		// notice they went away. Stream sockets that could not take the whole
+		// tick are polled for space too, the rest retry on the next tick
+		for (int i = 0; i < n_spectators; i++)
+		{
+			struct spectator *s = &spectators[i];
+			fds[i].fd = s->conn.fd;
+			fds[i].events = POLLIN;
+			if (s->pos < ring_head && s->conn.shm == NULL && s->conn.uring == NULL)
+				fds[i].events |= POLLOUT;
+		}
+
+		int timeout = next_tick - now_ms();
+		if (poll(fds, n_spectators, timeout > 0 ? timeout : 0) <= 0)
+			continue;
+
+		for (int i = n_spectators - 1; i >= 0; i--)
+		{
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				char discard[sizeof(struct msg_data)];
+				ssize_t n = recv(fds[i].fd, discard, sizeof(discard), MSG_DONTWAIT);
+				if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				{
+					spectator_remove(i);
+					continue;
+				}
+			}
+			if ((fds[i].revents & POLLOUT) && !feed(&spectators[i]))
+				spectator_remove(i);
+		}
+	}
+	return NULL;
+}
+
+void spectate_init(world_fn world)
+{
+	get_world = world;
+
+	// Every spectator is a file descriptor, allow as many as the hard limit
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+	{
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+bool spectate_add(conn_t conn)
+{
+	pthread_mutex_lock(&pending_lock);
+
+	bool added = n_total < SPECTATE_MAX;
+	if (added)
+	{
+		pending[n_pending++] = conn;
+		n_total++;
+	}
+
+	pthread_mutex_unlock(&pending_lock);
+	return added;
+}
+
+void spectate_start()
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, spectate_thread, NULL);
+}
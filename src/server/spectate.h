@@ -0,0 +1,35 @@
+#include <stdbool.h>
+
+// Spectators watch the game without a ball slot and never send input. A
+// single thread serves all of them at a coarser rate than the players get:
+// every SPECTATE_TICK_MS the cells that changed since the last tick are
+// encoded once into a shared ring, and each spectator is only a cursor into
+// it that gets sent whatever it has not seen yet
+#define SPECTATE_TICK_MS 100
+#define SPECTATE_MAX 4096
+
+// Every SPECTATE_KEYFRAME_TICKS the tick is the whole board (an FSNAP), new
+// spectators start from the latest one and so do the ones that fall more
+// than that many ticks behind. A spectator stuck in the middle of a tick for
+// that long is disconnected
+#define SPECTATE_KEYFRAME_TICKS 20
+
+// A tick never takes more than a keyframe, bigger changes go as one
+#define SPECTATE_FRAME_MAX_BYTES ((int)sizeof(struct msg_data) + SNAP_MAX_BYTES)
+
+// Ticks kept in the ring, enough for anybody who is not being skipped
+#define SPECTATE_FRAMES (2 * SPECTATE_KEYFRAME_TICKS)
+#define SPECTATE_RING_BYTES (SPECTATE_FRAMES * SPECTATE_FRAME_MAX_BYTES)
+
+// Called from the spectator thread (without any of its state locked) to get
+// the current board
+typedef void (*world_fn)(struct board_state *world);
+
+void spectate_init(world_fn world);
+
+// Hands a connection that already got its BINFO over to the spectator
+// thread, returns false if there are too many spectators
+bool spectate_add(conn_t conn);
+
+// Starts the thread that ticks and feeds the spectators
+void spectate_start();
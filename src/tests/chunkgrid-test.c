@@ -0,0 +1,195 @@
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* System libraries */
+#include <pthread.h>
+
+#include "../../lib/chunkgrid.h"
+
+// Checks the chunked grid on a board past CHUNK_GRID_DENSE_CELLS against a
+// plain array: lookups, chunks allocated on the first set, freed once empty
+// and released, what chunk_grid_bytes() says all along, and sets from
+// several threads at once. Exits non-zero on the first check that fails
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit(1); \
+		} \
+	} while (0)
+
+// Not a multiple of the chunk side, so the last chunks are partial
+#define WIDTH 1000
+#define HEIGHT 700
+#define RANDOM_ROUNDS 200
+#define N_THREADS 4
+
+#define CHUNKS_X ((WIDTH + CHUNK_GRID_SIZE - 1) / CHUNK_GRID_SIZE)
+#define CHUNKS_Y ((HEIGHT + CHUNK_GRID_SIZE - 1) / CHUNK_GRID_SIZE)
+#define DIRECTORY_BYTES ((long)CHUNKS_X * CHUNKS_Y * sizeof(struct grid_chunk *))
+#define CHUNK_BYTES ((long)sizeof(struct grid_chunk))
+
+static int shadow[HEIGHT][WIDTH];
+
+// Chunks with something in them, per the shadow
+static int used_chunks()
+{
+	int n = 0;
+	for (int cy = 0; cy < CHUNKS_Y; cy++)
+	{
+		for (int cx = 0; cx < CHUNKS_X; cx++)
+		{
+			int used = 0;
+			for (int y = cy * CHUNK_GRID_SIZE; y < (cy + 1) * CHUNK_GRID_SIZE && y < HEIGHT && !used; y++)
+				for (int x = cx * CHUNK_GRID_SIZE; x < (cx + 1) * CHUNK_GRID_SIZE && x < WIDTH && !used; x++)
+					used = shadow[y][x] != -1;
+			n += used;
+		}
+	}
+	return n;
+}
+
+static void check_all(const struct chunk_grid *grid)
+{
+	for (int y = 0; y < HEIGHT; y++)
+		for (int x = 0; x < WIDTH; x++)
+			CHECK(chunk_grid_get(grid, x, y) == shadow[y][x]);
+}
+
+static void set(struct chunk_grid *grid, int x, int y, int value)
+{
+	CHECK(chunk_grid_set(grid, x, y, value));
+	shadow[y][x] = value;
+}
+
+// Boards up to the limit stay one dense array
+static void test_dense()
+{
+	struct chunk_grid grid;
+
+	chunk_grid_init(&grid, 128, 128);
+	CHECK(grid.dense != NULL);
+	CHECK(chunk_grid_bytes(&grid) == 128 * 128 * (long)sizeof(int));
+
+	chunk_grid_set(&grid, 127, 127, 5);
+	CHECK(chunk_grid_get(&grid, 127, 127) == 5);
+	CHECK(chunk_grid_get(&grid, 0, 0) == -1);
+	chunk_grid_destroy(&grid);
+}
+
+static void test_chunks()
+{
+	struct chunk_grid grid;
+
+	memset(shadow, -1, sizeof(shadow));
+	chunk_grid_init(&grid, WIDTH, HEIGHT);
+	CHECK(grid.dense == NULL);
+	CHECK(chunk_grid_bytes(&grid) == DIRECTORY_BYTES);
+	CHECK(chunk_grid_get(&grid, WIDTH - 1, HEIGHT - 1) == -1);
+
+	// Emptying a cell of a chunk that is not there allocates nothing
+	set(&grid, 500, 500, -1);
+	CHECK(grid.n_allocated == 0);
+
+	// The first set allocates the chunk, more in it do not
+	set(&grid, 17, 33, 1);
+	CHECK(grid.n_allocated == 1);
+	CHECK(chunk_grid_bytes(&grid) == DIRECTORY_BYTES + CHUNK_BYTES);
+	set(&grid, 16, 47, 2);
+	set(&grid, 31, 32, 3);
+	CHECK(grid.n_allocated == 1);
+
+	// The corner, in the last (partial) chunk
+	set(&grid, WIDTH - 1, HEIGHT - 1, 4);
+	CHECK(grid.n_allocated == 2);
+	check_all(&grid);
+
+	// Emptied chunks stay until the release
+	set(&grid, 17, 33, -1);
+	set(&grid, 16, 47, -1);
+	set(&grid, 31, 32, -1);
+	CHECK(grid.n_allocated == 2);
+	chunk_grid_release(&grid);
+	CHECK(grid.n_allocated == 1);
+	CHECK(chunk_grid_bytes(&grid) == DIRECTORY_BYTES + CHUNK_BYTES);
+	check_all(&grid);
+
+	// A chunk filled again before the release is kept, with what it has
+	set(&grid, WIDTH - 1, HEIGHT - 1, -1);
+	set(&grid, WIDTH - 2, HEIGHT - 1, 6);
+	chunk_grid_release(&grid);
+	CHECK(grid.n_allocated == 1);
+	check_all(&grid);
+
+	// At random, the chunks allocated after a release are the ones in use
+	for (int round = 0; round < RANDOM_ROUNDS; round++)
+	{
+		for (int i = 0; i < 500; i++)
+		{
+			// Clustered, so chunks fill up and empty out
+			int x = (round * 37 % WIDTH + rand() % 64) % WIDTH;
+			int y = (round * 53 % HEIGHT + rand() % 64) % HEIGHT;
+			set(&grid, x, y, rand() % 3 == 0 ? -1 : rand() % 1000);
+		}
+		chunk_grid_release(&grid);
+		CHECK(grid.n_allocated == used_chunks());
+		CHECK(chunk_grid_bytes(&grid) == DIRECTORY_BYTES + grid.n_allocated * CHUNK_BYTES);
+	}
+	check_all(&grid);
+
+	chunk_grid_clear(&grid);
+	memset(shadow, -1, sizeof(shadow));
+	CHECK(grid.n_allocated == 0);
+	CHECK(chunk_grid_bytes(&grid) == DIRECTORY_BYTES);
+	check_all(&grid);
+
+	chunk_grid_destroy(&grid);
+}
+
+static struct chunk_grid shared_grid;
+
+// Every thread takes every N_THREADS-th column, so they race for the same
+// chunks but never for the same cell
+static void *fill_columns(void *arg)
+{
+	int first = (int)(long)arg;
+	for (int x = first; x < WIDTH; x += N_THREADS)
+		for (int y = 0; y < HEIGHT; y += 7)
+			chunk_grid_set(&shared_grid, x, y, y * WIDTH + x);
+	return NULL;
+}
+
+static void test_threads()
+{
+	pthread_t threads[N_THREADS];
+
+	chunk_grid_init(&shared_grid, WIDTH, HEIGHT);
+	for (int i = 0; i < N_THREADS; i++)
+		pthread_create(&threads[i], NULL, fill_columns, (void *)(long)i);
+	for (int i = 0; i < N_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	memset(shadow, -1, sizeof(shadow));
+	for (int x = 0; x < WIDTH; x++)
+		for (int y = 0; y < HEIGHT; y += 7)
+			shadow[y][x] = y * WIDTH + x;
+
+	// One chunk each, whoever lost the race freed theirs
+	CHECK(shared_grid.n_allocated == CHUNKS_X * CHUNKS_Y);
+	check_all(&shared_grid);
+	chunk_grid_destroy(&shared_grid);
+}
+
+int main()
+{
+	srand(1);
+	test_dense();
+	test_chunks();
+	test_threads();
+
+	printf("chunkgrid: ok\n");
+	return 0;
+}
@@ -0,0 +1,283 @@
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+/* System libraries */
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "../../lib/conn.h"
+#include "../../lib/world.h"
+
+// Times the scans the server runs over its ball table (who gets a broadcast,
+// the players for the stats, every ball for a snapshot and the cells the
+// bots chase) on the column layout of libchase against the array of structs
+// the server used to keep, and against ball_info_t split further into an
+// array per field, all filled with the same N balls:
+//     ./bin/layout-bench.out [balls] [iterations]
+
+#define BENCH_BALLS 100
+#define BENCH_ITERATIONS 200000
+
+// The server's per connection state, the column next to ball_type and
+// ball_info
+struct client_info
+{
+	conn_t conn;
+	unsigned int session;
+	bool udp_enabled;
+	bool udp_ready;
+	struct sockaddr_in udp_addr;
+	unsigned int udp_rx_seq;
+	unsigned int udp_tx_seq;
+	unsigned int udp_acked;
+	unsigned int udp_keyframe_seq;
+	unsigned int udp_token;
+	bool compressed;
+	bool relayed;
+	int relay;
+	unsigned int channel;
+	bool respawning;
+	unsigned long respawn_timer;
+	unsigned int token;
+	bool detached;
+	unsigned long grace_timer;
+};
+
+static struct client_info clients[MAX_BALLS];
+
+// The old layout, a ball and its connection state in one struct
+struct old_ball
+{
+	conn_t conn;
+	enum ball_type type;
+	ball_info_t info;
+	unsigned int session;
+	bool udp_enabled;
+	bool udp_ready;
+	struct sockaddr_in udp_addr;
+	unsigned int udp_rx_seq;
+	unsigned int udp_tx_seq;
+	unsigned int udp_acked;
+	unsigned int udp_keyframe_seq;
+	bool compressed;
+	bool respawning;
+	pthread_t respawn_thread;
+	struct
+	{
+		int client_index;
+		unsigned int session;
+	} respawn_args;
+};
+
+static struct old_ball old_balls[MAX_BALLS];
+
+// ball_info_t split in one array per field, positions apart from hp and glyph
+static int split_x[MAX_BALLS], split_y[MAX_BALLS], split_hp[MAX_BALLS];
+static char split_ch[MAX_BALLS];
+
+// Keeps the scans from being optimized away
+static volatile long sink;
+static ball_info_t copy[MAX_BALLS];
+
+static long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Same balls in both layouts, in slots spread over the table the way churn
+// leaves them
+static void fill(int n_balls)
+{
+	static const struct world_hooks hooks = {0};
+	int slots[MAX_BALLS];
+
+	world_init(&hooks);
+	for (int i = 0; i < MAX_BALLS; i++)
+		slots[i] = i;
+	for (int i = MAX_BALLS - 1; i > 0; i--)
+	{
+		int j = rand() % (i + 1);
+		int slot = slots[i];
+		slots[i] = slots[j];
+		slots[j] = slot;
+	}
+
+	for (int i = 0; i < n_balls; i++)
+	{
+		int index = slots[i];
+		int type = i % 3 == 0 ? BOT : i % 3 == 1 ? PRIZE : PLAYER;
+
+		ball_info[index] = create_ball();
+		set_ball_type(index, type);
+		place_ball(index);
+		clients[index].udp_ready = i % 4 == 0;
+
+		old_balls[index].type = type;
+		old_balls[index].info = ball_info[index];
+		old_balls[index].udp_ready = clients[index].udp_ready;
+
+		split_x[index] = ball_info[index].pos_x;
+		split_y[index] = ball_info[index].pos_y;
+		split_hp[index] = ball_info[index].hp;
+		split_ch[index] = ball_info[index].ch;
+	}
+}
+
+// Players that get the broadcast from the ring
+static long broadcast_old()
+{
+	long sum = 0;
+	for (int i = 0; i < MAX_BALLS; i++)
+	{
+		if (old_balls[i].type == PLAYER && !old_balls[i].udp_ready)
+			sum += i;
+	}
+	return sum;
+}
+
+static long broadcast_new()
+{
+	long sum = 0;
+	for_each_ball(i, BALL_MASK(PLAYER))
+	{
+		if (!clients[i].udp_ready)
+			sum += i;
+	}
+	return sum;
+}
+
+// Copy of the players, for the stats
+static long stats_old()
+{
+	int n = 0;
+	for (int i = 0; i < MAX_BALLS; i++)
+	{
+		if (old_balls[i].type == PLAYER)
+			copy[n++] = old_balls[i].info;
+	}
+	return n;
+}
+
+static long stats_new()
+{
+	int n = 0;
+	for_each_ball(i, BALL_MASK(PLAYER))
+		copy[n++] = ball_info[i];
+	return n;
+}
+
+static long stats_split()
+{
+	int n = 0;
+	for_each_ball(i, BALL_MASK(PLAYER))
+		copy[n++] = (ball_info_t){split_x[i], split_y[i], split_hp[i], split_ch[i]};
+	return n;
+}
+
+// Copy of every ball, for a snapshot
+static long snapshot_old()
+{
+	int n = 0;
+	for (int i = 0; i < MAX_BALLS; i++)
+	{
+		if (old_balls[i].type != EMPTY)
+			copy[n++] = old_balls[i].info;
+	}
+	return n;
+}
+
+static long snapshot_new()
+{
+	int n = 0;
+	for_each_ball(i, ANY_BALL)
+		copy[n++] = ball_info[i];
+	return n;
+}
+
+static long snapshot_split()
+{
+	int n = 0;
+	for_each_ball(i, ANY_BALL)
+		copy[n++] = (ball_info_t){split_x[i], split_y[i], split_hp[i], split_ch[i]};
+	return n;
+}
+
+// Cells of the players and prizes, the targets of the bots' flow field
+static long targets_old()
+{
+	long sum = 0;
+	for (int i = 0; i < MAX_BALLS; i++)
+	{
+		if (old_balls[i].type == PLAYER || old_balls[i].type == PRIZE)
+			sum += old_balls[i].info.pos_y * WINDOW_SIZE + old_balls[i].info.pos_x;
+	}
+	return sum;
+}
+
+static long targets_new()
+{
+	long sum = 0;
+	for_each_ball(i, BALL_MASK(PLAYER) | BALL_MASK(PRIZE))
+		sum += ball_info[i].pos_y * WINDOW_SIZE + ball_info[i].pos_x;
+	return sum;
+}
+
+static long targets_split()
+{
+	long sum = 0;
+	for_each_ball(i, BALL_MASK(PLAYER) | BALL_MASK(PRIZE))
+		sum += split_y[i] * WINDOW_SIZE + split_x[i];
+	return sum;
+}
+
+// Nanoseconds per call
+static double time_scan(long (*scan)(), int iterations)
+{
+	long start = now_ns();
+	for (int i = 0; i < iterations; i++)
+		sink += scan();
+	return (double)(now_ns() - start) / iterations;
+}
+
+static void compare(const char *name, long (*old_scan)(), long (*new_scan)(), long (*split_scan)(), int iterations)
+{
+	if (old_scan() != new_scan() || old_scan() != split_scan())
+	{
+		fprintf(stderr, "%s: the layouts disagree\n", name);
+		exit(1);
+	}
+
+	double old_ns = time_scan(old_scan, iterations);
+	double new_ns = time_scan(new_scan, iterations);
+	double split_ns = time_scan(split_scan, iterations);
+	printf("%-10s %12.1f %12.1f %12.1f %8.2fx\n", name, old_ns, new_ns, split_ns, new_ns > 0 ? old_ns / new_ns : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+	int n_balls = argc > 1 ? atoi(argv[1]) : BENCH_BALLS;
+	int iterations = argc > 2 ? atoi(argv[2]) : BENCH_ITERATIONS;
+
+	if (n_balls < 0 || n_balls > BOARD_CELLS || iterations < 1)
+	{
+		printf("Usage: %s [balls [0,%d]] [iterations]\n", argv[0], BOARD_CELLS);
+		exit(-1);
+	}
+
+	srand(1);
+	fill(n_balls);
+
+	printf("%d balls, %d iterations, ns per scan\n", n_balls, iterations);
+	printf("%-10s %12s %12s %12s %9s\n", "scan", "old", "columns", "split", "speedup");
+	// Who gets a broadcast does not read ball_info at all
+	compare("broadcast", broadcast_old, broadcast_new, broadcast_new, iterations);
+	compare("stats", stats_old, stats_new, stats_split, iterations);
+	compare("snapshot", snapshot_old, snapshot_new, snapshot_split, iterations);
+	compare("targets", targets_old, targets_new, targets_split, iterations);
+	return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Records a simulation log of a server under load with its moves resolved in
+# 3 regions, then replays it resolving them in 1 and in 6: every tick has to
+# end on the board the recorded run hashed in its SIM_HASH record, which the
+# replay checks and fails on. Run from the top of the tree after make
+#     sh ./src/tests/replay-test.sh [port] [seconds]
+
+PORT=${1:-5650}
+SECONDS_RUN=${2:-5}
+DIR=$(mktemp -d)
+LOG=$DIR/sim.log
+status=0
+
+# The server draws on a terminal, script gives it one
+TERM=${TERM:-xterm} script -qfc "./bin/chase-server.out -p 3 -l $LOG 127.0.0.1 $PORT 3" /dev/null > /dev/null 2>&1 &
+sleep 1
+
+./bin/swarm.out 127.0.0.1 $PORT 40 $SECONDS_RUN || status=1
+
+# The log path only shows up in this run's command line
+pkill -INT -f -- "-l $LOG"
+sleep 1
+
+for regions in 1 6; do
+	TERM=${TERM:-xterm} script -qec "./bin/chase-server.out -p $regions -r $LOG" $DIR/replay-$regions.txt > /dev/null 2>&1
+	if [ $? -ne 0 ] || ! grep -q "the board matches" $DIR/replay-$regions.txt; then
+		echo "replay with $regions regions:"
+		cat $DIR/replay-$regions.txt
+		status=1
+	fi
+done
+
+# A run that logged no ticks would pass without checking anything
+if ! grep -q "Replayed [1-9]" $DIR/replay-1.txt; then
+	echo "nothing was logged"
+	status=1
+fi
+
+[ $status -eq 0 ] && echo "replay: ok" && grep -h "Replayed" $DIR/replay-*.txt
+rm -rf $DIR
+exit $status
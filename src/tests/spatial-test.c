@@ -0,0 +1,285 @@
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../lib/spatial.h"
+#include "../../lib/bitboard.h"
+
+// Checks spatial_nearest() and spatial_in_rect() against a scan of every
+// entity, on boards of a few shapes with entities coming, moving and going at
+// random, and bitboard_free_in_rect() against a scan of every cell on boards
+// of the same shapes. Ties in distance may come in any order, so what is
+// compared for the nearest is the distances, and entities in a rectangle come
+// in bucket order, so what is compared for those is the set.
+// Exits non-zero on the first check that fails
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit(1); \
+		} \
+	} while (0)
+
+#define N_TYPES 4
+#define MAX_K 8
+// Most a rectangle query is asked to write
+#define MAX_RECT 64
+
+struct shape
+{
+	int width, height, bucket_size, n_ids;
+	int rounds;
+};
+
+static const struct shape shapes[] = {
+	{20, 20, 4, 400, 2000},		   // The game board
+	{10, 7, 3, 50, 2000},		   // Buckets that do not divide the board
+	{1000, 700, 16, 100000, 300},  // Big and sparse
+	{64, 64, 8, 4096, 1000},	   // Crowded, every cell can be taken
+};
+
+// What the index should have, kept by hand
+static int *is_in, *at_x, *at_y, *type_of;
+
+static int distance(int id, int x, int y)
+{
+	return abs(at_x[id] - x) + abs(at_y[id] - y);
+}
+
+static int by_value(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static void check_query(const struct spatial_index *si, int n_ids, unsigned int types, int x, int y, int max_dist, int k)
+{
+	int ids[MAX_K];
+	int n = spatial_nearest(si, types, x, y, max_dist, k, ids);
+
+	// The k smallest distances there are
+	static int *all;
+	static int all_cap;
+	if (all_cap < n_ids)
+	{
+		all = realloc(all, n_ids * sizeof(int));
+		all_cap = n_ids;
+	}
+
+	int n_all = 0;
+	for (int id = 0; id < n_ids; id++)
+	{
+		if (is_in[id] && (types & (1u << type_of[id])) && (max_dist == -1 || distance(id, x, y) <= max_dist))
+			all[n_all++] = distance(id, x, y);
+	}
+	qsort(all, n_all, sizeof(int), by_value);
+
+	CHECK(n == (n_all < k ? n_all : k));
+	for (int i = 0; i < n; i++)
+	{
+		CHECK(ids[i] >= 0 && ids[i] < n_ids && is_in[ids[i]]);
+		CHECK(types & (1u << type_of[ids[i]]));
+		CHECK(spatial_distance(si, ids[i], x, y) == distance(ids[i], x, y));
+		CHECK(distance(ids[i], x, y) == all[i]);
+		for (int j = 0; j < i; j++)
+			CHECK(ids[j] != ids[i]);
+	}
+}
+
+// A rectangle around the board, possibly sticking out of it or empty
+static void random_rect(const struct shape *s, int *x0, int *y0, int *x1, int *y1)
+{
+	int span = s->bucket_size * 3;
+
+	*x0 = rand() % (s->width + 2) - 1;
+	*y0 = rand() % (s->height + 2) - 1;
+	*x1 = *x0 + rand() % (span + 1) - 1;
+	*y1 = *y0 + rand() % (span + 1) - 1;
+}
+
+static void check_rect(const struct spatial_index *si, int n_ids, unsigned int types, int x0, int y0, int x1, int y1, int max)
+{
+	int ids[MAX_RECT];
+	int n = spatial_in_rect(si, types, x0, y0, x1, y1, ids, max);
+
+	CHECK(spatial_in_rect(si, types, x0, y0, x1, y1, NULL, 0) == n);
+
+	// Every entity there is
+	static int *all;
+	static int all_cap;
+	if (all_cap < n_ids)
+	{
+		all = realloc(all, n_ids * sizeof(int));
+		all_cap = n_ids;
+	}
+
+	int n_all = 0;
+	for (int id = 0; id < n_ids; id++)
+	{
+		if (is_in[id] && (types & (1u << type_of[id])) &&
+			at_x[id] >= x0 && at_x[id] <= x1 && at_y[id] >= y0 && at_y[id] <= y1)
+			all[n_all++] = id;
+	}
+	CHECK(n == n_all);
+
+	// The ones written are some of them, each once, and all of them when
+	// they fit
+	int n_written = n < max ? n : max;
+	qsort(ids, n_written, sizeof(int), by_value);
+	for (int i = 0; i < n_written; i++)
+	{
+		CHECK(ids[i] >= 0 && ids[i] < n_ids && is_in[ids[i]]);
+		CHECK(types & (1u << type_of[ids[i]]));
+		CHECK(at_x[ids[i]] >= x0 && at_x[ids[i]] <= x1 && at_y[ids[i]] >= y0 && at_y[ids[i]] <= y1);
+		CHECK(i == 0 || ids[i - 1] != ids[i]);
+		if (n <= max)
+			CHECK(ids[i] == all[i]);
+	}
+}
+
+static void test_shape(const struct shape *s)
+{
+	struct spatial_index si;
+	spatial_init(&si, s->width, s->height, s->bucket_size, s->n_ids, N_TYPES);
+
+	is_in = calloc(s->n_ids, sizeof(int));
+	at_x = calloc(s->n_ids, sizeof(int));
+	at_y = calloc(s->n_ids, sizeof(int));
+	type_of = calloc(s->n_ids, sizeof(int));
+
+	for (int round = 0; round < s->rounds; round++)
+	{
+		// A batch of changes, mostly small moves like the balls make
+		for (int i = 0; i < s->n_ids / 10 + 1; i++)
+		{
+			int id = rand() % s->n_ids;
+			int what = rand() % 10;
+
+			if (what == 0)
+			{
+				spatial_remove(&si, id);
+				is_in[id] = 0;
+			}
+			else if (what < 5 || !is_in[id])
+			{
+				type_of[id] = rand() % N_TYPES;
+				at_x[id] = rand() % s->width;
+				at_y[id] = rand() % s->height;
+				spatial_place(&si, id, type_of[id], at_x[id], at_y[id]);
+				is_in[id] = 1;
+			}
+			else
+			{
+				int x = at_x[id] + rand() % 3 - 1, y = at_y[id] + rand() % 3 - 1;
+				if (x >= 0 && x < s->width && y >= 0 && y < s->height)
+				{
+					at_x[id] = x;
+					at_y[id] = y;
+					spatial_place(&si, id, type_of[id], x, y);
+				}
+			}
+			CHECK(spatial_contains(&si, id) == is_in[id]);
+		}
+
+		unsigned int types = rand() % (1 << N_TYPES);
+		int x = rand() % s->width, y = rand() % s->height;
+		int max_dist = rand() % 3 == 0 ? -1 : rand() % (s->bucket_size * 4);
+		int k = rand() % MAX_K + 1;
+		check_query(&si, s->n_ids, types, x, y, max_dist, k);
+
+		int x0, y0, x1, y1;
+		random_rect(s, &x0, &y0, &x1, &y1);
+		check_rect(&si, s->n_ids, types, x0, y0, x1, y1, rand() % (MAX_RECT + 1));
+	}
+
+	// Nothing left, nothing found
+	for (int id = 0; id < s->n_ids; id++)
+	{
+		spatial_remove(&si, id);
+		is_in[id] = 0;
+	}
+	check_query(&si, s->n_ids, (1 << N_TYPES) - 1, 0, 0, -1, MAX_K);
+	check_rect(&si, s->n_ids, (1 << N_TYPES) - 1, 0, 0, s->width - 1, s->height - 1, MAX_RECT);
+
+	spatial_destroy(&si);
+	free(is_in);
+	free(at_x);
+	free(at_y);
+	free(type_of);
+}
+
+static void check_free_in_rect(const struct bitboard *bb, const char *taken, int x0, int y0, int x1, int y1, int max)
+{
+	int cells[MAX_RECT];
+	int n = bitboard_free_in_rect(bb, x0, y0, x1, y1, cells, max);
+
+	CHECK(bitboard_free_in_rect(bb, x0, y0, x1, y1, NULL, 0) == n);
+
+	// The free cells there, in cell order
+	int n_free = 0;
+	for (int y = y0 < 0 ? 0 : y0; y <= y1 && y < bb->height; y++)
+	{
+		for (int x = x0 < 0 ? 0 : x0; x <= x1 && x < bb->width; x++)
+		{
+			int cell = y * bb->width + x;
+
+			CHECK(bitboard_test(bb, x, y) == taken[cell]);
+			if (taken[cell])
+				continue;
+			if (n_free < max)
+				CHECK(cells[n_free] == cell);
+			n_free++;
+		}
+	}
+	CHECK(n == n_free);
+}
+
+static void test_bitboard(const struct shape *s)
+{
+	struct bitboard bb;
+	int n_cells = s->width * s->height;
+	char *taken = calloc(n_cells, 1);
+
+	bitboard_init(&bb, s->width, s->height);
+	for (int round = 0; round < s->rounds; round++)
+	{
+		// Cells taken and let go in clusters, so rows have runs of both
+		int around = rand() % n_cells;
+		for (int i = 0; i < s->n_ids / 10 + 1; i++)
+		{
+			int cell = (around + rand() % (s->width * 4)) % n_cells;
+			int x = cell % s->width, y = cell / s->width;
+
+			if (taken[cell])
+				bitboard_clear(&bb, x, y);
+			else
+				bitboard_set(&bb, x, y);
+			taken[cell] = !taken[cell];
+		}
+
+		int x0, y0, x1, y1;
+		random_rect(s, &x0, &y0, &x1, &y1);
+		check_free_in_rect(&bb, taken, x0, y0, x1, y1, rand() % (MAX_RECT + 1));
+	}
+
+	// Whole rows, which cross words on every board wider than 64
+	for (int y = 0; y < s->height; y += s->height / 4 + 1)
+		check_free_in_rect(&bb, taken, -1, y, s->width, y, MAX_RECT);
+
+	bitboard_destroy(&bb);
+	free(taken);
+}
+
+int main()
+{
+	srand(1);
+	for (int i = 0; i < (int)(sizeof(shapes) / sizeof(shapes[0])); i++)
+	{
+		test_shape(&shapes[i]);
+		test_bitboard(&shapes[i]);
+	}
+
+	printf("spatial: ok\n");
+	return 0;
+}
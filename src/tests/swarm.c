@@ -0,0 +1,140 @@
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+/* System libraries */
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "../chase.h"
+
+// Load for a server: players that join, move at random, ask to continue the
+// game and now and then leave and join again, draining everything the server
+// sends without looking at it:
+//     ./bin/swarm.out <server_IP> <server_port> <players> <seconds>
+
+#define SWARM_MAX_PLAYERS 300
+#define SWARM_TICK_MS 30
+// One in this many ticks a player leaves and joins again
+#define SWARM_CHURN 400
+
+static struct sockaddr_in server_address;
+
+// Joins a new player, -1 if the server is not there
+static int join()
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&server_address, sizeof(server_address)) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+
+	struct msg_data msg = {0};
+	msg.type = CONN;
+	if (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg))
+	{
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+// Reads whatever the server sent, returns false if it closed the connection
+static bool drain(int fd)
+{
+	static char buffer[65536];
+
+	while (1)
+	{
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n > 0)
+			continue;
+		return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int n_players = argc == 5 ? atoi(argv[3]) : 0;
+	int seconds = argc == 5 ? atoi(argv[4]) : 0;
+
+	if (argc != 5 || inet_addr(argv[1]) == INADDR_NONE || n_players < 1 ||
+		n_players > SWARM_MAX_PLAYERS || seconds < 1)
+	{
+		printf("Usage: %s <server_IP> <server_port> <players [1,%d]> <seconds>\n", argv[0], SWARM_MAX_PLAYERS);
+		exit(-1);
+	}
+
+	server_address.sin_family = AF_INET;
+	server_address.sin_port = htons(atoi(argv[2]));
+	inet_pton(AF_INET, argv[1], &server_address.sin_addr);
+
+	int fds[SWARM_MAX_PLAYERS];
+	for (int i = 0; i < n_players; i++)
+	{
+		fds[i] = join();
+		if (fds[i] == -1)
+		{
+			perror("connect");
+			exit(-1);
+		}
+	}
+
+	srand(time(NULL));
+	long n_moves = 0, n_joins = n_players;
+	time_t end = time(NULL) + seconds;
+
+	while (time(NULL) < end)
+	{
+		for (int i = 0; i < n_players; i++)
+		{
+			// Turned down or gone, try again next tick
+			if (fds[i] == -1 || !drain(fds[i]) || rand() % SWARM_CHURN == 0)
+			{
+				if (fds[i] != -1)
+					close(fds[i]);
+				fds[i] = join();
+				n_joins += fds[i] != -1;
+				continue;
+			}
+
+			struct msg_data msg = {0};
+			msg.type = BMOV;
+			msg.n_moves = 1 + rand() % 4;
+			for (int k = 0; k < msg.n_moves; k++)
+				msg.moves[k] = UP + rand() % 4;
+
+			// Now and then a player asks to continue the game, which the
+			// server grants dead or not, so revives get exercised too
+			if (rand() % 20 == 0)
+			{
+				memset(&msg, 0, sizeof(msg));
+				msg.type = CONTGAME;
+			}
+
+			if (send(fds[i], &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg))
+				n_moves += msg.n_moves;
+		}
+		usleep(SWARM_TICK_MS * 1000);
+	}
+
+	for (int i = 0; i < n_players; i++)
+	{
+		if (fds[i] != -1)
+			close(fds[i]);
+	}
+
+	printf("%ld joins, %ld moves sent\n", n_joins, n_moves);
+	return 0;
+}
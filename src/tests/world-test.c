@@ -0,0 +1,199 @@
+/* Standard libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../lib/world.h"
+
+// Drives libchase in-process, with no server around it: fills the board,
+// plays games of bots chasing players and checks the rules and the board
+// after every move. Exits non-zero on the first check that fails
+
+#define TICKS 500
+#define N_PLAYERS 20
+#define N_BOTS 10
+#define N_PRIZES 10
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			exit(1); \
+		} \
+	} while (0)
+
+// Seeded so two runs can be compared
+static unsigned int seed;
+
+static int test_rand()
+{
+	seed = seed * 1103515245u + 12345u;
+	return (seed >> 16) & 0x7fff;
+}
+
+static int n_eaten;
+
+static void eaten(int index)
+{
+	n_eaten++;
+}
+
+static void reset(unsigned int new_seed)
+{
+	struct world_hooks hooks = {.changed = NULL, .eaten = eaten, .rand = test_rand};
+
+	seed = new_seed;
+	n_eaten = 0;
+	world_init(&hooks);
+}
+
+// Puts a new ball of a type in the next slot
+static int spawn(int type, int *next_slot)
+{
+	int index = (*next_slot)++;
+
+	ball_info[index] = type == PLAYER ? create_player() : create_ball();
+	if (type == BOT)
+		ball_info[index].ch = '*';
+	set_ball_type(index, type);
+	place_ball(index);
+	return index;
+}
+
+// Every ball is inside the wall, alone in its cell, and the grid has nothing
+// else in it
+static void check_board()
+{
+	int n_balls = 0;
+
+	for (int i = 0; i < MAX_BALLS; i++)
+	{
+		if (ball_type[i] == EMPTY)
+			continue;
+		n_balls++;
+
+		int x = ball_info[i].pos_x, y = ball_info[i].pos_y;
+		CHECK(x >= 1 && x <= WINDOW_SIZE - 2 && y >= 1 && y <= WINDOW_SIZE - 2);
+		CHECK(grid_get(x, y) == i);
+		CHECK(ball_info[i].hp >= 0 && ball_info[i].hp <= MAX_HP);
+	}
+
+	int n_cells = 0;
+	for (int y = 0; y < WINDOW_SIZE; y++)
+		for (int x = 0; x < WINDOW_SIZE; x++)
+			n_cells += grid_get(x, y) != -1;
+	CHECK(n_cells == n_balls);
+	CHECK(n_balls == n_active[PLAYER] + n_active[BOT] + n_active[PRIZE]);
+}
+
+// Every interior cell takes a ball, then there is no free cell left
+static void test_full_board()
+{
+	reset(1);
+	int next_slot = 0;
+
+	for (int i = 0; i < BOARD_CELLS; i++)
+		spawn(i % 3 == 0 ? PLAYER : i % 3 == 1 ? BOT : PRIZE, &next_slot);
+	check_board();
+
+	int x, y;
+	CHECK(!random_free_cell(&x, &y));
+}
+
+// The rules of a single move, on balls put by hand
+static void test_rules()
+{
+	ball_info_t field[MAX_FIELD];
+	reset(2);
+
+	int player = 0, prize = 1, bot = 2;
+
+	ball_info[player] = (ball_info_t){1, 1, 5, 'A'};
+	set_ball_type(player, PLAYER);
+	place_ball(player);
+
+	// The wall stops it and nothing changes
+	CHECK(apply_move(player, UP, field, 0, NULL) == 0);
+	CHECK(apply_move(player, LEFT, field, 0, NULL) == 0);
+	CHECK(ball_info[player].pos_x == 1 && ball_info[player].pos_y == 1);
+
+	// Into a free cell, the field has the old cell and the new one
+	CHECK(apply_move(player, RIGHT, field, 0, NULL) == 2);
+	CHECK(field[0].pos_x == 1 && field[0].ch == ' ');
+	CHECK(field[1].pos_x == 2 && field[1].ch == 'A');
+	CHECK(grid_get(1, 1) == -1 && grid_get(2, 1) == player);
+
+	// A prize is eaten and gives its hp
+	ball_info[prize] = (ball_info_t){3, 1, 4, '4'};
+	set_ball_type(prize, PRIZE);
+	place_ball(prize);
+
+	apply_move(player, RIGHT, field, 0, NULL);
+	CHECK(ball_type[prize] == EMPTY && n_eaten == 1);
+	CHECK(ball_info[player].hp == 9 && grid_get(3, 1) == player);
+
+	// A bot next to the player takes it as its way and steals 1 hp
+	ball_info[bot] = (ball_info_t){3, 2, MAX_HP, '*'};
+	set_ball_type(bot, BOT);
+	place_ball(bot);
+
+	update_chase_flow();
+	CHECK(bot_direction(bot) == UP);
+	apply_move(bot, UP, field, 0, NULL);
+	CHECK(ball_info[player].hp == 8 && ball_info[bot].hp == MAX_HP);
+	CHECK(ball_info[bot].pos_y == 2);
+	check_board();
+}
+
+// A game of bots chasing players that move at random, returns the hash of
+// the board at the end
+static unsigned int play(unsigned int game_seed)
+{
+	ball_info_t field[MAX_FIELD];
+	int next_slot = 0;
+	int players[N_PLAYERS], bots[N_BOTS];
+
+	reset(game_seed);
+	for (int i = 0; i < N_PLAYERS; i++)
+		players[i] = spawn(PLAYER, &next_slot);
+	for (int i = 0; i < N_BOTS; i++)
+		bots[i] = spawn(BOT, &next_slot);
+	for (int i = 0; i < N_PRIZES; i++)
+		spawn(PRIZE, &next_slot);
+	check_board();
+
+	for (int tick = 0; tick < TICKS; tick++)
+	{
+		for (int i = 0; i < N_PLAYERS; i++)
+		{
+			if (ball_type[players[i]] == PLAYER && ball_info[players[i]].hp > 0)
+				apply_move(players[i], test_rand() % 4 + UP, field, 0, NULL);
+		}
+
+		update_chase_flow();
+		for (int i = 0; i < N_BOTS; i++)
+		{
+			direction_t dir = bot_direction(bots[i]);
+			CHECK(dir >= NONE && dir <= RIGHT);
+			apply_move(bots[i], dir, field, 0, NULL);
+		}
+		check_board();
+	}
+
+	// Whatever was eaten is gone from the board
+	CHECK(n_active[PRIZE] == N_PRIZES - n_eaten);
+	return world_hash();
+}
+
+int main()
+{
+	test_full_board();
+	test_rules();
+
+	// Same seed, same game
+	unsigned int hash = play(42);
+	CHECK(play(42) == hash);
+
+	printf("world: ok\n");
+	return 0;
+}